@@ -0,0 +1,371 @@
+// End-to-end lock throughput. N processes contend for M devices through the
+// real lock protocols bundled with the tests (lockdev from tests/lockdev and
+// rxtx from tests/rxtx). Has to run with lockdev-redirect.so preloaded or
+// in the namespace or seccomp mode of the launcher.
+//
+// Every acquisition is checked against a shared owner table, so a lock that
+// was granted to two processes at once is reported as a violation and makes
+// the benchmark fail (except for rxtx, see below). The syscalls per
+// lock/unlock cycle are counted once in an uncontended run under ptrace.
+//
+// Usage: lockbench BUILD PROTOCOL PROCESSES DEVICES SECONDS [MODE]
+//   MODE is only a label for the results (default: preload)
+//
+// Prints one JSON object to stdout.
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/ptrace.h>
+#include <sys/wait.h>
+#include "lockdev.h"
+
+// From tests/rxtx/rxtx_test.c, see rxtx_protocol.c
+int fhs_lock(const char* filename, int pid);
+int fhs_unlock(const char* filename, int openpid);
+
+#define MAX_DEVICES 32
+#define HISTOGRAM_BUCKETS 64
+#define TRACED_CYCLES 100
+
+// Time a lock is held. Long enough for other processes to notice a double
+// grant.
+#define HOLD_NS 20000
+
+struct protocol {
+  const char* name;
+  bool (*lock)(const char* device);
+  bool (*unlock)(const char* device);
+  bool exclusive;   // Violations are errors
+};
+
+// Per process results. Padded to avoid false sharing.
+struct worker_stats {
+  uint64_t acquisitions;
+  uint64_t attempts;
+  uint64_t errors;
+  uint64_t violations;
+  uint64_t max_latency;
+  uint64_t histogram[HISTOGRAM_BUCKETS];    // Latency, log2 of nanoseconds
+} __attribute__ ((aligned (64)));
+
+struct shared {
+  int holders[MAX_DEVICES];
+  struct worker_stats workers[];
+};
+
+static char devices[MAX_DEVICES][PATH_MAX];
+static int device_count;
+
+
+//
+// Protocols
+//
+
+static bool lockdev_lock(const char* device) {
+  return dev_lock(device) == 0;
+}
+
+static bool lockdev_unlock(const char* device) {
+  return dev_unlock(device, getpid()) == 0;
+}
+
+static bool rxtx_lock(const char* device) {
+  return fhs_lock(device, getpid()) == 0;
+}
+
+static bool rxtx_unlock(const char* device) {
+  return fhs_unlock(device, getpid()) == 0;
+}
+
+// rxtx reads the pid from lock files which may not be written yet. It then
+// checks an uninitialized pid for being stale and may remove a fresh lock, so
+// it also has violations without lockdev-redirect. They are only reported.
+static const struct protocol protocols[] = {
+  { "lockdev", lockdev_lock, lockdev_unlock, true },
+  { "rxtx", rxtx_lock, rxtx_unlock, false },
+};
+
+
+//
+// Helpers
+//
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void spin(uint64_t ns) {
+  uint64_t end = now_ns() + ns;
+  while (now_ns() < end)
+    ;
+}
+
+static int log2_bucket(uint64_t value) {
+  int bucket = 0;
+  while (value > 1 && bucket < HISTOGRAM_BUCKETS - 1) {
+    value >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+// Picks character devices to lock. Both protocols need existing devices
+// with distinct device numbers. Serial ports are preferred.
+static void find_devices(int wanted) {
+  const char* prefixes[] = { "ttyS", "" };
+  dev_t seen[MAX_DEVICES];
+  for (size_t p = 0; p < sizeof(prefixes) / sizeof(prefixes[0]) && device_count < wanted; p++) {
+    DIR* dir = opendir("/dev");
+    if (!dir)
+      return;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) && device_count < wanted) {
+      if (strncmp(entry->d_name, prefixes[p], strlen(prefixes[p])) || strchr(entry->d_name, ':'))
+        continue;
+      char path[PATH_MAX];
+      struct stat st;
+      snprintf(path, PATH_MAX, "/dev/%s", entry->d_name);
+      if (stat(path, &st) || !S_ISCHR(st.st_mode))
+        continue;
+      bool duplicate = false;
+      for (int i = 0; i < device_count; i++)
+        duplicate |= seen[i] == st.st_rdev;
+      if (duplicate)
+        continue;
+      seen[device_count] = st.st_rdev;
+      strcpy(devices[device_count++], path);
+    }
+    closedir(dir);
+  }
+}
+
+
+//
+// Contended run
+//
+
+static void worker(const struct protocol* protocol, struct shared* shared, int index, uint64_t deadline) {
+  struct worker_stats* stats = &shared->workers[index];
+  unsigned int seed = getpid();
+
+  // The protocols report every step on stderr
+  int null = open("/dev/null", O_WRONLY);
+  if (null != -1)
+    dup2(null, 2);
+
+  while (now_ns() < deadline) {
+    int device = rand_r(&seed) % device_count;
+    uint64_t start = now_ns();
+    bool locked = false;
+    while (!(locked = protocol->lock(devices[device])) && now_ns() < deadline) {
+      stats->attempts++;
+      sched_yield();
+    }
+    if (!locked)
+      break;
+    stats->attempts++;
+
+    uint64_t latency = now_ns() - start;
+    stats->acquisitions++;
+    stats->histogram[log2_bucket(latency)]++;
+    if (latency > stats->max_latency)
+      stats->max_latency = latency;
+
+    // Nobody else may hold this device now
+    if (__atomic_fetch_add(&shared->holders[device], 1, __ATOMIC_ACQ_REL) != 0)
+      stats->violations++;
+    spin(HOLD_NS);
+    __atomic_fetch_sub(&shared->holders[device], 1, __ATOMIC_ACQ_REL);
+
+    if (!protocol->unlock(devices[device]))
+      stats->errors++;
+  }
+}
+
+// Latency in microseconds below which the given fraction of acquisitions
+// finished. Reports the upper end of the histogram bucket.
+static double percentile(const uint64_t* histogram, uint64_t total, double fraction) {
+  uint64_t wanted = (uint64_t)(total * fraction);
+  uint64_t count = 0;
+  for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++) {
+    count += histogram[bucket];
+    if (count > wanted)
+      return (double)(2ull << bucket) / 1000;
+  }
+  return 0;
+}
+
+
+//
+// Syscall count
+//
+
+// Runs one warm up cycle and "cycles" more lock/unlock cycles in a traced
+// child process.
+// Return value: Number of syscalls. -1 on error.
+static long count_syscalls(const struct protocol* protocol, int cycles) {
+  pid_t pid = fork();
+  if (pid == -1)
+    return -1;
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null != -1)
+      dup2(null, 2);
+    protocol->lock(devices[0]);
+    protocol->unlock(devices[0]);
+    ptrace(PTRACE_TRACEME, 0, NULL, NULL);
+    raise(SIGSTOP);
+    for (int i = 0; i < cycles; i++) {
+      protocol->lock(devices[0]);
+      protocol->unlock(devices[0]);
+    }
+    _exit(0);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) == -1 || !WIFSTOPPED(status))
+    return -1;
+  ptrace(PTRACE_SETOPTIONS, pid, NULL, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL);
+
+  // Every syscall stops twice, on entry and on exit
+  long stops = 0;
+  while (ptrace(PTRACE_SYSCALL, pid, NULL, NULL) == 0 && waitpid(pid, &status, 0) != -1) {
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+      return stops / 2;
+    if (WIFSTOPPED(status) && WSTOPSIG(status) == (SIGTRAP | 0x80))
+      stops++;
+  }
+  return -1;
+}
+
+
+int main(int argc, char* argv[]) {
+  if (argc < 6) {
+    fprintf(stderr, "Usage: %s BUILD PROTOCOL PROCESSES DEVICES SECONDS [MODE]\n", argv[0]);
+    return 1;
+  }
+  const char* build = argv[1];
+  const char* mode = argc > 6 ? argv[6] : "preload";
+  const struct protocol* protocol = NULL;
+  for (size_t i = 0; i < sizeof(protocols) / sizeof(protocols[0]); i++) {
+    if (!strcmp(protocols[i].name, argv[2]))
+      protocol = &protocols[i];
+  }
+  int process_count = atoi(argv[3]);
+  int wanted_devices = atoi(argv[4]);
+  double seconds = atof(argv[5]);
+  if (!protocol || process_count < 1 || wanted_devices < 1 || wanted_devices > MAX_DEVICES || seconds <= 0) {
+    fprintf(stderr, "Invalid arguments\n");
+    return 1;
+  }
+
+  find_devices(wanted_devices);
+  if (device_count < wanted_devices) {
+    fprintf(stderr, "Only found %d of %d character devices to lock\n", device_count, wanted_devices);
+    return 1;
+  }
+
+  // Syscalls of the lock/unlock cycle itself, without the process setup
+  long with_cycles = count_syscalls(protocol, TRACED_CYCLES);
+  long without_cycles = count_syscalls(protocol, 0);
+  double syscalls = (with_cycles < 0 || without_cycles < 0) ? -1 : (double)(with_cycles - without_cycles) / TRACED_CYCLES;
+
+  size_t size = sizeof(struct shared) + process_count * sizeof(struct worker_stats);
+  struct shared* shared = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("mmap");
+    return 1;
+  }
+
+  pid_t* pids = calloc(process_count, sizeof(pid_t));
+  if (!pids)
+    return 1;
+  uint64_t start = now_ns();
+  uint64_t deadline = start + (uint64_t)(seconds * 1e9);
+  for (int i = 0; i < process_count; i++) {
+    pids[i] = fork();
+    if (pids[i] == -1) {
+      perror("fork");
+      return 1;
+    }
+    if (pids[i] == 0) {
+      worker(protocol, shared, i, deadline);
+      _exit(0);
+    }
+  }
+
+  int result = 0;
+  for (int i = 0; i < process_count; i++) {
+    int status;
+    waitpid(pids[i], &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      result = 1;
+    // lockdev leaves its pid files behind
+    char pidfile[PATH_MAX];
+    snprintf(pidfile, PATH_MAX, "/var/lock/LCK...%d", pids[i]);
+    unlink(pidfile);
+  }
+  double elapsed = (now_ns() - start) / 1e9;
+
+  // Fairness: Acquisitions of the least lucky process relative to the
+  // luckiest one
+  struct worker_stats total;
+  memset(&total, 0, sizeof(total));
+  uint64_t min_acquisitions = UINT64_MAX;
+  uint64_t max_acquisitions = 0;
+  for (int i = 0; i < process_count; i++) {
+    const struct worker_stats* stats = &shared->workers[i];
+    if (stats->acquisitions < min_acquisitions)
+      min_acquisitions = stats->acquisitions;
+    if (stats->acquisitions > max_acquisitions)
+      max_acquisitions = stats->acquisitions;
+    total.acquisitions += stats->acquisitions;
+    total.attempts += stats->attempts;
+    total.errors += stats->errors;
+    total.violations += stats->violations;
+    if (stats->max_latency > total.max_latency)
+      total.max_latency = stats->max_latency;
+    for (int bucket = 0; bucket < HISTOGRAM_BUCKETS; bucket++)
+      total.histogram[bucket] += stats->histogram[bucket];
+  }
+
+  printf("{\"build\":\"%s\",\"bench\":\"lock\",\"mode\":\"%s\",\"protocol\":\"%s\",\"processes\":%d,\"devices\":%d,\"seconds\":%.2f",
+         build, mode, protocol->name, process_count, device_count, elapsed);
+  printf(",\"acquisitions\":%llu,\"acquisitions_per_second\":%.1f", (unsigned long long)total.acquisitions, total.acquisitions / elapsed);
+  printf(",\"attempts_per_acquisition\":%.2f", total.acquisitions ? (double)total.attempts / total.acquisitions : 0);
+  printf(",\"latency_us_p50\":%.1f,\"latency_us_p99\":%.1f,\"latency_us_p999\":%.1f,\"latency_us_max\":%.1f",
+         percentile(total.histogram, total.acquisitions, 0.5), percentile(total.histogram, total.acquisitions, 0.99),
+         percentile(total.histogram, total.acquisitions, 0.999), total.max_latency / 1000.0);
+  if (syscalls < 0)
+    printf(",\"syscalls_per_lock\":null");
+  else
+    printf(",\"syscalls_per_lock\":%.1f", syscalls);
+  printf(",\"unlock_errors\":%llu,\"violations\":%llu", (unsigned long long)total.errors, (unsigned long long)total.violations);
+  printf(",\"fairness\":%.2f}\n", max_acquisitions ? (double)min_acquisitions / max_acquisitions : 0);
+
+  // The lock table and the lock broker close the race of rxtx
+  if (total.violations && (protocol->exclusive || strcmp(mode, "mutex") == 0 || strcmp(mode, "broker") == 0)) {
+    fprintf(stderr, "%s: %llu mutual exclusion violations!\n", protocol->name, (unsigned long long)total.violations);
+    result = 1;
+  }
+  if (!total.acquisitions) {
+    fprintf(stderr, "%s: No lock was acquired\n", protocol->name);
+    result = 1;
+  }
+  return result;
+}
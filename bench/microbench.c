@@ -0,0 +1,351 @@
+// Measures the cost of single intercepted calls. Every operation runs in a
+// loop in 1..N threads. Each thread works on its own files in the given
+// directory. Run it once without lockdev-redirect.so, once with it on a
+// non-lock directory (miss path) and once on /var/lock (hit path). See
+// run.sh.
+//
+// Usage: microbench BUILD MODE DIRECTORY THREADS [ITERATIONS]
+//
+// Prints one JSON object per operation to stdout.
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define DEFAULT_ITERATIONS 20000
+
+struct bench_thread {
+  pthread_t thread;
+  char file[PATH_MAX];
+  char other[PATH_MAX];
+  char template[PATH_MAX];
+  bool failed;
+  double ns;
+  double instructions;
+  double cycles;
+};
+
+static const char* directory;
+static long iterations = DEFAULT_ITERATIONS;
+static pthread_barrier_t barrier;
+static void (*current_op)(struct bench_thread*);
+
+
+//
+// Operations. Every operation leaves the files as it found them.
+//
+
+static void op_open(struct bench_thread* t) {
+  int fd = open(t->file, O_RDONLY);
+  if (fd == -1)
+    t->failed = true;
+  else
+    close(fd);
+}
+
+static void op_openat(struct bench_thread* t) {
+  int fd = openat(AT_FDCWD, t->file, O_RDONLY);
+  if (fd == -1)
+    t->failed = true;
+  else
+    close(fd);
+}
+
+static void op_fopen(struct bench_thread* t) {
+  FILE* fp = fopen(t->file, "r");
+  if (!fp)
+    t->failed = true;
+  else
+    fclose(fp);
+}
+
+static void op_creat(struct bench_thread* t) {
+  int fd = creat(t->other, 0644);
+  if (fd == -1 || unlink(t->other))
+    t->failed = true;
+  if (fd != -1)
+    close(fd);
+}
+
+static void op_stat(struct bench_thread* t) {
+  struct stat st;
+  if (stat(t->file, &st))
+    t->failed = true;
+}
+
+// Lock pollers mostly look for lock files that don't exist
+static void op_stat_missing(struct bench_thread* t) {
+  struct stat st;
+  if (stat(t->other, &st) == 0 || errno != ENOENT)
+    t->failed = true;
+}
+
+static void op_lstat(struct bench_thread* t) {
+  struct stat st;
+  if (lstat(t->file, &st))
+    t->failed = true;
+}
+
+static void op_statx(struct bench_thread* t) {
+  struct statx stx;
+  if (statx(AT_FDCWD, t->file, 0, STATX_BASIC_STATS, &stx))
+    t->failed = true;
+}
+
+static void op_access(struct bench_thread* t) {
+  if (access(t->file, R_OK))
+    t->failed = true;
+}
+
+static void op_chmod(struct bench_thread* t) {
+  if (chmod(t->file, S_IRUSR | S_IWUSR))
+    t->failed = true;
+}
+
+static void op_link(struct bench_thread* t) {
+  if (link(t->file, t->other) || unlink(t->other))
+    t->failed = true;
+}
+
+static void op_rename(struct bench_thread* t) {
+  if (rename(t->file, t->other) || rename(t->other, t->file))
+    t->failed = true;
+}
+
+static void op_mkdir(struct bench_thread* t) {
+  if (mkdir(t->other, 0700) || remove(t->other))
+    t->failed = true;
+}
+
+static void op_opendir(struct bench_thread* t) {
+  DIR* dir = opendir(directory);
+  if (!dir)
+    t->failed = true;
+  else
+    closedir(dir);
+}
+
+static void op_mkstemp(struct bench_thread* t) {
+  char template[PATH_MAX];
+  memcpy(template, t->template, PATH_MAX);
+  int fd = mkstemp(template);
+  if (fd == -1 || unlink(template))
+    t->failed = true;
+  if (fd != -1)
+    close(fd);
+}
+
+static void op_mktemp(struct bench_thread* t) {
+  char template[PATH_MAX];
+  memcpy(template, t->template, PATH_MAX);
+  if (!mktemp(template)[0])
+    t->failed = true;
+}
+
+static const struct {
+  const char* name;
+  void (*func)(struct bench_thread*);
+} ops[] = {
+  { "open", op_open },
+  { "openat", op_openat },
+  { "fopen", op_fopen },
+  { "creat", op_creat },
+  { "stat", op_stat },
+  { "stat_missing", op_stat_missing },
+  { "lstat", op_lstat },
+  { "statx", op_statx },
+  { "access", op_access },
+  { "chmod", op_chmod },
+  { "link", op_link },
+  { "rename", op_rename },
+  { "mkdir", op_mkdir },
+  { "opendir", op_opendir },
+  { "mkstemp", op_mkstemp },
+  { "mktemp", op_mktemp },
+};
+
+
+//
+// Hardware counters
+//
+
+// Opens an instruction and a cycle counter for the calling thread as one
+// group. Only user space is counted, which is where lockdev-redirect runs.
+// Return value: Group leader descriptor. -1 if not available.
+static int perf_open(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  attr.read_format = PERF_FORMAT_GROUP;
+  int leader = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+  if (leader == -1)
+    return -1;
+
+  attr.config = PERF_COUNT_HW_CPU_CYCLES;
+  attr.disabled = 0;
+  if (syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC) == -1) {
+    close(leader);
+    return -1;
+  }
+  return leader;
+}
+
+// Reads both counters of a group
+static bool perf_read(int leader, uint64_t* instructions, uint64_t* cycles) {
+  uint64_t values[3];
+  if (read(leader, values, sizeof(values)) != sizeof(values) || values[0] != 2)
+    return false;
+  *instructions = values[1];
+  *cycles = values[2];
+  return true;
+}
+
+
+//
+// Benchmark driver
+//
+
+static double now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void* thread_main(void* arg) {
+  struct bench_thread* t = arg;
+  void (*op)(struct bench_thread*) = current_op;
+  long count = iterations;
+
+  // Warm up: Lazy symbol binding, lock root setup, dentry cache
+  for (long i = 0; i < count / 10 + 1; i++)
+    op(t);
+
+  int leader = perf_open();
+  pthread_barrier_wait(&barrier);
+
+  if (leader != -1)
+    ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+  double start = now_ns();
+  for (long i = 0; i < count; i++)
+    op(t);
+  double end = now_ns();
+  if (leader != -1)
+    ioctl(leader, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+
+  t->ns = (end - start) / count;
+  t->instructions = -1;
+  t->cycles = -1;
+  uint64_t instructions, cycles;
+  if (leader != -1 && perf_read(leader, &instructions, &cycles)) {
+    t->instructions = (double)instructions / count;
+    t->cycles = (double)cycles / count;
+  }
+  if (leader != -1)
+    close(leader);
+  return NULL;
+}
+
+// Prints a per call value or null if it was not measured
+static void print_value(const char* name, double value) {
+  if (value < 0)
+    printf(",\"%s\":null", name);
+  else
+    printf(",\"%s\":%.1f", name, value);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 5) {
+    fprintf(stderr, "Usage: %s BUILD MODE DIRECTORY THREADS [ITERATIONS]\n", argv[0]);
+    return 1;
+  }
+  const char* build = argv[1];
+  const char* mode = argv[2];
+  directory = argv[3];
+  int thread_count = atoi(argv[4]);
+  if (argc > 5)
+    iterations = atol(argv[5]);
+  if (thread_count < 1 || iterations < 1) {
+    fprintf(stderr, "Invalid thread count or iterations\n");
+    return 1;
+  }
+
+  struct bench_thread* threads = calloc(thread_count, sizeof(struct bench_thread));
+  if (!threads)
+    return 1;
+
+  // Every thread gets its own file to work on
+  for (int i = 0; i < thread_count; i++) {
+    struct bench_thread* t = &threads[i];
+    snprintf(t->file, PATH_MAX, "%s/lockdev-redirect-bench-%d-%d.tmp", directory, getpid(), i);
+    snprintf(t->other, PATH_MAX, "%s/lockdev-redirect-bench-%d-%d.new", directory, getpid(), i);
+    snprintf(t->template, PATH_MAX, "%s/lockdev-redirect-bench-XXXXXX", directory);
+    int fd = open(t->file, O_CREAT | O_WRONLY, 0644);
+    if (fd == -1) {
+      fprintf(stderr, "Can't create %s: %s\n", t->file, strerror(errno));
+      return 1;
+    }
+    close(fd);
+  }
+
+  int result = 0;
+  for (size_t op = 0; op < sizeof(ops) / sizeof(ops[0]); op++) {
+    current_op = ops[op].func;
+    pthread_barrier_init(&barrier, NULL, thread_count);
+    for (int i = 0; i < thread_count; i++) {
+      if (pthread_create(&threads[i].thread, NULL, thread_main, &threads[i])) {
+        fprintf(stderr, "pthread_create failed\n");
+        return 1;
+      }
+    }
+
+    double ns = 0, instructions = 0, cycles = 0;
+    bool failed = false;
+    for (int i = 0; i < thread_count; i++) {
+      pthread_join(threads[i].thread, NULL);
+      ns += threads[i].ns;
+      instructions = (instructions < 0 || threads[i].instructions < 0) ? -1 : instructions + threads[i].instructions;
+      cycles = (cycles < 0 || threads[i].cycles < 0) ? -1 : cycles + threads[i].cycles;
+      failed |= threads[i].failed;
+      threads[i].failed = false;
+    }
+    pthread_barrier_destroy(&barrier);
+
+    if (failed) {
+      fprintf(stderr, "%s: %s failed in %s\n", mode, ops[op].name, directory);
+      result = 1;
+      continue;
+    }
+
+    printf("{\"build\":\"%s\",\"bench\":\"micro\",\"mode\":\"%s\",\"op\":\"%s\",\"threads\":%d,\"iterations\":%ld",
+           build, mode, ops[op].name, thread_count, iterations);
+    print_value("ns_per_call", ns / thread_count);
+    print_value("instructions_per_call", instructions < 0 ? -1 : instructions / thread_count);
+    print_value("cycles_per_call", cycles < 0 ? -1 : cycles / thread_count);
+    printf("}\n");
+    fflush(stdout);
+  }
+
+  for (int i = 0; i < thread_count; i++)
+    unlink(threads[i].file);
+  free(threads);
+  return result;
+}
@@ -0,0 +1,435 @@
+// Replays a file recorded with LOCKDEV_REDIRECT_CAPTURE. Every recorded call
+// is issued again with the recorded arguments, so the lock workload of a
+// real application can be measured without the application. Run it with
+// lockdev-redirect.so preloaded and a fresh XDG_RUNTIME_DIR, see run.sh.
+//
+// Usage: replay BUILD FILE [-p] [-r REPEAT]
+//   -p  Keep the recorded pacing instead of replaying at full speed
+//   -r  Replay the whole capture REPEAT times
+//
+// All calls are issued from one thread in recorded order, even if they
+// came from several processes or threads. Descriptors are mapped from the
+// recorded to the replayed ones. Buffers the application passed (like the
+// "struct stat" of stat) are replaced by our own. Prints one JSON object
+// per function and one for all calls to stdout. "divergent" counts calls
+// which failed or succeeded other than recorded.
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "../capture_file.h"
+
+#define MAX_FDS 4096
+
+// One recorded process and its descriptors
+struct replay_process {
+  int pid;
+  int fds[MAX_FDS];   // Replayed descriptor + 1 for every recorded one
+};
+
+struct replay_function {
+  const char* name;
+  int64_t (*func)(const struct lock_capture_record* record, struct replay_process* process);
+  uint64_t calls;
+  uint64_t ns;
+};
+
+static struct replay_process* processes = NULL;
+static size_t process_count = 0;
+
+
+//
+// Access to recorded arguments
+//
+
+static int64_t arg(const struct lock_capture_record* record, unsigned int index) {
+  return index < record->arg_count ? record->args[index] : 0;
+}
+
+static const char* string_arg(const struct lock_capture_record* record, unsigned int index) {
+  if (index >= record->arg_count || record->arg_kinds[index] != LOCK_CAPTURE_ARG_STRING)
+    return "";
+  return (const char*)record + record->args[index];
+}
+
+// Maps a recorded descriptor to the replayed one. AT_FDCWD stays.
+static int map_fd(struct replay_process* process, int64_t fd) {
+  if (fd == AT_FDCWD)
+    return AT_FDCWD;
+  if (fd < 0 || fd >= MAX_FDS || !process->fds[fd])
+    return -1;
+  return process->fds[fd] - 1;
+}
+
+static void add_fd(struct replay_process* process, int64_t recorded, int64_t replayed) {
+  if (recorded >= 0 && recorded < MAX_FDS && replayed >= 0)
+    process->fds[recorded] = replayed + 1;
+}
+
+// mkstemp and mktemp were recorded with the generated name
+static void restore_template(char* buffer, const char* name) {
+  snprintf(buffer, PATH_MAX, "%s", name);
+  size_t len = strlen(buffer);
+  if (len >= 6)
+    memset(buffer + len - 6, 'X', 6);
+}
+
+
+//
+// Replay of the single functions. Return value: -1 on failure
+//
+
+static int64_t replay_open(const struct lock_capture_record* r, struct replay_process* p) {
+  int fd = open(string_arg(r, 0), arg(r, 1), (mode_t)arg(r, 2));
+  add_fd(p, r->result, fd);
+  return fd;
+}
+
+static int64_t replay_openat(const struct lock_capture_record* r, struct replay_process* p) {
+  int fd = openat(map_fd(p, arg(r, 0)), string_arg(r, 1), arg(r, 2), (mode_t)arg(r, 3));
+  add_fd(p, r->result, fd);
+  return fd;
+}
+
+static int64_t replay_creat(const struct lock_capture_record* r, struct replay_process* p) {
+  int fd = creat(string_arg(r, 0), arg(r, 1));
+  add_fd(p, r->result, fd);
+  return fd;
+}
+
+// fclose is not intercepted, so the stream is closed right away
+static int64_t replay_fopen(const struct lock_capture_record* r, struct replay_process* p) {
+  FILE* fp = fopen(string_arg(r, 0), string_arg(r, 1));
+  if (fp)
+    fclose(fp);
+  return fp ? 0 : -1;
+}
+
+static int64_t replay_unlink(const struct lock_capture_record* r, struct replay_process* p) {
+  return unlink(string_arg(r, 0));
+}
+
+static int64_t replay_rmdir(const struct lock_capture_record* r, struct replay_process* p) {
+  return rmdir(string_arg(r, 0));
+}
+
+static int64_t replay_remove(const struct lock_capture_record* r, struct replay_process* p) {
+  return remove(string_arg(r, 0));
+}
+
+static int64_t replay_mktemp(const struct lock_capture_record* r, struct replay_process* p) {
+  char template[PATH_MAX];
+  restore_template(template, string_arg(r, 0));
+  return mktemp(template)[0] ? 0 : -1;
+}
+
+static int64_t replay_mkstemp(const struct lock_capture_record* r, struct replay_process* p) {
+  char template[PATH_MAX];
+  restore_template(template, string_arg(r, 0));
+  int fd = mkstemp(template);
+  add_fd(p, r->result, fd);
+  return fd;
+}
+
+// The stat family is replayed with stat and lstat. The __xstat variants
+// are not linkable with current glibc.
+static int64_t replay_stat(const struct lock_capture_record* r, struct replay_process* p) {
+  struct stat st;
+  return stat(string_arg(r, 0), &st);
+}
+
+static int64_t replay_xstat(const struct lock_capture_record* r, struct replay_process* p) {
+  struct stat st;
+  return stat(string_arg(r, 1), &st);
+}
+
+static int64_t replay_lstat(const struct lock_capture_record* r, struct replay_process* p) {
+  struct stat st;
+  return lstat(string_arg(r, 0), &st);
+}
+
+static int64_t replay_lxstat(const struct lock_capture_record* r, struct replay_process* p) {
+  struct stat st;
+  return lstat(string_arg(r, 1), &st);
+}
+
+static int64_t replay_statx(const struct lock_capture_record* r, struct replay_process* p) {
+  struct statx stx;
+  return statx(map_fd(p, arg(r, 0)), string_arg(r, 1), arg(r, 2), arg(r, 3), &stx);
+}
+
+static int64_t replay_access(const struct lock_capture_record* r, struct replay_process* p) {
+  return access(string_arg(r, 0), arg(r, 1));
+}
+
+static int64_t replay_faccessat(const struct lock_capture_record* r, struct replay_process* p) {
+  return faccessat(map_fd(p, arg(r, 0)), string_arg(r, 1), arg(r, 2), arg(r, 3));
+}
+
+static int64_t replay_chmod(const struct lock_capture_record* r, struct replay_process* p) {
+  return chmod(string_arg(r, 0), arg(r, 1));
+}
+
+static int64_t replay_mkdir(const struct lock_capture_record* r, struct replay_process* p) {
+  return mkdir(string_arg(r, 0), arg(r, 1));
+}
+
+static int64_t replay_link(const struct lock_capture_record* r, struct replay_process* p) {
+  return link(string_arg(r, 0), string_arg(r, 1));
+}
+
+static int64_t replay_rename(const struct lock_capture_record* r, struct replay_process* p) {
+  return rename(string_arg(r, 0), string_arg(r, 1));
+}
+
+static int64_t replay_linkat(const struct lock_capture_record* r, struct replay_process* p) {
+  return linkat(map_fd(p, arg(r, 0)), string_arg(r, 1), map_fd(p, arg(r, 2)), string_arg(r, 3), arg(r, 4));
+}
+
+static int64_t replay_renameat2(const struct lock_capture_record* r, struct replay_process* p) {
+  return renameat2(map_fd(p, arg(r, 0)), string_arg(r, 1), map_fd(p, arg(r, 2)), string_arg(r, 3), arg(r, 4));
+}
+
+static int64_t replay_opendir(const struct lock_capture_record* r, struct replay_process* p) {
+  DIR* dir = opendir(string_arg(r, 0));
+  if (dir)
+    closedir(dir);
+  return dir ? 0 : -1;
+}
+
+static int64_t replay_scandir(const struct lock_capture_record* r, struct replay_process* p) {
+  struct dirent** list;
+  int count = scandir(string_arg(r, 0), &list, NULL, NULL);
+  for (int i = 0; i < count; i++)
+    free(list[i]);
+  if (count >= 0)
+    free(list);
+  return count;
+}
+
+static int64_t replay_close(const struct lock_capture_record* r, struct replay_process* p) {
+  int fd = map_fd(p, arg(r, 0));
+  if (fd >= 0)
+    p->fds[arg(r, 0)] = 0;
+  return close(fd);
+}
+
+// Also used for fcntl, which is only captured for F_DUPFD and
+// F_DUPFD_CLOEXEC
+static int64_t replay_dup(const struct lock_capture_record* r, struct replay_process* p) {
+  int result = dup(map_fd(p, arg(r, 0)));
+  add_fd(p, r->result, result);
+  return result;
+}
+
+// The recorded target descriptor may be in use here. Duplicate to a free
+// one first, so dup2 can't close one of ours.
+static int64_t replay_dup2(const struct lock_capture_record* r, struct replay_process* p) {
+  int fd = map_fd(p, arg(r, 0));
+  int target = fd >= 0 ? dup(fd) : -1;
+  int result = dup2(fd, target);
+  add_fd(p, r->result, result);
+  return result;
+}
+
+static struct replay_function functions[] = {
+  { "open", replay_open }, { "open64", replay_open }, { "__open_2", replay_open }, { "__open64_2", replay_open },
+  { "openat", replay_openat }, { "openat64", replay_openat }, { "__openat_2", replay_openat }, { "__openat64_2", replay_openat },
+  { "creat", replay_creat }, { "creat64", replay_creat },
+  { "fopen", replay_fopen }, { "fopen64", replay_fopen },
+  { "unlink", replay_unlink }, { "remove", replay_remove },
+  { "mktemp", replay_mktemp }, { "mkstemp", replay_mkstemp }, { "mkstemp64", replay_mkstemp },
+  { "stat", replay_stat }, { "stat64", replay_stat }, { "__xstat", replay_xstat }, { "__xstat64", replay_xstat },
+  { "lstat", replay_lstat }, { "lstat64", replay_lstat }, { "__lxstat", replay_lxstat }, { "__lxstat64", replay_lxstat },
+  { "statx", replay_statx }, { "access", replay_access }, { "faccessat", replay_faccessat },
+  { "chmod", replay_chmod }, { "mkdir", replay_mkdir }, { "rmdir", replay_rmdir },
+  { "link", replay_link }, { "linkat", replay_linkat }, { "rename", replay_rename }, { "renameat2", replay_renameat2 },
+  { "opendir", replay_opendir }, { "scandir", replay_scandir }, { "scandir64", replay_scandir },
+  { "close", replay_close }, { "dup", replay_dup }, { "dup2", replay_dup2 }, { "dup3", replay_dup2 },
+  { "fcntl", replay_dup }, { "fcntl64", replay_dup },
+};
+#define FUNCTION_COUNT (sizeof(functions) / sizeof(functions[0]))
+
+
+//
+// Replay driver
+//
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static struct replay_process* get_process(int pid) {
+  for (size_t i = 0; i < process_count; i++)
+    if (processes[i].pid == pid)
+      return &processes[i];
+  struct replay_process* new_processes = realloc(processes, (process_count + 1) * sizeof(struct replay_process));
+  if (!new_processes)
+    return NULL;
+  processes = new_processes;
+  memset(&processes[process_count], 0, sizeof(struct replay_process));
+  processes[process_count].pid = pid;
+  return &processes[process_count++];
+}
+
+// Closes what the application left open, so the next round starts clean
+static void close_all(void) {
+  for (size_t i = 0; i < process_count; i++) {
+    for (int fd = 0; fd < MAX_FDS; fd++) {
+      if (processes[i].fds[fd])
+        close(processes[i].fds[fd] - 1);
+    }
+  }
+  process_count = 0;
+}
+
+// Reads the capture file and checks all record headers
+// Return value: Buffer holding the records. NULL on error.
+static char* load_capture(const char* path, size_t* size, size_t* count) {
+  FILE* fp = fopen(path, "r");
+  if (!fp) {
+    fprintf(stderr, "Can't open %s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+  fseek(fp, 0, SEEK_END);
+  long len = ftell(fp);
+  rewind(fp);
+  char* buffer = len > 0 ? malloc(len) : NULL;
+  if (!buffer || fread(buffer, 1, len, fp) != (size_t)len) {
+    fprintf(stderr, "Can't read %s\n", path);
+    fclose(fp);
+    free(buffer);
+    return NULL;
+  }
+  fclose(fp);
+
+  *count = 0;
+  for (size_t pos = 0; pos < (size_t)len; ) {
+    const struct lock_capture_record* record = (const struct lock_capture_record*)(buffer + pos);
+    if ((size_t)len - pos < sizeof(struct lock_capture_record) || record->magic != LOCK_CAPTURE_MAGIC ||
+        record->version != LOCK_CAPTURE_VERSION || record->size > (size_t)len - pos ||
+        record->size < sizeof(struct lock_capture_record) + record->arg_count * sizeof(int64_t) ||
+        record->arg_count > LOCK_CAPTURE_ARGS || record->size % 8) {
+      fprintf(stderr, "%s: Invalid record at offset %zu\n", path, pos);
+      free(buffer);
+      return NULL;
+    }
+    for (unsigned int i = 0; i < record->arg_count; i++) {
+      if (record->arg_kinds[i] == LOCK_CAPTURE_ARG_STRING &&
+          (record->args[i] < 0 || record->args[i] >= record->size || !memchr((const char*)record + record->args[i], '\0', record->size - record->args[i]))) {
+        fprintf(stderr, "%s: Invalid string in record at offset %zu\n", path, pos);
+        free(buffer);
+        return NULL;
+      }
+    }
+    pos += record->size;
+    (*count)++;
+  }
+  *size = len;
+  return buffer;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s BUILD FILE [-p] [-r REPEAT]\n", argv[0]);
+    return 1;
+  }
+  const char* build = argv[1];
+  const char* path = argv[2];
+  bool paced = false;
+  long repeat = 1;
+  for (int i = 3; i < argc; i++) {
+    if (strcmp(argv[i], "-p") == 0)
+      paced = true;
+    else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc)
+      repeat = atol(argv[++i]);
+    else {
+      fprintf(stderr, "Unknown argument %s\n", argv[i]);
+      return 1;
+    }
+  }
+  if (repeat < 1) {
+    fprintf(stderr, "Invalid repeat count\n");
+    return 1;
+  }
+
+  size_t size, count;
+  char* buffer = load_capture(path, &size, &count);
+  if (!buffer)
+    return 1;
+  const char* name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+
+  uint64_t divergent = 0, skipped = 0, total_calls = 0;
+  uint64_t start = now_ns();
+  for (long round = 0; round < repeat; round++) {
+    uint64_t round_start = now_ns();
+    uint64_t first_time = count ? ((const struct lock_capture_record*)buffer)->time_ns : 0;
+    for (size_t pos = 0; pos < size; ) {
+      const struct lock_capture_record* record = (const struct lock_capture_record*)(buffer + pos);
+      pos += record->size;
+
+      struct replay_function* function = NULL;
+      for (size_t i = 0; i < FUNCTION_COUNT; i++) {
+        if (strncmp(functions[i].name, record->function, sizeof(record->function)) == 0) {
+          function = &functions[i];
+          break;
+        }
+      }
+      struct replay_process* process = get_process(record->pid);
+      if (!function || !process) {
+        skipped++;
+        continue;
+      }
+
+      if (paced) {
+        uint64_t due = round_start + (record->time_ns - first_time);
+        struct timespec ts = { due / 1000000000ull, due % 1000000000ull };
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+      }
+
+      errno = 0;
+      uint64_t call_start = now_ns();
+      bool failed = function->func(record, process) < 0;
+      uint64_t call_end = now_ns();
+      int error = errno;
+      function->calls++;
+      function->ns += call_end - call_start;
+      total_calls++;
+
+      // errno is only meaningful after a failure
+      bool recorded_failed = record->flags & LOCK_CAPTURE_FAILED;
+      if (failed != recorded_failed || (failed && error != record->error))
+        divergent++;
+    }
+    close_all();
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  uint64_t call_ns = 0;
+  for (size_t i = 0; i < FUNCTION_COUNT; i++) {
+    if (!functions[i].calls)
+      continue;
+    call_ns += functions[i].ns;
+    printf("{\"build\":\"%s\",\"bench\":\"replay\",\"capture\":\"%s\",\"pacing\":\"%s\",\"function\":\"%s\",\"calls\":%llu,\"ns_per_call\":%.1f}\n",
+           build, name, paced ? "recorded" : "fast", functions[i].name, (unsigned long long)functions[i].calls,
+           (double)functions[i].ns / functions[i].calls);
+  }
+  printf("{\"build\":\"%s\",\"bench\":\"replay\",\"capture\":\"%s\",\"pacing\":\"%s\",\"function\":\"all\",\"calls\":%llu,\"ns_per_call\":%.1f,\"seconds\":%.3f,\"divergent\":%llu,\"skipped\":%llu}\n",
+         build, name, paced ? "recorded" : "fast", (unsigned long long)total_calls,
+         total_calls ? (double)call_ns / total_calls : 0.0, elapsed / 1e9, (unsigned long long)divergent,
+         (unsigned long long)skipped);
+  free(buffer);
+  return 0;
+}
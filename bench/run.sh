@@ -0,0 +1,156 @@
+#!/bin/bash
+
+set -e
+
+# Runs the microbenchmarks in four modes:
+#   none:   Without lockdev-redirect.so on a non-lock directory
+#   miss:   With lockdev-redirect.so on a non-lock directory
+#   hit:    With lockdev-redirect.so on /var/lock
+#   direct: Without lockdev-redirect.so on the redirect target
+#   trace:  Like "hit" with LOCKDEV_REDIRECT_TRACE enabled
+#   ns:     Without lockdev-redirect.so on /var/lock in the namespace mode
+#           of the launcher (skipped if user namespaces are not available)
+#   scmiss: In the seccomp mode of the launcher on a non-lock directory
+#   sc:     In the seccomp mode of the launcher on /var/lock (both skipped
+#           if seccomp user notifications are not available)
+# "miss" minus "none" is what we cost every application, "hit" minus
+# "direct" is the cost of the redirect itself. "trace" minus "hit" is the
+# cost of one trace record. "ns" should be the same as "direct". "scmiss"
+# minus "none" is the cost of a round trip through the supervisor.
+#
+# Then the lock throughput benchmark runs the lockdev and rxtx protocols
+# with 1..N contending processes on the same set of devices, with the
+# preload library, with its lock table (LOCKDEV_REDIRECT_MUTEX=1), with
+# the lock broker (LOCKDEV_REDIRECT_BROKER=1) and in the namespace and
+# seccomp modes.
+#
+# Finally every file in BENCH_REPLAY, recorded with
+# LOCKDEV_REDIRECT_CAPTURE, is replayed as fast as possible.
+#
+# Environment:
+#   BENCH_THREADS     Highest thread count (default: number of CPUs)
+#   BENCH_ITERATIONS  Calls per operation and thread (default: 20000)
+#   BENCH_PROCESSES   Process counts for the lock benchmark (default: 1 4 16)
+#   BENCH_DEVICES     Devices to lock (default: 4)
+#   BENCH_SECONDS     Duration of every lock benchmark run (default: 2)
+#   BENCH_REPLAY      Capture files to replay (default: none)
+#   BENCH_REPEAT      Rounds per replay (default: 10)
+#   BENCH_BUILD       Label for the results (default: git revision)
+#   BENCH_OUTPUT      Result file, one JSON object per line
+#                     (default: bench_output.txt in the source directory)
+
+TOPDIR="$(cd .. && pwd)"
+LIBRARY="$TOPDIR/lockdev-redirect.so"
+NAMESPACE="$TOPDIR/lockdev-redirect-ns --no-fallback"
+SECCOMP="$TOPDIR/lockdev-redirect-seccomp --no-fallback"
+BROKER="env -u LD_PRELOAD $TOPDIR/lockdev-redirectd"
+THREADS="${BENCH_THREADS:-$(nproc)}"
+ITERATIONS="${BENCH_ITERATIONS:-20000}"
+PROCESSES="${BENCH_PROCESSES:-1 4 16}"
+DEVICES="${BENCH_DEVICES:-4}"
+SECONDS_PER_RUN="${BENCH_SECONDS:-2}"
+REPEAT="${BENCH_REPEAT:-10}"
+BUILD="${BENCH_BUILD:-$(git -C "$TOPDIR" describe --always --dirty 2>/dev/null || echo unknown)}"
+OUTPUT="${BENCH_OUTPUT:-$TOPDIR/bench_output.txt}"
+
+if [ -z "$XDG_RUNTIME_DIR" ]; then
+  echo "XDG_RUNTIME_DIR is not set!"
+  exit 1
+fi
+
+MODES="preload mutex"
+if $NAMESPACE true 2>/dev/null; then
+  MODES="$MODES ns"
+else
+  echo "User namespaces not available, skipping the namespace mode"
+fi
+if $SECCOMP true 2>/dev/null; then
+  MODES="$MODES sc"
+else
+  echo "Seccomp user notifications not available, skipping the seccomp mode"
+fi
+
+MISSDIR="$(mktemp -d)"
+TRACEDIR="$(mktemp -d)"
+trap 'rm -rf "$MISSDIR" "$TRACEDIR"' EXIT
+
+# Thread counts: Powers of two up to and including $THREADS
+COUNTS=""
+for ((n = 1; n < THREADS; n *= 2)); do COUNTS="$COUNTS $n"; done
+COUNTS="$COUNTS $THREADS"
+
+: > "$OUTPUT"
+for threads in $COUNTS; do
+  ./microbench "$BUILD" none "$MISSDIR" $threads $ITERATIONS >> "$OUTPUT"
+  LD_PRELOAD="$LIBRARY" ./microbench "$BUILD" miss "$MISSDIR" $threads $ITERATIONS >> "$OUTPUT"
+  LD_PRELOAD="$LIBRARY" ./microbench "$BUILD" hit /var/lock $threads $ITERATIONS >> "$OUTPUT"
+  ./microbench "$BUILD" direct "$XDG_RUNTIME_DIR/lock" $threads $ITERATIONS >> "$OUTPUT"
+  LD_PRELOAD="$LIBRARY" LOCKDEV_REDIRECT_TRACE="$TRACEDIR" ./microbench "$BUILD" trace /var/lock $threads $ITERATIONS >> "$OUTPUT"
+  rm -f "$TRACEDIR"/*.trace
+  if [[ " $MODES " == *" ns "* ]]; then
+    $NAMESPACE ./microbench "$BUILD" ns /var/lock $threads $ITERATIONS >> "$OUTPUT"
+  fi
+  if [[ " $MODES " == *" sc "* ]]; then
+    $SECCOMP ./microbench "$BUILD" scmiss "$MISSDIR" $threads $ITERATIONS >> "$OUTPUT"
+    $SECCOMP ./microbench "$BUILD" sc /var/lock $threads $ITERATIONS >> "$OUTPUT"
+  fi
+done
+
+# Short summary: ns per call for each mode
+echo "threads op none miss hit direct trace ns scmiss sc" | awk '{ printf "%-8s %-12s %10s %10s %10s %10s %10s %10s %10s %10s\n", $1, $2, $3, $4, $5, $6, $7, $8, $9, $10 }'
+grep '"bench":"micro"' "$OUTPUT" | sed -e 's/.*"mode":"\([a-z]*\)","op":"\([a-z0-9_]*\)","threads":\([0-9]*\),.*"ns_per_call":\([0-9.]*\).*/\3 \2 \1 \4/' | \
+  awk '{ key = $1 " " $2; if (!(key in seen)) { seen[key] = 1; keys[n++] = key } ns[key, $3] = $4 }
+       END { for (i = 0; i < n; i++) { split(keys[i], k, " ")
+             printf "%-8s %-12s %10s %10s %10s %10s %10s %10s %10s %10s\n", k[1], k[2], ns[keys[i], "none"], ns[keys[i], "miss"], ns[keys[i], "hit"], ns[keys[i], "direct"], ns[keys[i], "trace"], ns[keys[i], "ns"], ns[keys[i], "scmiss"], ns[keys[i], "sc"] } }'
+echo
+
+# Lock throughput. Fails if a lock was ever granted twice.
+LOCK_MODES="$MODES"
+if $BROKER --start; then
+  LOCK_MODES="$LOCK_MODES broker"
+else
+  echo "Lock broker not started, skipping the broker mode"
+fi
+for mode in $LOCK_MODES; do
+  for protocol in lockdev rxtx; do
+    for processes in $PROCESSES; do
+      if [ "$mode" = ns ]; then
+        $NAMESPACE ./lockbench "$BUILD" $protocol $processes $DEVICES $SECONDS_PER_RUN ns >> "$OUTPUT"
+      elif [ "$mode" = sc ]; then
+        $SECCOMP ./lockbench "$BUILD" $protocol $processes $DEVICES $SECONDS_PER_RUN sc >> "$OUTPUT"
+      elif [ "$mode" = broker ]; then
+        # The daemon exits when idle
+        $BROKER --start
+        LD_PRELOAD="$LIBRARY" LOCKDEV_REDIRECT_BROKER=1 ./lockbench "$BUILD" $protocol $processes $DEVICES $SECONDS_PER_RUN broker >> "$OUTPUT"
+      elif [ "$mode" = mutex ]; then
+        LD_PRELOAD="$LIBRARY" LOCKDEV_REDIRECT_MUTEX=1 ./lockbench "$BUILD" $protocol $processes $DEVICES $SECONDS_PER_RUN mutex >> "$OUTPUT"
+      else
+        LD_PRELOAD="$LIBRARY" ./lockbench "$BUILD" $protocol $processes $DEVICES $SECONDS_PER_RUN >> "$OUTPUT"
+      fi
+    done
+  done
+done
+$BROKER --stop
+
+echo "mode protocol processes locks/s p50(us) p99(us) syscalls/lock fairness" | awk '{ printf "%-8s %-8s %9s %10s %10s %10s %14s %9s\n", $1, $2, $3, $4, $5, $6, $7, $8 }'
+grep '"bench":"lock"' "$OUTPUT" | \
+  sed -e 's/.*"mode":"\([a-z]*\)","protocol":"\([a-z]*\)","processes":\([0-9]*\),.*"acquisitions_per_second":\([0-9.]*\),.*"latency_us_p50":\([0-9.]*\),"latency_us_p99":\([0-9.]*\),.*"syscalls_per_lock":\([0-9.a-z]*\),.*"fairness":\([0-9.]*\).*/\1 \2 \3 \4 \5 \6 \7 \8/' | \
+  awk '{ printf "%-8s %-8s %9s %10s %10s %10s %14s %9s\n", $1, $2, $3, $4, $5, $6, $7, $8 }'
+echo
+
+# Replays of real application workloads. Every replay gets its own lock
+# directory, so it finds the same state as the recorded application.
+if [ -n "$BENCH_REPLAY" ]; then
+  echo "capture calls ns/call divergent"  | awk '{ printf "%-24s %10s %10s %10s\n", $1, $2, $3, $4 }'
+  for capture in $BENCH_REPLAY; do
+    REPLAYDIR="$(mktemp -d)"
+    XDG_RUNTIME_DIR="$REPLAYDIR" LD_PRELOAD="$LIBRARY" ./replay "$BUILD" "$capture" -r $REPEAT >> "$OUTPUT"
+    rm -rf "$REPLAYDIR"
+  done
+  grep '"bench":"replay".*"function":"all"' "$OUTPUT" | \
+    sed -e 's/.*"capture":"\([^"]*\)",.*"calls":\([0-9]*\),"ns_per_call":\([0-9.]*\),.*"divergent":\([0-9]*\),.*/\1 \2 \3 \4/' | \
+    awk '{ printf "%-24s %10s %10s %10s\n", $1, $2, $3, $4 }'
+  echo
+fi
+
+echo "Results written to $OUTPUT"
@@ -0,0 +1,3 @@
+// The rxtx lock protocol as copied to tests/rxtx, without its test driver
+#define main rxtx_test_main
+#include "../tests/rxtx/rxtx_test.c"
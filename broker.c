@@ -0,0 +1,315 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "utilities.h"
+#include "symbols.h"
+#include "broker_protocol.h"
+
+/*
+ Lock broker client
+ With LOCKDEV_REDIRECT_BROKER=1 exclusive creations and removals of lock
+ files ("LCK." prefix) go through lockdev-redirectd, which queues processes
+ waiting for busy locks and removes the lock files of exited owners. Every
+ process opens its own connection on first use. If the daemon isn't
+ running, or stops answering, the file protocol is used on its own and the
+ daemon is tried again after RETRY_MS.
+
+ The threads of a process share the connection. broker_mutex is only held
+ to send a request, never while waiting for the daemon. One of the waiting
+ threads receives the replies for all of them and hands them out by id.
+*/
+
+#define RETRY_MS 1000
+
+// LOCKDEV_REDIRECT_BROKER=1
+__attribute__ ((visibility ("hidden"))) bool _broker_enabled = false;
+
+// A request waiting for its reply
+struct pending_request {
+  uint32_t id;
+  bool done;
+  int result;
+  struct pending_request* next;
+};
+
+static struct sockaddr_un address;
+static pthread_mutex_t broker_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t broker_cond = PTHREAD_COND_INITIALIZER;
+// All below are protected by broker_mutex
+static int broker_fd = -1;
+static int orphan_fd = -1;         // Given up while a thread receives on it
+static uint64_t retry_after;
+static uint32_t last_id;
+static bool receiving;             // A thread waits for replies
+static struct pending_request* pending;
+
+
+static uint64_t _now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Lets all requests waiting for replies fail
+static void _fail_pending(void) {
+  for (struct pending_request* request = pending; request; request = request->next)
+    request->done = true;
+  pending = NULL;
+  pthread_cond_broadcast(&broker_cond);
+}
+
+// Gives up the connection, all pending requests fail. If a thread is
+// receiving, then it gets woken up and closes the socket.
+static void _disconnect(void) {
+  _fail_pending();
+  if (broker_fd >= 0 && receiving) {
+    shutdown(broker_fd, SHUT_RDWR);
+    orphan_fd = broker_fd;
+  }
+  else if (broker_fd >= 0)
+    ORIG(close)(broker_fd);
+  broker_fd = -1;
+  retry_after = _now_ms() + RETRY_MS;
+}
+
+// Return value: true if connected
+static bool _connect(void) {
+  if (broker_fd >= 0)
+    return true;
+  if (_now_ms() < retry_after)
+    return false;
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1) {
+    _disconnect();
+    return false;
+  }
+  // A hanging daemon must not hang the application
+  struct timeval timeout = { 1, 0 };
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+      connect(fd, (const struct sockaddr*)&address, sizeof(address)) != 0) {
+    ORIG(close)(fd);
+    _disconnect();
+    return false;
+  }
+  _track_internal_fd(fd);
+  broker_fd = fd;
+  return true;
+}
+
+// Fills a request for one lock file
+// Return value: Size of the request. 0 if the path is no lock file.
+static size_t _fill_request(struct lock_broker_request* request, int op, const struct lock_target* target) {
+  const char* name = strrchr(target->path, '/');
+  name = name ? name + 1 : target->path;
+  const struct lock_root* root = _get_lock_root(target->root);
+  if (strncmp(name, "LCK.", 4) != 0 || !root)
+    return 0;
+
+  memset(request, 0, offsetof(struct lock_broker_request, paths));
+  request->version = LOCK_BROKER_VERSION;
+  request->op = op;
+  request->count = 1;
+  int n = snprintf(request->paths, LOCK_BROKER_PATHS, "%s/%s", root->path, target->path);
+  if (n < 0 || n >= LOCK_BROKER_PATHS)
+    return 0;
+  return offsetof(struct lock_broker_request, paths) + n + 1;
+}
+
+// Receives one reply and hands it to its request. Called with broker_mutex
+// held.
+static void _receive(void) {
+  int fd = broker_fd;
+  // Closed by the application, see _forget_broker_fds
+  if (fd < 0) {
+    _fail_pending();
+    return;
+  }
+  receiving = true;
+  pthread_mutex_unlock(&broker_mutex);
+  struct lock_broker_reply reply;
+  ssize_t len = recv(fd, &reply, sizeof(reply), 0);
+  pthread_mutex_lock(&broker_mutex);
+  receiving = false;
+
+  if (fd == orphan_fd) {
+    ORIG(close)(fd);
+    orphan_fd = -1;
+  }
+  else if (len < (ssize_t)offsetof(struct lock_broker_reply, status)) {
+    if (fd == broker_fd)
+      _disconnect();
+    else
+      _fail_pending();
+  }
+  else {
+    for (struct pending_request** request = &pending; *request; request = &(*request)->next) {
+      if ((*request)->id == reply.id) {
+        (*request)->result = reply.result;
+        (*request)->done = true;
+        *request = (*request)->next;
+        break;
+      }
+    }
+  }
+  pthread_cond_broadcast(&broker_cond);
+}
+
+// Sends a request for one lock file
+// Parameters:
+//   op: LOCK_BROKER_* request
+//   target: Redirect target of the lock file
+// Return value: Result of the daemon. LOCK_BROKER_UNTRACKED if the daemon
+//   isn't available or the path is no lock file.
+static int _request(int op, const struct lock_target* target) {
+  struct lock_broker_request request;
+  size_t len = _fill_request(&request, op, target);
+  if (!len)
+    return LOCK_BROKER_UNTRACKED;
+
+  int saved_errno = errno;
+  struct pending_request self = { 0, false, LOCK_BROKER_UNTRACKED, NULL };
+  pthread_mutex_lock(&broker_mutex);
+  if (_connect()) {
+    self.id = request.id = ++last_id;
+    if (send(broker_fd, &request, len, MSG_NOSIGNAL | MSG_DONTWAIT) == (ssize_t)len) {
+      self.next = pending;
+      pending = &self;
+    }
+    else {
+      _disconnect();
+      self.done = true;
+    }
+  }
+  else
+    self.done = true;
+  while (!self.done) {
+    if (receiving)
+      pthread_cond_wait(&broker_cond, &broker_mutex);
+    else
+      _receive();
+  }
+  pthread_mutex_unlock(&broker_mutex);
+  LOCKDEV_PROBE2(broker_request, request.paths, self.result);
+  errno = saved_errno;
+  return self.result;
+}
+
+// Called before a lock file is created exclusively
+// Parameters:
+//   target: Redirect target of the lock file
+// Return value: 0 if the caller may create the lock file and has to call
+//   _broker_cancel if that fails. EEXIST if the lock is held or reserved
+//   for another process. LOCK_BROKER_UNTRACKED if the file protocol decides.
+__attribute__ ((visibility ("hidden"))) int _broker_acquire(const struct lock_target* target) {
+  return _request(LOCK_BROKER_ACQUIRE, target);
+}
+
+// Called if the exclusive creation after _broker_acquire failed
+__attribute__ ((visibility ("hidden"))) void _broker_cancel(const struct lock_target* target) {
+  _request(LOCK_BROKER_CANCEL, target);
+}
+
+// Called after the lock file was created. The daemon only removes lock
+// files of exited owners if they are still the ones the owner created.
+__attribute__ ((visibility ("hidden"))) void _broker_created(const struct lock_target* target) {
+  struct lock_broker_request request;
+  size_t len = _fill_request(&request, LOCK_BROKER_CREATED, target);
+  struct lock_file_id id;
+  if (!len)
+    return;
+  _get_lock_file_id(target, &id);
+  request.dev = id.dev;
+  request.ino = id.ino;
+  request.birth = id.birth;
+  // There is no reply
+  int saved_errno = errno;
+  pthread_mutex_lock(&broker_mutex);
+  if (broker_fd >= 0 && send(broker_fd, &request, len, MSG_NOSIGNAL | MSG_DONTWAIT) != (ssize_t)len)
+    _disconnect();
+  pthread_mutex_unlock(&broker_mutex);
+  errno = saved_errno;
+}
+
+// Lets the daemon remove a lock file
+// Parameters:
+//   target: Redirect target of the lock file
+//   result: Set to the unlink result if the daemon handled the call
+// Return value: true if the daemon handled the call
+__attribute__ ((visibility ("hidden"))) bool _broker_remove(const struct lock_target* target, int* result) {
+  int error = _request(LOCK_BROKER_REMOVE, target);
+  if (error == LOCK_BROKER_UNTRACKED)
+    return false;
+  *result = error ? -1 : 0;
+  if (error)
+    errno = error;
+  return true;
+}
+
+// Called by the close wrappers. The connection is opened again on next use,
+// the daemon keeps our locks meanwhile.
+// Parameters:
+//   first: First closed descriptor
+//   last: Last closed descriptor
+__attribute__ ((visibility ("hidden"))) void _forget_broker_fds(int first, int last) {
+  int fd = __atomic_load_n(&broker_fd, __ATOMIC_RELAXED);
+  if (fd >= first && fd <= last)
+    __atomic_compare_exchange_n(&broker_fd, &fd, -1, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// The daemon knows processes by the PID of their connection, so the child
+// needs a connection of its own. Other threads are gone in the child, the
+// mutex may have been held by one of them.
+static void _reset_after_fork(void) {
+  pthread_mutex_init(&broker_mutex, NULL);
+  pthread_cond_init(&broker_cond, NULL);
+  if (broker_fd >= 0)
+    ORIG(close)(broker_fd);
+  if (orphan_fd >= 0)
+    ORIG(close)(orphan_fd);
+  broker_fd = -1;
+  orphan_fd = -1;
+  retry_after = 0;
+  receiving = false;
+  pending = NULL;
+}
+
+__attribute__ ((constructor (104))) static void _init_broker(void) {
+  const char* enabled = getenv("LOCKDEV_REDIRECT_BROKER");
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (!enabled || strcmp(enabled, "1") != 0 || !runtime_dir || !runtime_dir[0])
+    return;
+  address.sun_family = AF_UNIX;
+  int n = snprintf(address.sun_path, sizeof(address.sun_path), "%s/%s", runtime_dir, LOCK_BROKER_SOCKET);
+  if (n < 0 || (size_t)n >= sizeof(address.sun_path) ||
+      pthread_atfork(NULL, NULL, _reset_after_fork))
+    return;
+  _broker_enabled = true;
+}
@@ -0,0 +1,54 @@
+#include <stdint.h>
+
+// Lock broker protocol
+// With LOCKDEV_REDIRECT_BROKER=1 the library asks lockdev-redirectd before
+// it creates a lock file exclusively and lets the daemon remove lock files.
+// Every request and every reply is one message on the SOCK_SEQPACKET socket
+// $XDG_RUNTIME_DIR/lockdev-redirect/broker. It is kept next to the lock
+// root, so removing the lock directory doesn't cut off the daemon. Only the
+// used part of "paths" and "status" is sent. The daemon knows the sender by
+// the PID of the connection (SO_PEERCRED), so every process has a
+// connection of its own. Threads share it, replies are matched to requests
+// by "id". This header is the only thing the library and the daemon share,
+// so the layout must only change together with LOCK_BROKER_VERSION.
+
+#define LOCK_BROKER_VERSION 2
+#define LOCK_BROKER_SOCKET "lockdev-redirect/broker"  // Below $XDG_RUNTIME_DIR
+#define LOCK_BROKER_PATHS 512        // Path bytes per request
+#define LOCK_BROKER_BATCH 32         // Paths per status request
+
+// Requests. Paths are absolute paths of redirected lock files.
+#define LOCK_BROKER_ACQUIRE 1    // Before exclusive creation. 0 or EEXIST.
+#define LOCK_BROKER_CANCEL 2     // Exclusive creation failed after ACQUIRE
+#define LOCK_BROKER_REMOVE 3     // Remove a lock file. 0 or errno of unlink, EBUSY if held by another process.
+#define LOCK_BROKER_STATUS 4     // Owner and waiters of every path
+#define LOCK_BROKER_SHUTDOWN 5
+#define LOCK_BROKER_CREATED 6    // Lock file created after ACQUIRE, "dev", "ino" and "birth" are set. No reply.
+
+// Result if the daemon doesn't track the path. The caller uses the file
+// protocol on its own then.
+#define LOCK_BROKER_UNTRACKED -1
+
+struct lock_broker_request {
+  uint8_t version;
+  uint8_t op;
+  uint8_t count;              // Paths in "paths"
+  uint8_t reserved;
+  uint32_t id;                // Returned in the reply
+  uint64_t dev;               // Lock file of LOCK_BROKER_CREATED, see
+  uint64_t ino;               // struct lock_file_id
+  uint64_t birth;
+  char paths[LOCK_BROKER_PATHS];   // "count" zero terminated paths
+};
+
+struct lock_broker_status {
+  int32_t owner;              // PID. 0 if not held.
+  uint32_t waiters;           // Processes queued for the lock
+};
+
+struct lock_broker_reply {
+  uint32_t id;                // Of the request
+  int32_t result;             // 0, errno value or LOCK_BROKER_UNTRACKED
+  uint32_t count;             // Entries in "status"
+  struct lock_broker_status status[LOCK_BROKER_BATCH];
+};
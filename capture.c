@@ -0,0 +1,178 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+#include "stats.h"
+#include "symbols.h"
+
+_Static_assert(sizeof(struct lock_capture_record) == 64, "Capture record header should be 64 bytes");
+
+// Descriptors returned by captured calls. Their close and dup calls are
+// captured as well, so the replay can pair them.
+#define CAPTURE_FDS 4096
+static unsigned char captured_fds[CAPTURE_FDS / 8];
+static char capture_path[PATH_MAX];
+
+
+static bool _is_captured_fd(int64_t fd) {
+  return fd >= 0 && fd < CAPTURE_FDS && (__atomic_load_n(&captured_fds[fd / 8], __ATOMIC_RELAXED) & (1 << (fd % 8)));
+}
+
+static void _set_captured_fd(int64_t fd, bool captured) {
+  if (fd < 0 || fd >= CAPTURE_FDS)
+    return;
+  if (captured)
+    __atomic_or_fetch(&captured_fds[fd / 8], 1 << (fd % 8), __ATOMIC_RELAXED);
+  else
+    __atomic_and_fetch(&captured_fds[fd / 8], ~(1 << (fd % 8)), __ATOMIC_RELAXED);
+}
+
+// Checks if a call returns a new descriptor
+static bool _returns_fd(unsigned int id) {
+  switch (id) {
+    case LOCK_STATS_open: case LOCK_STATS_open64: case LOCK_STATS_openat: case LOCK_STATS_openat64:
+    case LOCK_STATS___open_2: case LOCK_STATS___open64_2: case LOCK_STATS___openat_2: case LOCK_STATS___openat64_2:
+    case LOCK_STATS_creat: case LOCK_STATS_creat64: case LOCK_STATS_mkstemp: case LOCK_STATS_mkstemp64:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// Decides if a call belongs to the lock workload and updates the set of
+// captured descriptors
+static bool _should_capture(const struct lock_stats_call* call, int64_t result) {
+  switch (call->id) {
+    case LOCK_STATS_close:
+      if (!_is_captured_fd(call->args[0]))
+        return false;
+      _set_captured_fd(call->args[0], false);
+      return true;
+    case LOCK_STATS_fcntl:
+    case LOCK_STATS_fcntl64:
+      if (call->args[1] != F_DUPFD && call->args[1] != F_DUPFD_CLOEXEC)
+        return false;
+      // fall through
+    case LOCK_STATS_dup:
+    case LOCK_STATS_dup2:
+    case LOCK_STATS_dup3:
+      if (!_is_captured_fd(call->args[0]))
+        return false;
+      if (result != -1)
+        _set_captured_fd(result, true);
+      return true;
+    default:
+      if (call->decision == LOCK_STATS_MISS)
+        return false;
+      if (_returns_fd(call->id) && result != -1)
+        _set_captured_fd(result, true);
+      return true;
+  }
+}
+
+// Called by _stats_end while capturing
+// Opens the capture file for every record. Only calls on lock paths are
+// captured, so this is rare, and our descriptor can't be closed by the
+// application.
+__attribute__ ((visibility ("hidden"))) void _capture_record(const struct lock_stats_call* call, int64_t result, bool failed, int error) {
+  if (!_should_capture(call, result))
+    return;
+
+  struct lock_capture_record record;
+  int64_t args[LOCK_CAPTURE_ARGS];
+  struct iovec iov[2 + LOCK_CAPTURE_ARGS + 1];
+  static const char padding[8];
+  memset(&record, 0, sizeof(record));
+  record.magic = LOCK_CAPTURE_MAGIC;
+  record.version = LOCK_CAPTURE_VERSION;
+  if (call->decision == LOCK_STATS_HIT)
+    record.flags |= LOCK_CAPTURE_HIT;
+  else if (call->decision == LOCK_STATS_REWRITE_FAILED)
+    record.flags |= LOCK_CAPTURE_REWRITE_FAILED;
+  if (failed)
+    record.flags |= LOCK_CAPTURE_FAILED;
+  record.pid = getpid();
+  record.tid = syscall(SYS_gettid);
+  record.time_ns = call->start;
+  record.result = result;
+  record.error = error;
+  record.arg_count = call->arg_count;
+  strncpy(record.function, _stats_function_names[call->id], sizeof(record.function) - 1);
+
+  // Strings follow the argument values in argument order
+  size_t size = sizeof(record) + call->arg_count * sizeof(int64_t);
+  unsigned int iov_count = 2;
+  for (unsigned int i = 0; i < call->arg_count; i++) {
+    record.arg_kinds[i] = call->arg_kinds[i];
+    args[i] = call->args[i];
+    if (call->arg_kinds[i] != LOCK_CAPTURE_ARG_STRING)
+      continue;
+    const char* string = (const char*)(intptr_t)call->args[i];
+    size_t len = string ? strnlen(string, PATH_MAX) : PATH_MAX;
+    if (len == PATH_MAX) {
+      record.arg_kinds[i] = LOCK_CAPTURE_ARG_OTHER;
+      args[i] = 0;
+      continue;
+    }
+    args[i] = size;
+    iov[iov_count].iov_base = (void*)string;
+    iov[iov_count].iov_len = len + 1;
+    size += iov[iov_count].iov_len;
+    iov_count++;
+  }
+  iov[iov_count].iov_base = (void*)padding;
+  iov[iov_count].iov_len = (8 - size % 8) % 8;
+  size += iov[iov_count].iov_len;
+  iov_count++;
+  record.size = size;
+  iov[0].iov_base = &record;
+  iov[0].iov_len = sizeof(record);
+  iov[1].iov_base = args;
+  iov[1].iov_len = call->arg_count * sizeof(int64_t);
+
+  int saved_errno = errno;
+  int fd = ORIG(open)(capture_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+  if (fd == -1 || writev(fd, iov, iov_count) != (ssize_t)size)
+    fprintf(stderr, "lockdev-redirect: Failed to write capture to %s\n", capture_path);
+  if (fd != -1)
+    ORIG(close)(fd);
+  errno = saved_errno;
+}
+
+__attribute__ ((constructor (104))) static void _init_capture(void) {
+  const char* path = getenv("LOCKDEV_REDIRECT_CAPTURE");
+  if (!path || !path[0])
+    return;
+  if (strlen(path) >= PATH_MAX) {
+    fprintf(stderr, "lockdev-redirect: LOCKDEV_REDIRECT_CAPTURE too long, capturing disabled\n");
+    return;
+  }
+  strcpy(capture_path, path);
+  __atomic_or_fetch(&_stats_enabled, LOCK_STATS_CAPTURING, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,43 @@
+#include <stdint.h>
+
+// Capture file
+// With LOCKDEV_REDIRECT_CAPTURE=<file> every call on a lock path, and every
+// close or dup of a descriptor returned by such a call, is appended to
+// <file> with its arguments and result. bench/replay re-issues them to
+// measure lockdev-redirect with the lock workload of a real application.
+//
+// The file is a plain sequence of variable sized records. Each record is
+// written with one writev() with O_APPEND, so several processes may share
+// one file. The layout must only change together with
+// LOCK_CAPTURE_VERSION.
+
+#define LOCK_CAPTURE_MAGIC 0x434c     // "LC"
+#define LOCK_CAPTURE_VERSION 2
+#define LOCK_CAPTURE_ARGS 6           // Maximum number of arguments
+
+// Record flags
+#define LOCK_CAPTURE_HIT 1               // Path was redirected
+#define LOCK_CAPTURE_REWRITE_FAILED 2    // Path matched but could not be redirected
+#define LOCK_CAPTURE_FAILED 4            // The call failed
+
+// Argument kinds
+#define LOCK_CAPTURE_ARG_OTHER 0      // Pointer to a buffer. Value not recorded.
+#define LOCK_CAPTURE_ARG_INT 1
+#define LOCK_CAPTURE_ARG_STRING 2     // Value is the offset of the string in the record
+
+struct lock_capture_record {
+  uint16_t magic;
+  uint16_t version;
+  uint16_t size;              // Whole record, multiple of 8
+  uint16_t flags;
+  int32_t pid;
+  int32_t tid;
+  uint64_t time_ns;           // CLOCK_MONOTONIC at entry
+  int64_t result;             // Return value. Pointers are stored as integer.
+  int32_t error;              // errno of failed calls. 0 on success.
+  uint8_t arg_count;
+  uint8_t reserved[3];
+  char function[16];
+  uint8_t arg_kinds[8];
+  int64_t args[];             // Followed by the zero terminated strings
+};
@@ -0,0 +1,174 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "utilities.h"
+#include "symbols.h"
+
+// One entry per descriptor. 0 means "not a directory we care about".
+// Descriptors are tracked when our open, opendir, dup, dup2, dup3 and fcntl
+// (F_DUPFD, F_DUPFD_CLOEXEC) wrappers return them. Descriptors from
+// FD_TABLE_SIZE on, and descriptors created behind our back (e.g. by
+// syscall() or inside glibc), are never tracked: Paths relative to them are
+// not redirected.
+// Entries are written with relaxed atomics only. A descriptor is only
+// passed to *at() calls after the open call that created it returned, so
+// no stronger ordering is needed. Survives fork() together with the
+// descriptors it describes.
+__attribute__ ((visibility ("hidden"))) uint16_t _fd_table[FD_TABLE_SIZE];
+
+// Set once at startup from getcwd, then only by our chdir and fchdir
+// wrappers. Limits:
+// - Directory changes inside glibc are not seen. nftw with FTW_CHDIR and
+//   the chdir file actions of posix_spawn don't go through our wrappers.
+// - Once the working directory is inside a lock directory, it really is
+//   the redirect target. getcwd then returns the path below
+//   $XDG_RUNTIME_DIR, not the lock path.
+// A failed chdir or fchdir we know nothing about resets the state, so a
+// stale state at worst misses a redirect.
+__attribute__ ((visibility ("hidden"))) uint16_t _cwd_state = STATE_DEAD;
+
+// Identity of the directories in "_fd_table". Only used to verify a
+// descriptor before redirecting a path relative to it.
+static struct {
+  dev_t dev;
+  ino_t ino;
+} fd_ids[FD_TABLE_SIZE];
+
+// Remembers the match result for a freshly opened descriptor
+// Parameters:
+//   fd: The opened descriptor (may be -1 on error)
+//   match: The match result of the opened path
+__attribute__ ((visibility ("hidden"))) void _track_fd(int fd, const struct lock_match* match) {
+  if (fd < 0 || fd >= FD_TABLE_SIZE || (match->prefix && match->prefix->blackhole))
+    return;
+
+  uint16_t value = match->state;
+  if (match->prefix)
+    value = FD_INSIDE_ROOT | match->prefix->root;
+  else {
+    struct stat stat_buf;
+    if (fstat(fd, &stat_buf) != 0 || !S_ISDIR(stat_buf.st_mode))
+      return;
+    fd_ids[fd].dev = stat_buf.st_dev;
+    fd_ids[fd].ino = stat_buf.st_ino;
+  }
+  __atomic_store_n(&_fd_table[fd], value, __ATOMIC_RELAXED);
+}
+
+// Checks if a descriptor found in the table still is the directory it was
+// when we saw it being opened.
+// Parameters:
+//   fd: The descriptor to check
+// Return value: true if the descriptor is unchanged. false otherwise.
+__attribute__ ((visibility ("hidden"))) bool _check_fd(int fd) {
+  struct stat stat_buf;
+  if (fstat(fd, &stat_buf) == 0 && stat_buf.st_dev == fd_ids[fd].dev && stat_buf.st_ino == fd_ids[fd].ino)
+    return true;
+
+  _untrack_fd(fd);
+  return false;
+}
+
+// Forgets a range of closed descriptors
+// Parameters:
+//   first: First closed descriptor
+//   last: Last closed descriptor
+__attribute__ ((visibility ("hidden"))) void _untrack_fds(int first, int last) {
+  if (first < 0)
+    first = 0;
+  if (last >= FD_TABLE_SIZE)
+    last = FD_TABLE_SIZE - 1;
+  for (int fd = first; fd <= last; fd++)
+    _untrack_fd(fd);
+}
+
+// Remembers the match result for the new working directory after a
+// successful chdir. Lock paths themselves are entered through the lock
+// root, so relative paths below them need no redirect.
+// Parameters:
+//   match: The match result of the path passed to chdir
+__attribute__ ((visibility ("hidden"))) void _set_cwd(const struct lock_match* match) {
+  __atomic_store_n(&_cwd_state, match->prefix ? STATE_DEAD : match->state, __ATOMIC_RELAXED);
+}
+
+// Forgets the working directory state after a failed chdir or fchdir on a
+// path or descriptor which is not tracked
+__attribute__ ((visibility ("hidden"))) void _reset_cwd(void) {
+  __atomic_store_n(&_cwd_state, STATE_DEAD, __ATOMIC_RELAXED);
+}
+
+// Takes the entry of a descriptor for the new working directory after a
+// successful fchdir
+// Parameters:
+//   fd: The descriptor passed to fchdir
+__attribute__ ((visibility ("hidden"))) void _set_cwd_fd(int fd) {
+  uint16_t value = STATE_DEAD;
+  if (fd >= 0 && fd < FD_TABLE_SIZE) {
+    value = __atomic_load_n(&_fd_table[fd], __ATOMIC_RELAXED);
+    if ((value & FD_INSIDE_ROOT) || (value != STATE_DEAD && !_check_fd(fd)))
+      value = STATE_DEAD;
+  }
+  __atomic_store_n(&_cwd_state, value, __ATOMIC_RELAXED);
+}
+
+// Copies the entry of a duplicated descriptor
+// Parameters:
+//   fd: The source descriptor
+//   fd2: The new descriptor
+__attribute__ ((visibility ("hidden"))) void _copy_fd(int fd, int fd2) {
+  if (fd2 < 0 || fd2 >= FD_TABLE_SIZE)
+    return;
+
+  uint16_t value = 0;
+  if (fd >= 0 && fd < FD_TABLE_SIZE) {
+    value = __atomic_load_n(&_fd_table[fd], __ATOMIC_RELAXED);
+    fd_ids[fd2] = fd_ids[fd];
+  }
+  __atomic_store_n(&_fd_table[fd2], value, __ATOMIC_RELAXED);
+}
+
+// The working directory the application was started in counts like a
+// chdir to it. After "cd /var/lock && app" the working directory is moved
+// to the redirect target, after "cd /var && app" relative lock paths are
+// matched.
+__attribute__ ((constructor (104))) static void _init_cwd(void) {
+  int saved_errno = errno;
+  char cwd[PATH_MAX];
+  struct lock_match match;
+  struct lock_target target;
+  if (getcwd(cwd, sizeof(cwd))) {
+    if (!_find_lockpath_prefix(&match, AT_FDCWD, cwd))
+      _set_cwd(&match);
+    else if (_redirect_path(&target, &match)) {
+      int fd = ORIG(openat)(target.dirfd, target.path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+      if (fd != -1) {
+        if (ORIG(fchdir)(fd) == 0)
+          _set_cwd(&match);
+        ORIG(close)(fd);
+      }
+    }
+  }
+  errno = saved_errno;
+}
@@ -21,8 +21,13 @@
           name = "lockdev-redirect";
           src = ./.;
           installPhase = ''
-            mkdir -p $out/lib
+            mkdir -p $out/lib $out/bin
             cp lockdev-redirect.so $out/lib
+            cp lockdev-redirect-stats $out/bin
+            cp lockdev-redirect-trace $out/bin
+            cp lockdev-redirect-ns $out/bin
+            cp lockdev-redirect-seccomp $out/bin
+            cp lockdev-redirectd $out/bin
           '';
         };
         lockdev-redirect = pkgs.writeShellScriptBin "lockdev-redirect" ''
@@ -34,10 +39,48 @@
           if [ "$1" = '--help' ]; then
             echo 'lockdev-redirect, redirect /var/lock to a user-writable path.'
             echo 'Usage: lockdev-redirect COMMAND'
+            echo '       lockdev-redirect --namespace COMMAND'
+            echo '       lockdev-redirect --seccomp COMMAND'
+            echo '       lockdev-redirect --broker COMMAND'
+            echo '       lockdev-redirect --stats'
+            echo '       lockdev-redirect --top [-d SECONDS] [-n COUNT]'
             echo 'Where COMMAND is the command to execute with redirected /var/lock'
+            echo '--namespace bind mounts the redirect target over /var/lock in a new'
+            echo 'user namespace instead of preloading lockdev-redirect.so'
+            echo '--seccomp redirects the syscalls of the command from a supervisor,'
+            echo 'so static binaries and direct syscalls are covered as well'
+            echo '--broker queues processes waiting for busy locks in lockdev-redirectd'
+            echo '--stats and --top show statistics of processes started with'
+            echo 'LOCKDEV_REDIRECT_LIVE=1'
             exit 0
           fi
 
+          if [ "$1" = '--namespace' ]; then
+            shift
+            export LD_LIBRARY_PATH=''${LD_LIBRARY_PATH:+$LD_LIBRARY_PATH:}${lockdev-redirect-so}/lib
+            exec ${lockdev-redirect-so}/bin/lockdev-redirect-ns "$@"
+          fi
+
+          if [ "$1" = '--seccomp' ]; then
+            shift
+            export LD_LIBRARY_PATH=''${LD_LIBRARY_PATH:+$LD_LIBRARY_PATH:}${lockdev-redirect-so}/lib
+            exec ${lockdev-redirect-so}/bin/lockdev-redirect-seccomp "$@"
+          fi
+
+          if [ "$1" = '--stats' ] || [ "$1" = '--top' ]; then
+            exec ${lockdev-redirect-so}/bin/lockdev-redirect-stats "$@"
+          fi
+
+          if [ "$1" = '--broker' ]; then
+            shift
+            export LOCKDEV_REDIRECT_BROKER=1
+          fi
+
+          # The broker is started on demand
+          if [ "$LOCKDEV_REDIRECT_BROKER" = 1 ]; then
+            ${lockdev-redirect-so}/bin/lockdev-redirectd --start || echo 'lockdev-redirect: Lock broker not started, using lock files only' >&2
+          fi
+
           export LD_PRELOAD=$LD_PRELOAD:${lockdev-redirect-so}/lib/lockdev-redirect.so
           exec $*
         '';
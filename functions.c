@@ -18,7 +18,6 @@
 
 
 #define _GNU_SOURCE
-#include <dlfcn.h>
 #include <stdarg.h>
 #include <fcntl.h>
 #include <string.h>
@@ -29,322 +28,695 @@
 #include <linux/limits.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <unistd.h>
+#include <limits.h>
+#include <linux/close_range.h>
 #include "utilities.h"
+#include "symbols.h"
+#include "stats.h"
+#include "broker_protocol.h"
+
+
+// Lock bookkeeping around the exclusive creation of a lock file, see
+// locktable.c and broker.c
+struct lock_claim {
+  struct lock_table_slot* slot;
+  int brokered;
+};
+
+// The broker is asked first, so it queues us even if the table knows
+// that the lock is busy.
+// Return value: false if another process holds the lock
+static bool _claim_lock(struct lock_claim* claim, const struct lock_target* target) {
+  claim->slot = NULL;
+  claim->brokered = LOCK_BROKER_UNTRACKED;
+  if (_broker_enabled && (claim->brokered = _broker_acquire(target)) == EEXIST)
+    return false;
+  if (_lock_table_enabled && !_lock_table_begin_create(target, &claim->slot)) {
+    if (claim->brokered == 0)
+      _broker_cancel(target);
+    return false;
+  }
+  return true;
+}
 
+static void _finish_claim(struct lock_claim* claim, const struct lock_target* target, bool success) {
+  if (claim->slot)
+    _lock_table_end_create(claim->slot, target, success);
+  if (claim->brokered == 0 && success)
+    _broker_created(target);
+  else if (claim->brokered == 0)
+    _broker_cancel(target);
+}
 
-typedef int (*orig_open_func_type)(const char* file, int oflag, ...);
-typedef char* (*orig_mktemp_func_type)(char* template);
-typedef FILE* (*orig_fopen_func_type)(const char* filename, const char* modes);
-typedef int (*orig_unlink_func_type)(const char *name);
-typedef int (*orig_xstat_func_type)(int ver, const char* filename, struct stat* stat_buf);
-typedef int (*orig_creat_func_type)(const char *file, mode_t mode);
-typedef int (*orig_link_func_type)(const char *from, const char *to);
-typedef int (*orig_rename_func_type)(const char *old, const char *new);
-typedef int (*orig_chmod_func_type)(const char *file, __mode_t mode);
-typedef int (*orig_scandir_func_type)(const char *__restrict dir, struct dirent ***__restrict __namelist, int (*selector) (const struct dirent *), int (*cmp) (const struct dirent **, const struct dirent **));
-typedef FILE* (*orig_fopen64_func_type)(const char* filename, const char* modes);typedef int (*orig_remove_func_type)(const char *filename);
-
+// Opens a redirected lock file. Exclusive creations claim the lock first.
+// Parameters:
+//   target: Redirect target as returned by _redirect_path
+//   oflag: Flags to open with
+//   mode: Mode for created files
+// Return value: File descriptor on success. -1 otherwise.
+static int _openat_exclusive(const struct lock_target* target, int oflag, int mode) {
+  struct lock_claim claim;
+  bool claimed = __builtin_expect(_lock_table_enabled | _broker_enabled, 0) &&
+                 (oflag & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL);
+  if (claimed && !_claim_lock(&claim, target)) {
+    errno = EEXIST;
+    return -1;
+  }
 
-//
-// glibc functions overrides start here
-//
+  int fd = ORIG(openat)(target->dirfd, target->path, oflag, mode);
+  // Our lock root may have been removed. Re-create it and try again.
+  if (fd == -1 && errno == ENOENT && (oflag & O_CREAT) && _recreate_lock_root(target->root))
+    fd = ORIG(openat)(target->dirfd, target->path, oflag, mode);
+  if (claimed) {
+    int saved_errno = errno;
+    _finish_claim(&claim, target, fd != -1);
+    errno = saved_errno;
+  }
+  return fd;
+}
 
-int open(const char *file, int oflag, ...) {
-  orig_open_func_type orig_func;
-  orig_func = (orig_open_func_type)dlsym(RTLD_NEXT, "open");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call open\n");
-    return -1;
+// Opens a redirected lock file with fopen semantics. There is no "fopenat",
+// so the fopen mode is translated to open flags and the stream is created
+// with fdopen.
+// Parameters:
+//   target: Redirect target as returned by _redirect_path
+//   modes: The fopen mode string
+// Return value: FILE stream on success. NULL otherwise.
+static FILE* _fopen_at(const struct lock_target* target, const char* modes) {
+  int oflag;
+  switch (modes[0]) {
+    case 'r': oflag = O_RDONLY; break;
+    case 'w': oflag = O_WRONLY | O_CREAT | O_TRUNC; break;
+    case 'a': oflag = O_WRONLY | O_CREAT | O_APPEND; break;
+    default:
+      errno = EINVAL;
+      return NULL;
+  }
+  for (const char* c = modes + 1; *c && *c != ','; c++) {
+    if (*c == '+')
+      oflag = (oflag & ~(O_RDONLY | O_WRONLY)) | O_RDWR;
+    else if (*c == 'x')
+      oflag |= O_EXCL;
+    else if (*c == 'e')
+      oflag |= O_CLOEXEC;
   }
 
-  const char* lockpath_prefix = _find_lockpath_prefix(file);
-  if (!lockpath_prefix) {
-    if (__OPEN_NEEDS_MODE(oflag)) {
-      va_list args;
-      va_start(args, oflag);
-      int mode = va_arg(args, int);
-      va_end(args);
-      return orig_func(file, oflag, mode);
-    } else {
-      return orig_func(file, oflag);
-    }
+  if (!(oflag & O_CREAT) && _lookup_absent(target)) {
+    errno = ENOENT;
+    return NULL;
   }
+  int fd = _openat_exclusive(target, oflag, 0666);
+  if (fd == -1)
+    return NULL;
 
-  char buffer[PATH_MAX];
-  const char* new_path = file;
-  if (_rewrite_path(buffer, file, lockpath_prefix))
-    new_path = buffer;
-
-  if (__OPEN_NEEDS_MODE(oflag)) {
-    va_list args;
-    va_start(args, oflag);
-    int mode = va_arg(args, int);
-    va_end(args);
-    return orig_func(new_path, oflag, mode);
-  } else {
-    return orig_func(new_path, oflag);
+  FILE* fp = fdopen(fd, modes);
+  if (!fp) {
+    int saved_errno = errno;
+    ORIG(close)(fd);
+    errno = saved_errno;
   }
+  return fp;
 }
 
 
-FILE *fopen (const char *filename, const char *modes) {
-  orig_fopen_func_type orig_func;
-  orig_func = (orig_fopen_func_type)dlsym(RTLD_NEXT, "fopen");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call fopen\n");
-    return NULL;
+// Fetches the optional "mode" argument of the open variants
+#define GET_OPEN_MODE(mode, oflag) \
+  int mode = 0; \
+  if (__OPEN_NEEDS_MODE(oflag)) { \
+    va_list args; \
+    va_start(args, oflag); \
+    mode = va_arg(args, int); \
+    va_end(args); \
   }
 
-  const char* lockpath_prefix = _find_lockpath_prefix(filename);
-  if (!lockpath_prefix)
-    return orig_func(filename, modes);
-
-  char new_path[PATH_MAX];
-  if (!_rewrite_path(new_path, filename, lockpath_prefix))
-    return orig_func(filename, modes);
+// Opens a matched lock path below its lock root. Shared by all open
+// variants.
+// Parameters:
+//   target: Redirect target as returned by _redirect_path
+//   match: The match result of the opened path
+//   oflag: Flags to open with
+//   mode: Mode for newly created files
+// Return value: New file descriptor on success. -1 otherwise.
+static int _open_redirected(const struct lock_target* target, const struct lock_match* match, int oflag, int mode) {
+  // Lock files are mostly opened to read the PID of their owner
+  if (!(oflag & O_CREAT) && _lookup_absent(target)) {
+    errno = ENOENT;
+    return -1;
+  }
+  int fd = _openat_exclusive(target, oflag, mode);
+  _track_fd(fd, match);
+  return fd;
+}
 
-  return orig_func(new_path, modes);
+// Remembers descriptors of parent directories of lock paths. Only costs a
+// compare for all other paths.
+static inline int _track_fd_if_needed(int fd, const struct lock_match* match) {
+  if (__builtin_expect(match->state != STATE_DEAD, 0))
+    _track_fd(fd, match);
+  return fd;
 }
 
 
-int unlink(const char *name) {
-  orig_unlink_func_type orig_func;
-  orig_func = (orig_unlink_func_type)dlsym(RTLD_NEXT, "unlink");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call unlink\n");
+// Removes a redirected file. Lock files held by other processes can't be
+// removed.
+static int _unlink_at(const struct lock_target* target) {
+  struct lock_table_slot* slot = NULL;
+  if (__builtin_expect(_lock_table_enabled, 0) && !_lock_table_begin_remove(target, &slot)) {
+    errno = EBUSY;
     return -1;
   }
+  int result;
+  if (__builtin_expect(!_broker_enabled, 1) || !_broker_remove(target, &result))
+    result = unlinkat(target->dirfd, target->path, 0);
+  if (slot)
+    _lock_table_end_remove(slot, result == 0);
+  return result;
+}
 
-  const char* lockpath_prefix = _find_lockpath_prefix(name);
-  if (!lockpath_prefix)
-    return orig_func(name);
+// Creates a hard link. Links to redirected paths are exclusive creations
+// (lockdev takes its locks this way), so they claim the lock of the new file
+// first.
+static int _link_at(const struct lock_target* target1, const struct lock_target* target2, bool redirected2, int flags) {
+  struct lock_claim claim;
+  bool claimed = __builtin_expect(_lock_table_enabled | _broker_enabled, 0) && redirected2;
+  if (claimed && !_claim_lock(&claim, target2)) {
+    errno = EEXIST;
+    return -1;
+  }
+  int result = ORIG(linkat)(target1->dirfd, target1->path, target2->dirfd, target2->path, flags);
+  if (claimed) {
+    int saved_errno = errno;
+    _finish_claim(&claim, target2, result == 0);
+    errno = saved_errno;
+  }
+  return result;
+}
 
-  char new_path[PATH_MAX];
-  if (!_rewrite_path(new_path, name, lockpath_prefix))
-    return orig_func(name);
+// Renames a file. With RENAME_NOREPLACE onto a redirected path this is an
+// exclusive creation like a link.
+static int _rename_at(const struct lock_target* target1, const struct lock_target* target2, bool redirected2, unsigned int flags) {
+  struct lock_claim claim;
+  bool claimed = __builtin_expect(_lock_table_enabled | _broker_enabled, 0) && redirected2 && (flags & RENAME_NOREPLACE);
+  if (claimed && !_claim_lock(&claim, target2)) {
+    errno = EEXIST;
+    return -1;
+  }
+  int result = ORIG(renameat2)(target1->dirfd, target1->path, target2->dirfd, target2->path, flags);
+  if (claimed) {
+    int saved_errno = errno;
+    _finish_claim(&claim, target2, result == 0);
+    errno = saved_errno;
+  }
+  return result;
+}
 
-  return orig_func(new_path);
+// Same as glibc remove: Try to unlink a file first, then try to remove a
+// directory
+static int _remove_at(const struct lock_target* target) {
+  int result = _unlink_at(target);
+  if (result == -1 && errno == EISDIR)
+    result = unlinkat(target->dirfd, target->path, AT_REMOVEDIR);
+  return result;
 }
 
+// Opens a redirected directory stream
+static DIR* _opendir_at(const struct lock_target* target) {
+  int fd = ORIG(openat)(target->dirfd, target->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1)
+    return NULL;
 
-char* mktemp(char *template) {
-  orig_mktemp_func_type orig_func;
-  orig_func = (orig_mktemp_func_type)dlsym(RTLD_NEXT, "mktemp");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call mktemp\n");
-    template[0] = '\0';
-    return template;
+  DIR* dir = fdopendir(fd);
+  if (!dir) {
+    int saved_errno = errno;
+    ORIG(close)(fd);
+    errno = saved_errno;
   }
+  return dir;
+}
 
-  const char* lockpath_prefix = _find_lockpath_prefix(template);
-  if (!lockpath_prefix)
-    return orig_func(template);
-
-  char new_template[PATH_MAX];
-  if (!_rewrite_path(new_template, template, lockpath_prefix))
-    return orig_func(template);
-
-  orig_func(new_template);
+// Copies the unique part of a redirected temporary file name back into the
+// template of the caller
+static void _copy_template_suffix(char* template, const char* new_template) {
   if (new_template[0] == '\0') {
     template[0] = '\0';
-    return template;
+    return;
   }
 
   // If we successfully made a unique temporary filename for your own target
   // path, then integrate its last six characters into the original template
-  char* last_six = new_template + strlen(new_template) - 6;
+  const char* last_six = new_template + strlen(new_template) - 6;
   strcpy(template + strlen(template) - 6, last_six);
-  return template;
 }
 
+// mktemp for matched lock paths. The template has to be rewritten to a full
+// path, as mktemp has no *at() variant.
+static char* _mktemp_redirected(char* (*orig_func)(char*), char* template, const struct lock_match* match) {
+  char new_template[PATH_MAX];
+  if (!_rewrite_path(new_template, PATH_MAX, match))
+    return orig_func(template);
 
-int __xstat (int ver, const char *filename, struct stat *stat_buf) {
-  orig_xstat_func_type orig_func;
-  orig_func = (orig_xstat_func_type)dlsym(RTLD_NEXT, "__xstat");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call __xstat\n");
-    return -1;
-  }
-
-  const char* lockpath_prefix = _find_lockpath_prefix(filename);
-  if (!lockpath_prefix)
-    return orig_func(ver, filename, stat_buf);
+  orig_func(new_template);
+  _copy_template_suffix(template, new_template);
+  return template;
+}
 
-  char new_path[PATH_MAX];
-  if (!_rewrite_path(new_path, filename, lockpath_prefix))
-    return orig_func(ver, filename, stat_buf);
+// mkstemp for matched lock paths. Same as _mktemp_redirected.
+static int _mkstemp_redirected(int (*orig_func)(char*), char* template, const struct lock_match* match) {
+  char new_template[PATH_MAX];
+  if (!_rewrite_path(new_template, PATH_MAX, match))
+    return orig_func(template);
 
-  return orig_func(ver, new_path, stat_buf);
+  int fd = orig_func(new_template);
+  if (fd != -1)
+    _copy_template_suffix(template, new_template);
+  return fd;
 }
 
+
 //
-// Implementations up to this line make rxtx work properly
+// glibc functions overrides start here
+//
+// The wrappers for all functions in wrappers.h are generated from the
+// following templates. Every wrapper has the same hot path: Fetch the
+// original function from the dispatch table, reject non-lock paths with the
+// inlined first stage of the matcher and forward the call unchanged.
+// Matched paths are forwarded to "call" relative to the lock root.
 //
 
-int creat(const char *file, mode_t mode) {
-  orig_creat_func_type orig_func;
-  orig_func = (orig_creat_func_type)dlsym(RTLD_NEXT, "creat");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call creat\n");
-    return -1;
+// Matched paths which aren't redirected may be below a missing legacy lock
+// directory. Those calls fail with ENOENT without a syscall, see
+// _is_blackholed.
+#define RETURN_IF_BLACKHOLED(stats, match, lookup, fail) \
+  if (_is_blackholed(&(match), lookup)) { \
+    _stats_forward(&(stats), LOCK_STATS_HIT); \
+    errno = ENOENT; \
+    LOCK_STATS_RETURN(stats, fail); \
   }
 
-  const char* lockpath_prefix = _find_lockpath_prefix(file);
-  if (!lockpath_prefix)
-    return orig_func(file, mode);
-
-  char new_path[PATH_MAX];
-  if (!_rewrite_path(new_path, file, lockpath_prefix))
-    return orig_func(file, mode);
-
-  return orig_func(new_path, mode);
+// glibc declares most path arguments nonnull, so the compiler would drop a
+// plain NULL check. The empty asm hides the value from it.
+static inline __attribute__ ((always_inline)) bool _is_null_path(const char* path) {
+  __asm__ ("" : "+r" (path));
+  return path == NULL;
 }
 
-
-int link(const char *from, const char *to) {
-  orig_link_func_type orig_func;
-  orig_func = (orig_link_func_type)dlsym(RTLD_NEXT, "link");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call link\n");
-    return -1;
+// A NULL path can't be a lock path. statx with AT_EMPTY_PATH accepts it, for
+// everything else the call fails like without us.
+#define FORWARD_IF_NULL(stats, path, call) \
+  if (__builtin_expect(_is_null_path(path), 0)) { \
+    _stats_forward(&(stats), LOCK_STATS_MISS); \
+    LOCK_STATS_RETURN(stats, call); \
   }
 
-  const char* lockpath_prefix_from = _find_lockpath_prefix(from);
-  const char* lockpath_prefix_to = _find_lockpath_prefix(to);
-  if (!lockpath_prefix_from && !lockpath_prefix_to)
-    return orig_func(from, to);
-
-  char from_buffer[PATH_MAX];
-  const char* new_from = from;
-  if (lockpath_prefix_from) {
-    if (_rewrite_path(from_buffer, from, lockpath_prefix_from))
-      new_from = from_buffer;
+#define WRAPPER_OPEN(name, params, args, dirfd, path, oflag_extra) \
+  int name params { \
+    __typeof__(_orig.name) orig_func = ORIG(name); \
+    if (orig_func == NULL) \
+      return -1; \
+    GET_OPEN_MODE(mode, oflag); \
+    struct lock_stats_call stats; \
+    _stats_enter(&stats, LOCK_STATS_##name, path, NULL); \
+    LOCK_STATS_ARGUMENTS(stats, args); \
+    FORWARD_IF_NULL(stats, path, orig_func args); \
+    \
+    struct lock_match match; \
+    struct lock_target target; \
+    bool matched = _find_lockpath_prefix(&match, dirfd, path) != NULL; \
+    if (__builtin_expect(!matched, 1) || !_redirect_path(&target, &match)) { \
+      if (matched) \
+        RETURN_IF_BLACKHOLED(stats, match, !(oflag & O_CREAT), -1); \
+      _stats_forward(&stats, matched && !match.prefix->blackhole ? LOCK_STATS_REWRITE_FAILED : LOCK_STATS_MISS); \
+      LOCK_STATS_RETURN(stats, _track_fd_if_needed(orig_func args, &match)); \
+    } \
+    \
+    _stats_forward(&stats, LOCK_STATS_HIT); \
+    LOCK_STATS_RETURN(stats, _open_redirected(&target, &match, oflag | (oflag_extra), mode)); \
   }
 
-  char to_buffer[PATH_MAX];
-  const char* new_to = to;
-  if (lockpath_prefix_to) {
-    if (_rewrite_path(to_buffer, to, lockpath_prefix_to))
-      new_to = to_buffer;
+// The fortified variants are used instead of open/openat if an application
+// was built with _FORTIFY_SOURCE and the compiler can't prove that no mode
+// is needed.
+#define WRAPPER_OPEN2(name, params, args, dirfd, path, oflag_extra) \
+  int name params { \
+    __typeof__(_orig.name) orig_func = ORIG(name); \
+    if (orig_func == NULL) \
+      return -1; \
+    struct lock_stats_call stats; \
+    _stats_enter(&stats, LOCK_STATS_##name, path, NULL); \
+    LOCK_STATS_ARGUMENTS(stats, args); \
+    FORWARD_IF_NULL(stats, path, orig_func args); \
+    \
+    struct lock_match match; \
+    struct lock_target target; \
+    bool matched = _find_lockpath_prefix(&match, dirfd, path) != NULL; \
+    if (__builtin_expect(!matched, 1) || !_redirect_path(&target, &match)) { \
+      if (matched) \
+        RETURN_IF_BLACKHOLED(stats, match, !(oflag & O_CREAT), -1); \
+      _stats_forward(&stats, matched && !match.prefix->blackhole ? LOCK_STATS_REWRITE_FAILED : LOCK_STATS_MISS); \
+      LOCK_STATS_RETURN(stats, _track_fd_if_needed(orig_func args, &match)); \
+    } \
+    \
+    _stats_forward(&stats, LOCK_STATS_HIT); \
+    LOCK_STATS_RETURN(stats, _open_redirected(&target, &match, oflag | (oflag_extra), 0)); \
   }
 
-  return orig_func(new_from, new_to);
-}
-
-
-int rename (const char* old, const char* new) {
-  orig_rename_func_type orig_func;
-  orig_func = (orig_rename_func_type)dlsym(RTLD_NEXT, "rename");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call rename\n");
-    return -1;
+// "fail" is only evaluated if "creates" is true, so it may have side effects.
+// mktemp only generates a name, it succeeds in missing directories.
+#define WRAPPER_PATH(name, ret, params, args, fail, dirfd, path, creates, call) \
+  ret name params { \
+    __typeof__(_orig.name) orig_func = ORIG(name); \
+    if (orig_func == NULL) \
+      return fail; \
+    struct lock_stats_call stats; \
+    _stats_enter(&stats, LOCK_STATS_##name, path, NULL); \
+    LOCK_STATS_ARGUMENTS(stats, args); \
+    FORWARD_IF_NULL(stats, path, orig_func args); \
+    \
+    struct lock_match match; \
+    struct lock_target target; \
+    bool matched = _find_lockpath_prefix(&match, dirfd, path) != NULL; \
+    if (__builtin_expect(!matched, 1) || !_redirect_path(&target, &match)) { \
+      if (matched && LOCK_STATS_##name != LOCK_STATS_mktemp) \
+        RETURN_IF_BLACKHOLED(stats, match, false, fail); \
+      _stats_forward(&stats, matched && !match.prefix->blackhole ? LOCK_STATS_REWRITE_FAILED : LOCK_STATS_MISS); \
+      LOCK_STATS_RETURN(stats, orig_func args); \
+    } \
+    \
+    _stats_forward(&stats, LOCK_STATS_HIT); \
+    ret result = call; \
+    /* Our lock root may have been removed. Re-create it and try again. */ \
+    if ((creates) && result == fail && errno == ENOENT && _recreate_lock_root(target.root)) \
+      result = call; \
+    LOCK_STATS_RETURN(stats, result); \
   }
 
-  const char* lockpath_prefix_old = _find_lockpath_prefix(old);
-  const char* lockpath_prefix_new = _find_lockpath_prefix(new);
-  if (!lockpath_prefix_old && !lockpath_prefix_new)
-    return orig_func(old, new);
-
-  char old_buffer[PATH_MAX];
-  const char* new_old = old;
-  if (lockpath_prefix_old) {
-    if (_rewrite_path(old_buffer, old, lockpath_prefix_old))
-      new_old = old_buffer;
+// Redirected lookups of paths known to be missing fail without a call
+#define WRAPPER_LOOKUP(name, ret, params, args, fail, dirfd, path, call) \
+  ret name params { \
+    __typeof__(_orig.name) orig_func = ORIG(name); \
+    if (orig_func == NULL) \
+      return fail; \
+    struct lock_stats_call stats; \
+    _stats_enter(&stats, LOCK_STATS_##name, path, NULL); \
+    LOCK_STATS_ARGUMENTS(stats, args); \
+    FORWARD_IF_NULL(stats, path, orig_func args); \
+    \
+    struct lock_match match; \
+    struct lock_target target; \
+    bool matched = _find_lockpath_prefix(&match, dirfd, path) != NULL; \
+    if (__builtin_expect(!matched, 1) || !_redirect_path(&target, &match)) { \
+      if (matched) \
+        RETURN_IF_BLACKHOLED(stats, match, true, fail); \
+      _stats_forward(&stats, matched && !match.prefix->blackhole ? LOCK_STATS_REWRITE_FAILED : LOCK_STATS_MISS); \
+      LOCK_STATS_RETURN(stats, orig_func args); \
+    } \
+    \
+    _stats_forward(&stats, LOCK_STATS_HIT); \
+    if (_lookup_absent(&target)) { \
+      errno = ENOENT; \
+      LOCK_STATS_RETURN(stats, fail); \
+    } \
+    LOCK_STATS_RETURN(stats, call); \
   }
 
-  char new_buffer[PATH_MAX];
-  const char* new_new = new;
-  if (lockpath_prefix_new) {
-    if (_rewrite_path(new_buffer, new, lockpath_prefix_new))
-      new_new = new_buffer;
+#define WRAPPER_PATH2(name, ret, params, args, fail, dirfd1, path1, dirfd2, path2, creates, call) \
+  ret name params { \
+    __typeof__(_orig.name) orig_func = ORIG(name); \
+    if (orig_func == NULL) \
+      return fail; \
+    struct lock_stats_call stats; \
+    _stats_enter(&stats, LOCK_STATS_##name, path1, path2); \
+    LOCK_STATS_ARGUMENTS(stats, args); \
+    \
+    struct lock_match match1; \
+    struct lock_match match2; \
+    /* A NULL path is passed on as is, the other one may be redirected */ \
+    bool matched1 = !_is_null_path(path1) && _find_lockpath_prefix(&match1, dirfd1, path1) != NULL; \
+    bool matched2 = !_is_null_path(path2) && _find_lockpath_prefix(&match2, dirfd2, path2) != NULL; \
+    if (__builtin_expect(!matched1 && !matched2, 1)) { \
+      _stats_forward(&stats, LOCK_STATS_MISS); \
+      LOCK_STATS_RETURN(stats, orig_func args); \
+    } \
+    \
+    struct lock_target target1 = { dirfd1, path1, 0 }; \
+    bool redirected1 = matched1 && _redirect_path(&target1, &match1); \
+    \
+    struct lock_target target2 = { dirfd2, path2, 0 }; \
+    bool redirected2 = matched2 && _redirect_path(&target2, &match2); \
+    \
+    if (matched1 && !redirected1) \
+      RETURN_IF_BLACKHOLED(stats, match1, false, fail); \
+    if (matched2 && !redirected2) \
+      RETURN_IF_BLACKHOLED(stats, match2, false, fail); \
+    _stats_forward(&stats, (redirected1 || redirected2) ? LOCK_STATS_HIT : LOCK_STATS_REWRITE_FAILED); \
+    ret result = call; \
+    if ((creates) && redirected2 && result == fail && errno == ENOENT && _recreate_lock_root(target2.root)) \
+      result = call; \
+    LOCK_STATS_RETURN(stats, result); \
   }
 
-  return orig_func(new_old, new_new);
-}
+#define WRAPPER_NONE(name, ret, params)
+
+LOCKDEV_WRAPPERS(WRAPPER_OPEN, WRAPPER_OPEN2, WRAPPER_PATH, WRAPPER_LOOKUP, WRAPPER_PATH2, WRAPPER_NONE, WRAPPER_NONE)
+
 
 //
-// Implementations up to this line make lockdev work properly
+// Hand-written wrappers
 //
 
-int chmod(const char *file, __mode_t mode) {
-  orig_chmod_func_type orig_func;
-  orig_func = (orig_chmod_func_type)dlsym(RTLD_NEXT, "chmod");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call chmod\n");
+// Lock paths are entered through the lock root, like the open wrappers do.
+// Relative paths below them then reach the redirect target without any
+// rewrite. For parents of lock paths (like "/var") the automaton state is
+// kept, so relative paths from there are matched like absolute ones.
+int chdir(const char* path) {
+  __typeof__(_orig.chdir) orig_func = ORIG(chdir);
+  if (orig_func == NULL)
     return -1;
+  struct lock_stats_call stats;
+  _stats_enter(&stats, LOCK_STATS_chdir, path, NULL);
+  LOCK_STATS_ARGUMENTS(stats, (path));
+  FORWARD_IF_NULL(stats, path, orig_func(path));
+
+  struct lock_match match;
+  struct lock_target target;
+  bool matched = _find_lockpath_prefix(&match, AT_FDCWD, path) != NULL;
+  if (__builtin_expect(!matched, 1) || !_redirect_path(&target, &match)) {
+    if (matched)
+      RETURN_IF_BLACKHOLED(stats, match, true, -1);
+    _stats_forward(&stats, matched && !match.prefix->blackhole ? LOCK_STATS_REWRITE_FAILED : LOCK_STATS_MISS);
+    int result = orig_func(path);
+    if (result == 0)
+      _set_cwd(&match);
+    else if (!matched && match.state == STATE_DEAD)
+      _reset_cwd();
+    LOCK_STATS_RETURN(stats, result);
   }
 
-  const char* lockpath_prefix = _find_lockpath_prefix(file);
-  if (!lockpath_prefix)
-    return orig_func(file, mode);
+  _stats_forward(&stats, LOCK_STATS_HIT);
+  int fd = ORIG(openat)(target.dirfd, target.path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  int result = fd == -1 ? -1 : ORIG(fchdir)(fd);
+  if (fd != -1) {
+    int saved_errno = errno;
+    ORIG(close)(fd);
+    errno = saved_errno;
+  }
+  if (result == 0)
+    _set_cwd(&match);
+  LOCK_STATS_RETURN(stats, result);
+}
 
-  char new_path[PATH_MAX];
-  if (!_rewrite_path(new_path, file, lockpath_prefix))
-    return orig_func(file, mode);
 
-  return orig_func(new_path, mode);
+int fchdir(int fd) {
+  __typeof__(_orig.fchdir) orig_func = ORIG(fchdir);
+  if (orig_func == NULL)
+    return -1;
+  struct lock_stats_call stats;
+  _stats_enter(&stats, LOCK_STATS_fchdir, NULL, NULL);
+  LOCK_STATS_ARGUMENTS(stats, (fd));
+
+  _stats_forward(&stats, LOCK_STATS_MISS);
+  int result = orig_func(fd);
+  if (result == 0)
+    _set_cwd_fd(fd);
+  else if (fd < 0 || fd >= FD_TABLE_SIZE || !__atomic_load_n(&_fd_table[fd], __ATOMIC_RELAXED))
+    _reset_cwd();
+  LOCK_STATS_RETURN(stats, result);
 }
 
 
-extern int scandir (const char *__restrict dir, struct dirent ***__restrict namelist, int (*selector) (const struct dirent *), int (*cmp) (const struct dirent **, const struct dirent **)) {
-  orig_scandir_func_type orig_func;
-  orig_func = (orig_scandir_func_type)dlsym(RTLD_NEXT, "scandir");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call scandir\n");
+int close(int fd) {
+  __typeof__(_orig.close) orig_func = ORIG(close);
+  if (orig_func == NULL)
     return -1;
-  }
-
-  const char* lockpath_prefix = _find_lockpath_prefix(dir);
-  if (!lockpath_prefix)
-    return orig_func(dir, namelist, selector, cmp);
 
-  char new_path[PATH_MAX];
-  if (!_rewrite_path(new_path, dir, lockpath_prefix))
-    return orig_func(dir, namelist, selector, cmp);
+  struct lock_stats_call stats;
+  _stats_enter(&stats, LOCK_STATS_close, NULL, NULL);
+  LOCK_STATS_ARGUMENTS(stats, (fd));
 
-  return orig_func(new_path, namelist, selector, cmp);
+  if (__builtin_expect(_is_lock_root_fd_range(fd, fd), 0))
+    _forget_lock_root_fds(fd, fd);
+  _untrack_fd(fd);
+  _stats_forward(&stats, LOCK_STATS_MISS);
+  LOCK_STATS_RETURN(stats, orig_func(fd));
 }
 
 
-FILE *fopen64 (const char *filename, const char *modes) {
-  orig_fopen64_func_type orig_func;
-  orig_func = (orig_fopen64_func_type)dlsym(RTLD_NEXT, "fopen64");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call fopen64\n");
+// Parents of lock paths (like "/var") are tracked like by the open
+// wrappers, so *at() calls relative to dirfd() of the stream are matched.
+DIR* opendir(const char* name) {
+  __typeof__(_orig.opendir) orig_func = ORIG(opendir);
+  if (orig_func == NULL)
     return NULL;
+  struct lock_stats_call stats;
+  _stats_enter(&stats, LOCK_STATS_opendir, name, NULL);
+  LOCK_STATS_ARGUMENTS(stats, (name));
+  FORWARD_IF_NULL(stats, name, orig_func(name));
+
+  struct lock_match match;
+  struct lock_target target;
+  bool matched = _find_lockpath_prefix(&match, AT_FDCWD, name) != NULL;
+  if (__builtin_expect(!matched, 1) || !_redirect_path(&target, &match)) {
+    if (matched)
+      RETURN_IF_BLACKHOLED(stats, match, false, NULL);
+    _stats_forward(&stats, matched && !match.prefix->blackhole ? LOCK_STATS_REWRITE_FAILED : LOCK_STATS_MISS);
+    DIR* dir = orig_func(name);
+    if (dir)
+      _track_fd_if_needed(dirfd(dir), &match);
+    LOCK_STATS_RETURN(stats, dir);
   }
 
-  const char* lockpath_prefix = _find_lockpath_prefix(filename);
-  if (!lockpath_prefix)
-    return orig_func(filename, modes);
+  _stats_forward(&stats, LOCK_STATS_HIT);
+  LOCK_STATS_RETURN(stats, _opendir_at(&target));
+}
 
-  char new_path[PATH_MAX];
-  if (!_rewrite_path(new_path, filename, lockpath_prefix))
-    return orig_func(filename, modes);
 
-  return orig_func(new_path, modes);
+int dup(int fd) {
+  __typeof__(_orig.dup) orig_func = ORIG(dup);
+  if (orig_func == NULL)
+    return -1;
+  struct lock_stats_call stats;
+  _stats_enter(&stats, LOCK_STATS_dup, NULL, NULL);
+  LOCK_STATS_ARGUMENTS(stats, (fd));
+
+  _stats_forward(&stats, LOCK_STATS_MISS);
+  int result = orig_func(fd);
+  if (result != -1)
+    _copy_fd(fd, result);
+  LOCK_STATS_RETURN(stats, result);
 }
 
 
-int remove(const char *filename) {
-  orig_remove_func_type orig_func;
-  orig_func = (orig_remove_func_type)dlsym(RTLD_NEXT, "remove");
-  if (orig_func == NULL) {
-    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call remove\n");
+int dup2(int fd, int fd2) {
+  __typeof__(_orig.dup2) orig_func = ORIG(dup2);
+  if (orig_func == NULL)
     return -1;
-  }
+  struct lock_stats_call stats;
+  _stats_enter(&stats, LOCK_STATS_dup2, NULL, NULL);
+  LOCK_STATS_ARGUMENTS(stats, (fd, fd2));
+
+  if (__builtin_expect(_is_lock_root_fd_range(fd2, fd2), 0) && fd != fd2)
+    _forget_lock_root_fds(fd2, fd2);
+  _stats_forward(&stats, LOCK_STATS_MISS);
+  int result = orig_func(fd, fd2);
+  if (result != -1)
+    _copy_fd(fd, fd2);
+  LOCK_STATS_RETURN(stats, result);
+}
+
+
+int dup3(int fd, int fd2, int flags) {
+  __typeof__(_orig.dup3) orig_func = ORIG(dup3);
+  if (orig_func == NULL)
+    return -1;
+  struct lock_stats_call stats;
+  _stats_enter(&stats, LOCK_STATS_dup3, NULL, NULL);
+  LOCK_STATS_ARGUMENTS(stats, (fd, fd2, flags));
+
+  if (__builtin_expect(_is_lock_root_fd_range(fd2, fd2), 0) && fd != fd2)
+    _forget_lock_root_fds(fd2, fd2);
+  _stats_forward(&stats, LOCK_STATS_MISS);
+  int result = orig_func(fd, fd2, flags);
+  if (result != -1)
+    _copy_fd(fd, fd2);
+  LOCK_STATS_RETURN(stats, result);
+}
+
+
+int close_range(unsigned int fd, unsigned int max_fd, int flags) {
+  __typeof__(_orig.close_range) orig_func = ORIG(close_range);
+  if (orig_func == NULL)
+    return -1;
+  struct lock_stats_call stats;
+  _stats_enter(&stats, LOCK_STATS_close_range, NULL, NULL);
+
+  // With CLOSE_RANGE_CLOEXEC nothing gets closed. Our descriptors already
+  // have O_CLOEXEC set.
+  int last = max_fd > INT_MAX ? INT_MAX : (int)max_fd;
+  if (!(flags & CLOSE_RANGE_CLOEXEC) && fd <= INT_MAX && _is_lock_root_fd_range(fd, last))
+    _forget_lock_root_fds(fd, last);
+  if (!(flags & CLOSE_RANGE_CLOEXEC) && fd <= INT_MAX)
+    _untrack_fds(fd, last);
+  _stats_forward(&stats, LOCK_STATS_MISS);
+  LOCK_STATS_RETURN(stats, orig_func(fd, max_fd, flags));
+}
 
-  const char* lockpath_prefix = _find_lockpath_prefix(filename);
-  if (!lockpath_prefix)
-    return orig_func(filename);
 
-  char new_path[PATH_MAX];
-  if (!_rewrite_path(new_path, filename, lockpath_prefix))
-    return orig_func(filename);
+void closefrom(int lowfd) {
+  __typeof__(_orig.closefrom) orig_func = ORIG(closefrom);
+  if (orig_func == NULL)
+    return;
+  struct lock_stats_call stats;
+  _stats_enter(&stats, LOCK_STATS_closefrom, NULL, NULL);
 
-  return orig_func(new_path);
+  if (_is_lock_root_fd_range(lowfd, INT_MAX))
+    _forget_lock_root_fds(lowfd, INT_MAX);
+  _untrack_fds(lowfd, INT_MAX);
+  _stats_forward(&stats, LOCK_STATS_MISS);
+  orig_func(lowfd);
+  _stats_leave(&stats, 0, false);
+}
+
+
+// Shared by fcntl and fcntl64. Only F_DUPFD and F_DUPFD_CLOEXEC create
+// descriptors we have to track.
+static int _fcntl_tracked(int (*orig_func)(int, int, ...), unsigned int id, int fd, int cmd, void* arg) {
+  struct lock_stats_call stats;
+  _stats_enter(&stats, id, NULL, NULL);
+  LOCK_STATS_ARGUMENTS(stats, (fd, cmd, arg));
+
+  _stats_forward(&stats, LOCK_STATS_MISS);
+  int result = orig_func(fd, cmd, arg);
+  if (result != -1 && (cmd == F_DUPFD || cmd == F_DUPFD_CLOEXEC))
+    _copy_fd(fd, result);
+  LOCK_STATS_RETURN(stats, result);
+}
+
+// Like glibc, the optional argument is passed on as pointer, no matter if
+// it is one
+int fcntl(int fd, int cmd, ...) {
+  __typeof__(_orig.fcntl) orig_func = ORIG(fcntl);
+  if (orig_func == NULL)
+    return -1;
+  va_list args;
+  va_start(args, cmd);
+  void* arg = va_arg(args, void*);
+  va_end(args);
+  return _fcntl_tracked(orig_func, LOCK_STATS_fcntl, fd, cmd, arg);
+}
+
+
+int fcntl64(int fd, int cmd, ...) {
+  __typeof__(_orig.fcntl64) orig_func = ORIG(fcntl64);
+  if (orig_func == NULL)
+    return -1;
+  va_list args;
+  va_start(args, cmd);
+  void* arg = va_arg(args, void*);
+  va_end(args);
+  return _fcntl_tracked(orig_func, LOCK_STATS_fcntl64, fd, cmd, arg);
 }
 
 //
-// Implementations up to this line make MATLAB libmwserialsupport.so work
+// Implementations up to this line keep our descriptor tracking valid
 //
@@ -0,0 +1,200 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Namespace mode of the launcher. Enters a new user and mount namespace and
+// bind mounts the lock root over /var/lock and /run/lock, so the command
+// sees the redirect without any preload library and without any per-call
+// overhead. Needs unprivileged user namespaces. If they are not available,
+// the command is started with lockdev-redirect.so instead. There are no
+// blackholes and no alias detection in this mode.
+//
+// Usage: lockdev-redirect-ns [--no-fallback] COMMAND [ARGS...]
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+
+// Lock directories which are replaced. Only the default configuration can
+// be represented with bind mounts.
+static const char* const LOCK_PATHS[] = { "/var/lock", "/run/lock", NULL };
+#define MAX_MOUNTS 2
+
+
+// Writes a string to a file in /proc/self
+static bool _write_file(const char* path, const char* content) {
+  int fd = open(path, O_WRONLY | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  ssize_t len = strlen(content);
+  bool success = write(fd, content, len) == len;
+  close(fd);
+  return success;
+}
+
+// Checks for a configuration the bind mounts can't represent (other paths,
+// other targets, blackholes)
+static bool _has_custom_config(void) {
+  if (getenv("LOCKDEV_REDIRECT_PATHS"))
+    return true;
+
+  char path[PATH_MAX];
+  const char* config_home = getenv("XDG_CONFIG_HOME");
+  const char* home = getenv("HOME");
+  int n = -1;
+  if (config_home && config_home[0])
+    n = snprintf(path, PATH_MAX, "%s/lockdev-redirect.conf", config_home);
+  else if (home && home[0])
+    n = snprintf(path, PATH_MAX, "%s/.config/lockdev-redirect.conf", home);
+  if (n > 0 && n < PATH_MAX && access(path, F_OK) == 0)
+    return true;
+  return access("/etc/lockdev-redirect.conf", F_OK) == 0;
+}
+
+// Creates the lock root like lockdev-redirect.so does
+// Return value: true on success. false otherwise.
+static bool _create_lock_root(char* root, size_t size) {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (!runtime_dir || !runtime_dir[0]) {
+    errno = ENOENT;
+    return false;
+  }
+  int n = snprintf(root, size, "%s/lock", runtime_dir);
+  if (n < 0 || (size_t)n + sizeof("/lockdev") > size) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  if (mkdir(root, 0700) != 0 && errno != EEXIST)
+    return false;
+  strcat(root, "/lockdev");
+  bool success = mkdir(root, 0700) == 0 || errno == EEXIST;
+  root[n] = '\0';
+  return success;
+}
+
+// Gives up after unshare succeeded. The command must not run in a half set
+// up namespace, not even with the library: /var/lock might not be mounted
+// over, and only our own IDs may be mapped.
+static void __attribute__ ((noreturn)) _setup_failed(const char* step) {
+  fprintf(stderr, "lockdev-redirect: Failed to set up the namespace (%s), %s\n", step, strerror(errno));
+  exit(1);
+}
+
+// Enters the namespaces and mounts the lock root. Exits if something fails
+// once the namespaces exist.
+// Return value: true on success. false with errno set if the namespaces
+//               can't be used at all.
+static bool _enter_namespace(void) {
+  if (_has_custom_config()) {
+    errno = ENOTSUP;
+    return false;
+  }
+
+  char root[PATH_MAX];
+  if (!_create_lock_root(root, PATH_MAX))
+    return false;
+
+  // /var/lock usually is a symlink to /run/lock. Mount only once per
+  // directory.
+  const char* targets[MAX_MOUNTS];
+  struct stat identities[MAX_MOUNTS];
+  unsigned int target_count = 0;
+  for (const char* const* path = LOCK_PATHS; *path; path++) {
+    struct stat stat_buf;
+    if (stat(*path, &stat_buf) != 0 || !S_ISDIR(stat_buf.st_mode))
+      continue;
+    unsigned int i;
+    for (i = 0; i < target_count; i++) {
+      if (identities[i].st_dev == stat_buf.st_dev && identities[i].st_ino == stat_buf.st_ino)
+        break;
+    }
+    if (i == target_count) {
+      targets[target_count] = *path;
+      identities[target_count++] = stat_buf;
+    }
+  }
+  if (!target_count) {
+    errno = ENOENT;
+    return false;
+  }
+
+  // Keep our IDs inside the namespace. Supplementary groups can't be mapped
+  // and show up as the overflow group.
+  char uid_map[64];
+  char gid_map[64];
+  snprintf(uid_map, sizeof(uid_map), "%u %u 1\n", getuid(), getuid());
+  snprintf(gid_map, sizeof(gid_map), "%u %u 1\n", getgid(), getgid());
+  if (unshare(CLONE_NEWUSER | CLONE_NEWNS) != 0)
+    return false;
+  if (!_write_file("/proc/self/setgroups", "deny") ||
+      !_write_file("/proc/self/uid_map", uid_map) ||
+      !_write_file("/proc/self/gid_map", gid_map))
+    _setup_failed("ID mapping");
+
+  // Don't propagate our mounts back
+  if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0)
+    _setup_failed("/");
+  for (unsigned int i = 0; i < target_count; i++) {
+    if (mount(root, targets[i], NULL, MS_BIND, NULL) != 0)
+      _setup_failed(targets[i]);
+  }
+  return true;
+}
+
+// Adds lockdev-redirect.so to LD_PRELOAD like the launcher does
+static void _add_preload(void) {
+  const char* preload = getenv("LD_PRELOAD");
+  char value[PATH_MAX];
+  int n = snprintf(value, PATH_MAX, "%s%slockdev-redirect.so", preload ? preload : "", preload && preload[0] ? ":" : "");
+  if (n > 0 && n < PATH_MAX)
+    setenv("LD_PRELOAD", value, 1);
+}
+
+
+int main(int argc, char *argv[]) {
+  bool fallback = true;
+  int first = 1;
+  if (first < argc && strcmp(argv[first], "--no-fallback") == 0) {
+    fallback = false;
+    first++;
+  }
+  if (first >= argc) {
+    fprintf(stderr, "Usage: %s [--no-fallback] COMMAND [ARGS...]\n", argv[0]);
+    return 1;
+  }
+
+  if (!_enter_namespace()) {
+    if (!fallback) {
+      fprintf(stderr, "lockdev-redirect: Namespace mode not available, %s\n", strerror(errno));
+      return 1;
+    }
+    _add_preload();
+  }
+
+  execvp(argv[first], argv + first);
+  fprintf(stderr, "lockdev-redirect: Failed to execute %s, %s\n", argv[first], strerror(errno));
+  return 127;
+}
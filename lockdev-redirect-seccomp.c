@@ -0,0 +1,578 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Seccomp mode of the launcher. Statically linked programs and programs
+// which issue syscalls directly (Go, some Rust crates) never call the glibc
+// functions lockdev-redirect.so overrides. This supervisor starts the
+// command with a seccomp filter which passes every syscall without a path
+// argument in the kernel and hands the path syscalls to us with
+// SECCOMP_RET_USER_NOTIF.
+//
+// The supervisor is linked with the objects of lockdev-redirect.so, so it
+// reads the same configuration and its own calls are redirected by the
+// same wrappers. Syscalls on lock paths are done here through these
+// wrappers on behalf of the command. Opened descriptors are installed into
+// the command with SECCOMP_IOCTL_NOTIF_ADDFD. All other paths continue in
+// the kernel unchanged.
+//
+// Needs SECCOMP_RET_USER_NOTIF (Linux 5.0, 5.14 for atomic ADDFD). If it
+// is not available, the command is started with lockdev-redirect.so instead.
+//
+// Usage: lockdev-redirect-seccomp [--no-fallback] COMMAND [ARGS...]
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+#include "utilities.h"
+
+#if defined(__x86_64__)
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define AUDIT_ARCH_NATIVE AUDIT_ARCH_AARCH64
+#endif
+
+// What a trapped syscall does with its path arguments
+enum {
+  OP_OPEN,
+  OP_STAT,
+  OP_STATX,
+  OP_ACCESS,
+  OP_MKDIR,
+  OP_UNLINK,
+  OP_RMDIR,
+  OP_RENAME,
+  OP_LINK,
+  OP_CHMOD
+};
+
+// Trapped syscalls. The same functions as in wrappers.h, seen from the
+// kernel side.
+static const int SYSCALLS[] = {
+#ifdef SYS_open
+  SYS_open, SYS_creat, SYS_stat, SYS_lstat, SYS_access, SYS_mkdir,
+  SYS_unlink, SYS_rmdir, SYS_rename, SYS_link, SYS_chmod,
+#endif
+#ifdef SYS_statx
+  SYS_statx,
+#endif
+#ifdef SYS_faccessat2
+  SYS_faccessat2,
+#endif
+#ifdef SYS_renameat2
+  SYS_renameat2,
+#endif
+  SYS_openat, SYS_newfstatat, SYS_faccessat, SYS_mkdirat, SYS_unlinkat,
+  SYS_renameat, SYS_linkat, SYS_fchmodat
+};
+#define SYSCALL_COUNT (sizeof(SYSCALLS) / sizeof(SYSCALLS[0]))
+
+// Decoded arguments of a trapped syscall
+struct request {
+  int op;
+  int dirfd1;
+  uint64_t path1;
+  int dirfd2;               // Second path of rename and link
+  uint64_t path2;
+  int flags;                // Open flags, AT_* flags or RENAME_* flags
+  unsigned int mode;        // Mode or statx mask
+  uint64_t buffer;          // Result buffer of stat and statx
+};
+
+static pid_t child_pid = -1;
+
+
+//
+// Helpers
+//
+
+static int _seccomp(unsigned int operation, unsigned int flags, void* args) {
+  return syscall(SYS_seccomp, operation, flags, args);
+}
+
+// Decodes the arguments of a trapped syscall
+// Return value: true for trapped syscalls. false otherwise.
+static bool _decode(struct request* r, const struct seccomp_data* data) {
+  const __u64* a = data->args;
+  memset(r, 0, sizeof(*r));
+  r->dirfd1 = AT_FDCWD;
+  r->dirfd2 = AT_FDCWD;
+  switch (data->nr) {
+#ifdef SYS_open
+  case SYS_open: r->op = OP_OPEN; r->path1 = a[0]; r->flags = a[1]; r->mode = a[2]; return true;
+  case SYS_creat: r->op = OP_OPEN; r->path1 = a[0]; r->flags = O_CREAT | O_WRONLY | O_TRUNC; r->mode = a[1]; return true;
+  case SYS_stat: r->op = OP_STAT; r->path1 = a[0]; r->buffer = a[1]; return true;
+  case SYS_lstat: r->op = OP_STAT; r->path1 = a[0]; r->buffer = a[1]; r->flags = AT_SYMLINK_NOFOLLOW; return true;
+  case SYS_access: r->op = OP_ACCESS; r->path1 = a[0]; r->mode = a[1]; return true;
+  case SYS_mkdir: r->op = OP_MKDIR; r->path1 = a[0]; r->mode = a[1]; return true;
+  case SYS_unlink: r->op = OP_UNLINK; r->path1 = a[0]; return true;
+  case SYS_rmdir: r->op = OP_RMDIR; r->path1 = a[0]; return true;
+  case SYS_rename: r->op = OP_RENAME; r->path1 = a[0]; r->path2 = a[1]; return true;
+  case SYS_link: r->op = OP_LINK; r->path1 = a[0]; r->path2 = a[1]; return true;
+  case SYS_chmod: r->op = OP_CHMOD; r->path1 = a[0]; r->mode = a[1]; return true;
+#endif
+#ifdef SYS_statx
+  case SYS_statx: r->op = OP_STATX; r->dirfd1 = a[0]; r->path1 = a[1]; r->flags = a[2]; r->mode = a[3]; r->buffer = a[4]; return true;
+#endif
+#ifdef SYS_faccessat2
+  case SYS_faccessat2: r->op = OP_ACCESS; r->dirfd1 = a[0]; r->path1 = a[1]; r->mode = a[2]; r->flags = a[3]; return true;
+#endif
+#ifdef SYS_renameat2
+  case SYS_renameat2: r->op = OP_RENAME; r->dirfd1 = a[0]; r->path1 = a[1]; r->dirfd2 = a[2]; r->path2 = a[3]; r->flags = a[4]; return true;
+#endif
+  case SYS_openat: r->op = OP_OPEN; r->dirfd1 = a[0]; r->path1 = a[1]; r->flags = a[2]; r->mode = a[3]; return true;
+  case SYS_newfstatat: r->op = OP_STAT; r->dirfd1 = a[0]; r->path1 = a[1]; r->buffer = a[2]; r->flags = a[3]; return true;
+  case SYS_faccessat: r->op = OP_ACCESS; r->dirfd1 = a[0]; r->path1 = a[1]; r->mode = a[2]; return true;
+  case SYS_mkdirat: r->op = OP_MKDIR; r->dirfd1 = a[0]; r->path1 = a[1]; r->mode = a[2]; return true;
+  case SYS_unlinkat: r->op = (a[2] & AT_REMOVEDIR) ? OP_RMDIR : OP_UNLINK; r->dirfd1 = a[0]; r->path1 = a[1]; return true;
+  case SYS_renameat: r->op = OP_RENAME; r->dirfd1 = a[0]; r->path1 = a[1]; r->dirfd2 = a[2]; r->path2 = a[3]; return true;
+  case SYS_linkat: r->op = OP_LINK; r->dirfd1 = a[0]; r->path1 = a[1]; r->dirfd2 = a[2]; r->path2 = a[3]; r->flags = a[4]; return true;
+  case SYS_fchmodat: r->op = OP_CHMOD; r->dirfd1 = a[0]; r->path1 = a[1]; r->mode = a[2]; return true;
+  }
+  return false;
+}
+
+// Reads a path from the memory of the traced process. Reads up to page
+// boundaries only, the string may end right before an unmapped page.
+// Return value: true on success. false if unreadable or too long.
+static bool _read_path(pid_t pid, uint64_t address, char* path) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  size_t pos = 0;
+  while (pos < PATH_MAX) {
+    size_t chunk = page - ((address + pos) & (page - 1));
+    if (chunk > PATH_MAX - pos)
+      chunk = PATH_MAX - pos;
+    struct iovec local = { path + pos, chunk };
+    struct iovec remote = { (void*)(uintptr_t)(address + pos), chunk };
+    ssize_t n = process_vm_readv(pid, &local, 1, &remote, 1, 0);
+    if (n <= 0)
+      return false;
+    if (memchr(path + pos, '\0', n))
+      return true;
+    pos += n;
+  }
+  return false;
+}
+
+// Makes a path of the traced process absolute. Relative paths are resolved
+// against its working directory or "dirfd" as seen in /proc.
+// Return value: true on success. false if the path can't be resolved here.
+static bool _absolute_path(pid_t pid, int dirfd, const char* path, char* absolute) {
+  if (path[0] == '/') {
+    strcpy(absolute, path);
+    return true;
+  }
+  // Empty paths with AT_EMPTY_PATH work on "dirfd" itself
+  if (path[0] == '\0')
+    return false;
+
+  char link[64];
+  if (dirfd == AT_FDCWD)
+    snprintf(link, sizeof(link), "/proc/%d/cwd", pid);
+  else
+    snprintf(link, sizeof(link), "/proc/%d/fd/%d", pid, dirfd);
+  ssize_t len = readlink(link, absolute, PATH_MAX);
+  if (len <= 0 || len >= PATH_MAX || absolute[0] != '/')
+    return false;
+  size_t path_len = strlen(path);
+  if (len + 1 + path_len >= PATH_MAX)
+    return false;
+  absolute[len] = '/';
+  memcpy(absolute + len + 1, path, path_len + 1);
+  return true;
+}
+
+// Reads the umask of the traced process. Creating calls are done with it.
+static mode_t _get_umask(pid_t pid) {
+  char path[64];
+  char status[4096];
+  snprintf(path, sizeof(path), "/proc/%d/status", pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 022;
+  ssize_t len = read(fd, status, sizeof(status) - 1);
+  close(fd);
+  if (len <= 0)
+    return 022;
+  status[len] = '\0';
+  const char* line = strstr(status, "\nUmask:");
+  return line ? strtoul(line + 7, NULL, 8) & 0777 : 022;
+}
+
+static bool _write_memory(pid_t pid, uint64_t address, const void* data, size_t size) {
+  struct iovec local = { (void*)data, size };
+  struct iovec remote = { (void*)(uintptr_t)address, size };
+  return process_vm_writev(pid, &local, 1, &remote, 1, 0) == (ssize_t)size;
+}
+
+
+//
+// Supervisor
+//
+
+static void _respond(int listener, struct seccomp_notif_resp* resp, uint64_t id, int64_t val, int error, uint32_t flags) {
+  resp->id = id;
+  resp->val = val;
+  resp->error = error;
+  resp->flags = flags;
+  // Fails if the process is gone
+  ioctl(listener, SECCOMP_IOCTL_NOTIF_SEND, resp);
+}
+
+// Installs a descriptor opened on behalf of the traced process into it and
+// completes its open call
+static void _send_fd(int listener, struct seccomp_notif_resp* resp, uint64_t id, int fd, int oflag) {
+  struct seccomp_notif_addfd addfd = {
+    .id = id,
+    .flags = SECCOMP_ADDFD_FLAG_SEND,
+    .srcfd = fd,
+    .newfd = 0,
+    .newfd_flags = oflag & O_CLOEXEC
+  };
+  int result = ioctl(listener, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+  // Before Linux 5.14 installing and answering are two steps
+  if (result == -1 && errno == EINVAL) {
+    addfd.flags = 0;
+    result = ioctl(listener, SECCOMP_IOCTL_NOTIF_ADDFD, &addfd);
+    if (result >= 0)
+      _respond(listener, resp, id, result, 0, 0);
+    else
+      _respond(listener, resp, id, 0, -errno, 0);
+  }
+  // Like EMFILE if the process hit RLIMIT_NOFILE. Without a response the
+  // traced thread would wait forever.
+  else if (result == -1)
+    _respond(listener, resp, id, 0, -errno, 0);
+  close(fd);
+}
+
+// Does a trapped syscall on a lock path through the wrappers
+static void _emulate(int listener, const struct seccomp_notif* req, struct seccomp_notif_resp* resp,
+                     const struct request* r, const char* path1, const char* path2) {
+  pid_t pid = req->pid;
+  int64_t result = -1;
+  errno = 0;
+
+  bool creates = r->op == OP_MKDIR || (r->op == OP_OPEN && ((r->flags & O_CREAT) || (r->flags & O_TMPFILE) == O_TMPFILE));
+  if (creates)
+    umask(_get_umask(pid));
+
+  switch (r->op) {
+  case OP_OPEN: {
+    int fd = openat(AT_FDCWD, path1, r->flags | O_CLOEXEC, r->mode);
+    if (creates)
+      umask(0);
+    if (fd != -1) {
+      _send_fd(listener, resp, req->id, fd, r->flags);
+      return;
+    }
+    break;
+  }
+  case OP_STAT: {
+    struct stat buf;
+    result = (r->flags & AT_SYMLINK_NOFOLLOW) ? lstat(path1, &buf) : stat(path1, &buf);
+    if (result == 0 && !_write_memory(pid, r->buffer, &buf, sizeof(buf))) {
+      result = -1;
+      errno = EFAULT;
+    }
+    break;
+  }
+  case OP_STATX: {
+    struct statx buf;
+    result = statx(AT_FDCWD, path1, r->flags, r->mode, &buf);
+    if (result == 0 && !_write_memory(pid, r->buffer, &buf, sizeof(buf))) {
+      result = -1;
+      errno = EFAULT;
+    }
+    break;
+  }
+  case OP_ACCESS: result = faccessat(AT_FDCWD, path1, r->mode, r->flags); break;
+  case OP_MKDIR: result = mkdir(path1, r->mode); umask(0); break;
+  case OP_UNLINK: result = unlink(path1); break;
+  case OP_RMDIR: result = rmdir(path1); break;
+  case OP_RENAME: result = renameat2(AT_FDCWD, path1, AT_FDCWD, path2, r->flags); break;
+  case OP_LINK: result = linkat(AT_FDCWD, path1, AT_FDCWD, path2, r->flags); break;
+  case OP_CHMOD: result = chmod(path1, r->mode); break;
+  }
+
+  _respond(listener, resp, req->id, result, result < 0 ? -errno : 0, 0);
+}
+
+// Handles one trapped syscall
+static void _handle(int listener, const struct seccomp_notif* req, struct seccomp_notif_resp* resp) {
+  struct request r;
+  char path1[PATH_MAX];
+  char path2[PATH_MAX];
+  char absolute1[PATH_MAX];
+  char absolute2[PATH_MAX];
+  bool matched = false;
+
+  if (_decode(&r, &req->data) && _read_path(req->pid, r.path1, path1) &&
+      (!r.path2 || _read_path(req->pid, r.path2, path2))) {
+    struct lock_match match;
+    bool resolved = _absolute_path(req->pid, r.dirfd1, path1, absolute1);
+    matched = resolved && _find_lockpath_prefix(&match, AT_FDCWD, absolute1);
+    if (r.path2 && resolved) {
+      resolved = _absolute_path(req->pid, r.dirfd2, path2, absolute2);
+      matched = resolved && (matched || _find_lockpath_prefix(&match, AT_FDCWD, absolute2));
+    }
+  }
+
+  // The process may have died and its PID been reused while we read its
+  // memory
+  if (!matched || ioctl(listener, SECCOMP_IOCTL_NOTIF_ID_VALID, &req->id) != 0) {
+    _respond(listener, resp, req->id, 0, 0, SECCOMP_USER_NOTIF_FLAG_CONTINUE);
+    return;
+  }
+  _emulate(listener, req, resp, &r, absolute1, absolute2);
+}
+
+static void _forward_signal(int sig) {
+  if (child_pid > 0)
+    kill(child_pid, sig);
+}
+
+static void _ignore_signal(int sig) {
+}
+
+// Serves the listener until no process uses the filter anymore
+// Return value: Wait status of the command
+static int _supervise(int listener) {
+  struct seccomp_notif_sizes sizes;
+  if (_seccomp(SECCOMP_GET_NOTIF_SIZES, 0, &sizes) != 0) {
+    sizes.seccomp_notif = sizeof(struct seccomp_notif);
+    sizes.seccomp_notif_resp = sizeof(struct seccomp_notif_resp);
+  }
+  struct seccomp_notif* req = malloc(sizes.seccomp_notif > sizeof(*req) ? sizes.seccomp_notif : sizeof(*req));
+  struct seccomp_notif_resp* resp = malloc(sizes.seccomp_notif_resp > sizeof(*resp) ? sizes.seccomp_notif_resp : sizeof(*resp));
+  if (!req || !resp) {
+    fprintf(stderr, "lockdev-redirect: Out of memory\n");
+    exit(1);
+  }
+
+  // SIGCHLD only interrupts ppoll, so the exit of the command can't slip
+  // through between waitpid and ppoll. A zombie keeps the filter in use.
+  sigset_t blocked;
+  sigset_t unblocked;
+  sigemptyset(&blocked);
+  sigaddset(&blocked, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &blocked, &unblocked);
+  struct sigaction action = { .sa_handler = _ignore_signal };
+  sigaction(SIGCHLD, &action, NULL);
+
+  int status = 0;
+  bool exited = false;
+  umask(0);
+  for (;;) {
+    if (!exited && waitpid(child_pid, &status, WNOHANG) == child_pid)
+      exited = true;
+
+    struct pollfd pfd = { listener, POLLIN, 0 };
+    if (ppoll(&pfd, 1, NULL, &unblocked) == -1)
+      continue;
+    if (pfd.revents & POLLIN) {
+      memset(req, 0, sizes.seccomp_notif);
+      // Fails if the process was killed before we got to it
+      if (ioctl(listener, SECCOMP_IOCTL_NOTIF_RECV, req) == 0)
+        _handle(listener, req, resp);
+      continue;
+    }
+    if (pfd.revents & (POLLHUP | POLLERR | POLLNVAL))
+      break;
+  }
+
+  if (!exited)
+    waitpid(child_pid, &status, 0);
+  return status;
+}
+
+
+//
+// Filter
+//
+
+// Checks for SECCOMP_RET_USER_NOTIF
+static bool _seccomp_available(void) {
+#ifdef AUDIT_ARCH_NATIVE
+  uint32_t action = SECCOMP_RET_USER_NOTIF;
+  return _seccomp(SECCOMP_GET_ACTION_AVAIL, 0, &action) == 0;
+#else
+  errno = ENOTSUP;
+  return false;
+#endif
+}
+
+// Installs the filter into the current process
+// Return value: Listener descriptor. -1 on error.
+static int _install_filter(void) {
+#ifdef AUDIT_ARCH_NATIVE
+  // Other architectures (like 32 bit programs on x86_64) use other syscall
+  // numbers and are let through. So are x32 syscalls.
+  struct sock_filter filter[SYSCALL_COUNT + 5];
+  unsigned int n = 0;
+  filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch));
+  filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_NATIVE, 0, SYSCALL_COUNT + 1);
+  filter[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr));
+  for (unsigned int i = 0; i < SYSCALL_COUNT; i++)
+    filter[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYSCALLS[i], SYSCALL_COUNT - i, 0);
+  filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW);
+  filter[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF);
+  struct sock_fprog program = { n, filter };
+
+  // Required to install filters without CAP_SYS_ADMIN. Also means that
+  // setuid programs don't gain privileges.
+  if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0)
+    return -1;
+  return _seccomp(SECCOMP_SET_MODE_FILTER, SECCOMP_FILTER_FLAG_NEW_LISTENER, &program);
+#else
+  errno = ENOTSUP;
+  return -1;
+#endif
+}
+
+static bool _send_listener(int sock, int listener) {
+  char byte = 0;
+  struct iovec iov = { &byte, 1 };
+  char control[CMSG_SPACE(sizeof(int))];
+  memset(control, 0, sizeof(control));
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &listener, sizeof(int));
+  return sendmsg(sock, &msg, 0) == 1;
+}
+
+static int _receive_listener(int sock) {
+  char byte;
+  struct iovec iov = { &byte, 1 };
+  char control[CMSG_SPACE(sizeof(int))];
+  struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control) };
+  if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1)
+    return -1;
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+    return -1;
+  int listener;
+  memcpy(&listener, CMSG_DATA(cmsg), sizeof(int));
+  return listener;
+}
+
+// Adds lockdev-redirect.so to LD_PRELOAD like the launcher does
+static void _add_preload(void) {
+  const char* preload = getenv("LD_PRELOAD");
+  char value[PATH_MAX];
+  int n = snprintf(value, PATH_MAX, "%s%slockdev-redirect.so", preload ? preload : "", preload && preload[0] ? ":" : "");
+  if (n > 0 && n < PATH_MAX)
+    setenv("LD_PRELOAD", value, 1);
+}
+
+
+int main(int argc, char *argv[]) {
+  bool fallback = true;
+  int first = 1;
+  if (first < argc && strcmp(argv[first], "--no-fallback") == 0) {
+    fallback = false;
+    first++;
+  }
+  if (first >= argc) {
+    fprintf(stderr, "Usage: %s [--no-fallback] COMMAND [ARGS...]\n", argv[0]);
+    return 1;
+  }
+
+  // All emulated calls run in this process. The lock table and the lock
+  // broker would see one owner for all locks.
+  _lock_table_enabled = false;
+  _broker_enabled = false;
+
+  int sockets[2];
+  if (!_seccomp_available() || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+    if (!fallback) {
+      fprintf(stderr, "lockdev-redirect: Seccomp mode not available, %s\n", strerror(errno));
+      return 1;
+    }
+    _add_preload();
+    execvp(argv[first], argv + first);
+    fprintf(stderr, "lockdev-redirect: Failed to execute %s, %s\n", argv[first], strerror(errno));
+    return 127;
+  }
+
+  child_pid = fork();
+  if (child_pid == -1) {
+    fprintf(stderr, "lockdev-redirect: Failed to fork, %s\n", strerror(errno));
+    return 1;
+  }
+  if (child_pid == 0) {
+    close(sockets[0]);
+    int listener = _install_filter();
+    if (listener == -1) {
+      fprintf(stderr, "lockdev-redirect: Failed to install seccomp filter, %s\n", strerror(errno));
+      _exit(127);
+    }
+    // Every trapped syscall from here on waits for the supervisor
+    if (!_send_listener(sockets[1], listener))
+      _exit(127);
+    close(listener);
+    close(sockets[1]);
+    execvp(argv[first], argv + first);
+    fprintf(stderr, "lockdev-redirect: Failed to execute %s, %s\n", argv[first], strerror(errno));
+    _exit(127);
+  }
+
+  // The terminal sends SIGINT and SIGQUIT to the command as well. Without
+  // us it would hang in its next trapped syscall.
+  signal(SIGINT, SIG_IGN);
+  signal(SIGQUIT, SIG_IGN);
+  signal(SIGTERM, _forward_signal);
+  signal(SIGHUP, _forward_signal);
+
+  close(sockets[1]);
+  int listener = _receive_listener(sockets[0]);
+  close(sockets[0]);
+  int status;
+  if (listener == -1)
+    waitpid(child_pid, &status, 0);
+  else
+    status = _supervise(listener);
+
+  if (WIFSIGNALED(status)) {
+    signal(WTERMSIG(status), SIG_DFL);
+    raise(WTERMSIG(status));
+    return 128 + WTERMSIG(status);
+  }
+  return WEXITSTATUS(status);
+}
@@ -0,0 +1,302 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Viewer for the live statistics segments of processes running with
+// LOCKDEV_REDIRECT_LIVE=1. Only reads the shared segments, so the observed
+// processes are never stopped or slowed down.
+//
+// Usage: lockdev-redirect-stats --stats
+//        lockdev-redirect-stats --top [-d SECONDS] [-n COUNT]
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "stats_segment.h"
+
+// Consistent copy of one segment
+struct snapshot {
+  int pid;
+  char command[64];
+  uint64_t published_ns;
+  uint32_t function_count;
+  struct lock_stats_entry* functions;
+  struct lock_stats_entry total;
+};
+
+struct snapshot_list {
+  struct snapshot* items;
+  size_t count;
+  size_t capacity;
+};
+
+static char segment_dir[PATH_MAX];
+
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Copies a mapped segment. Retries while the owner is writing to it.
+// Return value: true on success
+static bool read_segment(const struct lock_stats_segment* segment, size_t size, struct snapshot* snap) {
+  for (int attempt = 0; attempt < 1000; attempt++) {
+    uint64_t sequence = __atomic_load_n(&segment->sequence, __ATOMIC_ACQUIRE);
+    if (sequence & 1) {
+      sched_yield();
+      continue;
+    }
+
+    if (segment->magic != LOCK_STATS_SEGMENT_MAGIC || segment->version != LOCK_STATS_SEGMENT_VERSION)
+      return false;
+    uint32_t count = segment->function_count;
+    if (count > (size - sizeof(struct lock_stats_segment)) / sizeof(struct lock_stats_entry))
+      return false;
+
+    struct lock_stats_entry* functions = realloc(snap->functions, count * sizeof(struct lock_stats_entry) + 1);
+    if (!functions)
+      return false;
+    snap->functions = functions;
+    snap->pid = segment->pid;
+    memcpy(snap->command, segment->command, sizeof(snap->command));
+    snap->command[sizeof(snap->command) - 1] = '\0';
+    snap->published_ns = __atomic_load_n(&segment->published_ns, __ATOMIC_RELAXED);
+    snap->function_count = count;
+    for (uint32_t i = 0; i < count; i++) {
+      memcpy(functions[i].name, segment->functions[i].name, sizeof(functions[i].name));
+      functions[i].name[sizeof(functions[i].name) - 1] = '\0';
+      functions[i].calls = __atomic_load_n(&segment->functions[i].calls, __ATOMIC_RELAXED);
+      functions[i].hits = __atomic_load_n(&segment->functions[i].hits, __ATOMIC_RELAXED);
+      functions[i].rewrite_failures = __atomic_load_n(&segment->functions[i].rewrite_failures, __ATOMIC_RELAXED);
+      functions[i].errors = __atomic_load_n(&segment->functions[i].errors, __ATOMIC_RELAXED);
+    }
+
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&segment->sequence, __ATOMIC_RELAXED) != sequence)
+      continue;
+
+    memset(&snap->total, 0, sizeof(snap->total));
+    for (uint32_t i = 0; i < count; i++) {
+      snap->total.calls += functions[i].calls;
+      snap->total.hits += functions[i].hits;
+      snap->total.rewrite_failures += functions[i].rewrite_failures;
+      snap->total.errors += functions[i].errors;
+    }
+    return true;
+  }
+  return false;
+}
+
+// Maps and copies the segment file "name"
+// Return value: true on success
+static bool load_segment(int dirfd, const char* name, struct snapshot* snap) {
+  int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  struct stat st;
+  bool result = false;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (size_t)st.st_size >= sizeof(struct lock_stats_segment)) {
+    void* segment = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (segment != MAP_FAILED) {
+      result = read_segment(segment, st.st_size, snap);
+      munmap(segment, st.st_size);
+    }
+  }
+  close(fd);
+  return result;
+}
+
+static int compare_pid(const void* a, const void* b) {
+  return ((const struct snapshot*)a)->pid - ((const struct snapshot*)b)->pid;
+}
+
+// Reads the segments of all live processes. Segments of processes which
+// died without cleaning up are removed.
+static void collect(struct snapshot_list* list) {
+  list->count = 0;
+  DIR* dir = opendir(segment_dir);
+  if (!dir)
+    return;
+
+  struct dirent* entry;
+  while ((entry = readdir(dir))) {
+    char* end;
+    long pid = strtol(entry->d_name, &end, 10);
+    if (*end || pid <= 0)
+      continue;
+    if (kill(pid, 0) == -1 && errno == ESRCH) {
+      unlinkat(dirfd(dir), entry->d_name, 0);
+      continue;
+    }
+
+    if (list->count == list->capacity) {
+      size_t capacity = list->capacity ? list->capacity * 2 : 16;
+      struct snapshot* items = realloc(list->items, capacity * sizeof(struct snapshot));
+      if (!items)
+        break;
+      memset(items + list->capacity, 0, (capacity - list->capacity) * sizeof(struct snapshot));
+      list->items = items;
+      list->capacity = capacity;
+    }
+    if (load_segment(dirfd(dir), entry->d_name, &list->items[list->count]) &&
+        list->items[list->count].pid == pid)
+      list->count++;
+  }
+  closedir(dir);
+  qsort(list->items, list->count, sizeof(struct snapshot), compare_pid);
+}
+
+static const struct snapshot* find_pid(const struct snapshot_list* list, int pid) {
+  for (size_t i = 0; i < list->count; i++)
+    if (list->items[i].pid == pid)
+      return &list->items[i];
+  return NULL;
+}
+
+
+// --stats: Totals of every process and the functions it called
+static int show_stats(void) {
+  struct snapshot_list list = { NULL, 0, 0 };
+  collect(&list);
+  uint64_t now = now_ns();
+
+  for (size_t i = 0; i < list.count; i++) {
+    const struct snapshot* snap = &list.items[i];
+    printf("# pid %d (%s) calls=%llu hits=%llu rewrite_failures=%llu errors=%llu age=%.1fs\n",
+           snap->pid, snap->command, (unsigned long long)snap->total.calls, (unsigned long long)snap->total.hits,
+           (unsigned long long)snap->total.rewrite_failures, (unsigned long long)snap->total.errors,
+           now > snap->published_ns ? (now - snap->published_ns) / 1e9 : 0.0);
+    for (uint32_t f = 0; f < snap->function_count; f++) {
+      const struct lock_stats_entry* entry = &snap->functions[f];
+      if (!entry->calls)
+        continue;
+      printf("%d %s calls=%llu hits=%llu rewrite_failures=%llu errors=%llu\n", snap->pid, entry->name,
+             (unsigned long long)entry->calls, (unsigned long long)entry->hits,
+             (unsigned long long)entry->rewrite_failures, (unsigned long long)entry->errors);
+    }
+  }
+  if (list.count == 0)
+    printf("No processes with LOCKDEV_REDIRECT_LIVE=1 found in %s\n", segment_dir);
+  return 0;
+}
+
+// Per second rate of a counter between two snapshots. Segments are updated
+// while the process makes calls, so the publish times are used as interval.
+static double rate(uint64_t value, uint64_t old_value, const struct snapshot* snap, const struct snapshot* old) {
+  if (!old || snap->published_ns <= old->published_ns || value < old_value)
+    return 0;
+  return (value - old_value) * 1e9 / (snap->published_ns - old->published_ns);
+}
+
+// --top: Redirected call rates per process, refreshed every "delay" seconds
+static int show_top(double delay, long iterations) {
+  struct snapshot_list previous = { NULL, 0, 0 };
+  struct snapshot_list current = { NULL, 0, 0 };
+  collect(&previous);
+
+  for (long n = 0; iterations <= 0 || n < iterations; n++) {
+    struct timespec ts = { (time_t)delay, (long)((delay - (time_t)delay) * 1e9) };
+    nanosleep(&ts, NULL);
+    collect(&current);
+
+    printf("\033[H\033[J");
+    printf("lockdev-redirect: %zu processes, refresh %.1fs\n\n", current.count, delay);
+    printf("%8s %-16s %10s %10s %10s %10s %12s %12s\n", "PID", "COMMAND", "CALLS/s", "HITS/s", "FAILS/s",
+           "ERRORS/s", "CALLS", "HITS");
+    for (size_t i = 0; i < current.count; i++) {
+      const struct snapshot* snap = &current.items[i];
+      const struct snapshot* old = find_pid(&previous, snap->pid);
+      printf("%8d %-16.16s %10.1f %10.1f %10.1f %10.1f %12llu %12llu\n", snap->pid, snap->command,
+             rate(snap->total.calls, old ? old->total.calls : 0, snap, old),
+             rate(snap->total.hits, old ? old->total.hits : 0, snap, old),
+             rate(snap->total.rewrite_failures, old ? old->total.rewrite_failures : 0, snap, old),
+             rate(snap->total.errors, old ? old->total.errors : 0, snap, old),
+             (unsigned long long)snap->total.calls, (unsigned long long)snap->total.hits);
+    }
+    fflush(stdout);
+
+    // Idle processes keep their publish time, so their next rate covers the
+    // whole idle time
+    struct snapshot_list swap = previous;
+    previous = current;
+    current = swap;
+  }
+  return 0;
+}
+
+static void usage(const char* name) {
+  printf("Usage: %s --stats\n", name);
+  printf("       %s --top [-d SECONDS] [-n COUNT]\n", name);
+  printf("Shows statistics of processes started with LOCKDEV_REDIRECT_LIVE=1\n");
+}
+
+int main(int argc, char* argv[]) {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (!runtime_dir || !runtime_dir[0]) {
+    fprintf(stderr, "lockdev-redirect: XDG_RUNTIME_DIR not set!\n");
+    return 1;
+  }
+  int n = snprintf(segment_dir, PATH_MAX, "%s/%s", runtime_dir, LOCK_STATS_SEGMENT_DIR);
+  if (n < 0 || n >= PATH_MAX) {
+    fprintf(stderr, "lockdev-redirect: XDG_RUNTIME_DIR too long\n");
+    return 1;
+  }
+
+  if (argc < 2 || strcmp(argv[1], "--help") == 0) {
+    usage(argv[0]);
+    return argc < 2;
+  }
+  if (strcmp(argv[1], "--stats") == 0 && argc == 2)
+    return show_stats();
+  if (strcmp(argv[1], "--top") != 0) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  double delay = 1;
+  long iterations = 0;
+  for (int i = 2; i < argc; i++) {
+    if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+      delay = atof(argv[++i]);
+    else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc)
+      iterations = atol(argv[++i]);
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (delay <= 0) {
+    fprintf(stderr, "lockdev-redirect: Invalid delay\n");
+    return 1;
+  }
+  return show_top(delay, iterations);
+}
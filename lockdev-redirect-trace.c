@@ -0,0 +1,235 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Decoder for the trace rings written with LOCKDEV_REDIRECT_TRACE. Merges
+// the rings of all processes and threads in a directory to one timeline.
+//
+// Usage: lockdev-redirect-trace [-p PID] DIRECTORY
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "trace_ring.h"
+
+// One decoded record with the ring it came from
+struct event {
+  const struct lock_trace_ring* ring;
+  struct lock_trace_record record;
+  uint64_t start_ns;
+  uint64_t duration_ns;
+};
+
+// Conversion of ring timestamps to CLOCK_MONOTONIC
+struct conversion {
+  uint64_t ticks;
+  uint64_t ns;
+  long double ns_per_tick;
+};
+
+static struct event* events = NULL;
+static size_t event_count = 0;
+static size_t event_capacity = 0;
+
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Uses the two pairs of timestamps in the ring header. If the ring never
+// wrapped, then the second pair is taken now. This is fine as long as the
+// trace is decoded on the machine it was recorded on, before a reboot.
+static void get_conversion(const struct lock_trace_ring* ring, struct conversion* conv) {
+  conv->ticks = 0;
+  conv->ns = 0;
+  conv->ns_per_tick = 1;
+  if (ring->clock != LOCK_TRACE_CLOCK_TSC)
+    return;
+
+  uint64_t ticks1 = ring->clock_ticks[1];
+  uint64_t ns1 = ring->clock_ns[1];
+#if defined(__x86_64__) || defined(__i386__)
+  if (ns1 <= ring->clock_ns[0]) {
+    ticks1 = __builtin_ia32_rdtsc();
+    ns1 = now_ns();
+  }
+#endif
+  conv->ticks = ring->clock_ticks[0];
+  conv->ns = ring->clock_ns[0];
+  if (ticks1 > conv->ticks && ns1 > conv->ns)
+    conv->ns_per_tick = (long double)(ns1 - conv->ns) / (ticks1 - conv->ticks);
+}
+
+static uint64_t to_ns(const struct conversion* conv, uint64_t ticks) {
+  return conv->ns + (int64_t)((long double)((int64_t)(ticks - conv->ticks)) * conv->ns_per_tick);
+}
+
+static bool add_event(const struct lock_trace_ring* ring, const struct conversion* conv, const struct lock_trace_record* record) {
+  if (event_count == event_capacity) {
+    size_t capacity = event_capacity ? event_capacity * 2 : 4096;
+    struct event* new_events = realloc(events, capacity * sizeof(struct event));
+    if (!new_events)
+      return false;
+    events = new_events;
+    event_capacity = capacity;
+  }
+  struct event* event = &events[event_count++];
+  event->ring = ring;
+  event->record = *record;
+  event->start_ns = to_ns(conv, record->start);
+  event->duration_ns = (uint64_t)(record->duration * conv->ns_per_tick);
+  return true;
+}
+
+// Maps one ring file and collects its complete records. The mapping is
+// kept, the events point to its header.
+// Return value: true on success
+static bool load_ring(int dirfd, const char* name, int pid) {
+  int fd = openat(dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd == -1)
+    return false;
+  struct stat st;
+  void* map = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(struct lock_trace_ring))
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return false;
+
+  const struct lock_trace_ring* ring = map;
+  if (ring->magic != LOCK_TRACE_MAGIC || ring->version != LOCK_TRACE_VERSION ||
+      ring->record_size != sizeof(struct lock_trace_record) || ring->capacity == 0 ||
+      (ring->capacity & (ring->capacity - 1)) || ring->function_count > 64 ||
+      (size_t)st.st_size < sizeof(struct lock_trace_ring) + ring->capacity * sizeof(struct lock_trace_record)) {
+    fprintf(stderr, "%s: Not a trace ring of this version\n", name);
+    munmap(map, st.st_size);
+    return false;
+  }
+  if (pid && ring->pid != pid) {
+    munmap(map, st.st_size);
+    return true;
+  }
+
+  struct conversion conv;
+  get_conversion(ring, &conv);
+  uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  uint64_t first = head > ring->capacity ? head - ring->capacity : 0;
+  for (uint64_t index = first; index < head; index++) {
+    const struct lock_trace_record* slot = &ring->records[index & (ring->capacity - 1)];
+    struct lock_trace_record record = *slot;
+    // Skip records which were incomplete or got overwritten while copying
+    if (record.sequence != index + 1 || __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE) != index + 1)
+      continue;
+    record.path[LOCK_TRACE_PATH - 1] = '\0';
+    record.path2[LOCK_TRACE_PATH - 1] = '\0';
+    if (!add_event(ring, &conv, &record))
+      return false;
+  }
+  return true;
+}
+
+static int compare_events(const void* a, const void* b) {
+  const struct event* ea = a;
+  const struct event* eb = b;
+  if (ea->start_ns != eb->start_ns)
+    return ea->start_ns < eb->start_ns ? -1 : 1;
+  return ea->record.sequence < eb->record.sequence ? -1 : ea->record.sequence > eb->record.sequence;
+}
+
+static void print_event(const struct event* event, uint64_t base) {
+  const struct lock_trace_ring* ring = event->ring;
+  const struct lock_trace_record* record = &event->record;
+  const char* function = record->function < ring->function_count ? ring->function_names[record->function] : "?";
+  const char* decision = "miss";
+  if (record->flags & LOCK_TRACE_HIT)
+    decision = "HIT";
+  else if (record->flags & LOCK_TRACE_REWRITE_FAILED)
+    decision = "FAILED";
+
+  printf("%.9f %d/%d %.15s %s %s", (event->start_ns - base) / 1e9, ring->pid, ring->tid, ring->command,
+         function, decision);
+  if (record->path[0] || (record->flags & LOCK_TRACE_PATH_TRUNCATED))
+    printf(" \"%s%s\"", (record->flags & LOCK_TRACE_PATH_TRUNCATED) ? "..." : "", record->path);
+  if (record->path2[0] || (record->flags & LOCK_TRACE_PATH2_TRUNCATED))
+    printf(" \"%s%s\"", (record->flags & LOCK_TRACE_PATH2_TRUNCATED) ? "..." : "", record->path2);
+
+  // Pointer results don't fit into an int
+  if (record->result >= INT32_MIN && record->result <= INT32_MAX)
+    printf(" = %lld", (long long)record->result);
+  else
+    printf(" = 0x%llx", (unsigned long long)record->result);
+  if (record->error)
+    printf(" errno=%d (%s)", record->error, strerror(record->error));
+  else if (record->flags & LOCK_TRACE_FAILED)
+    printf(" failed");
+  printf(" %lluns\n", (unsigned long long)event->duration_ns);
+}
+
+static void usage(const char* name) {
+  fprintf(stderr, "Usage: %s [-p PID] DIRECTORY\n", name);
+  fprintf(stderr, "Prints the calls traced with LOCKDEV_REDIRECT_TRACE=DIRECTORY\n");
+}
+
+int main(int argc, char* argv[]) {
+  int pid = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "p:h")) != -1) {
+    if (opt == 'p')
+      pid = atoi(optarg);
+    else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  const char* directory = argv[optind];
+  DIR* dir = opendir(directory);
+  if (!dir) {
+    perror(directory);
+    return 1;
+  }
+  struct dirent* entry;
+  int result = 0;
+  while ((entry = readdir(dir))) {
+    size_t len = strlen(entry->d_name);
+    if (len < 6 || strcmp(entry->d_name + len - 6, ".trace") != 0)
+      continue;
+    if (!load_ring(dirfd(dir), entry->d_name, pid))
+      result = 1;
+  }
+  closedir(dir);
+
+  qsort(events, event_count, sizeof(struct event), compare_events);
+  for (size_t i = 0; i < event_count; i++)
+    print_event(&events[i], events[0].start_ns);
+  return result;
+}
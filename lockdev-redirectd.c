@@ -0,0 +1,796 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// Lock broker. One daemon per user owns the lock files below the redirect
+// directories of all processes started with LOCKDEV_REDIRECT_BROKER=1.
+// lockdev-redirect.so asks it before every exclusive creation of a lock
+// file and lets it remove lock files, see broker_protocol.h.
+//
+// Applications poll for busy devices by trying to create the lock file
+// again and again, so whoever tries first after the lock was removed wins.
+// The daemon queues processes which found a lock busy. Once the lock is
+// given back, only the first of them may take it for RESERVE_MS. Waiters
+// which didn't try again for WAITER_TIMEOUT_MS gave up and leave the queue.
+//
+// Owners and waiters are watched through pidfds. If an owner exits, its
+// lock files are stale and get removed right away, unless the file is no
+// longer the one the owner created. Processes without the broker may have
+// taken the lock meanwhile. Locks stay with the process, not with its
+// connection, so they survive exec. A lock of a live owner is given back
+// once its lock file is gone, as it may be renamed away or removed by
+// processes the daemon doesn't see.
+//
+// The daemon exits after IDLE_MS without connections and locks.
+//
+// Usage: lockdev-redirectd            Run in the foreground
+//        lockdev-redirectd --start    Start in the background if not running
+//        lockdev-redirectd --stop
+//        lockdev-redirectd --status [LOCKFILE...]
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <poll.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <linux/limits.h>
+#include "broker_protocol.h"
+
+#define MAX_CLIENTS 256
+#define MAX_PROCESSES 512
+#define MAX_LOCKS 1024
+#define MAX_WAITERS 16
+
+#define RESERVE_MS 1000
+#define WAITER_TIMEOUT_MS 3000
+#define IDLE_MS 30000
+
+// A process with a connection, a lock or a place in a queue
+struct process {
+  pid_t pid;
+  int pidfd;                  // -1 if pidfds are not available
+};
+
+struct lock {
+  char* path;
+  pid_t owner;                // 0 if not held
+  uint64_t dev;               // Lock file created by the owner, see
+  uint64_t ino;               // struct lock_file_id. ino is 0 until the
+  uint64_t birth;             // owner reported it.
+  uint64_t reserved_until;    // Only waiters[0] may take the lock until then
+  unsigned int waiter_count;
+  pid_t waiters[MAX_WAITERS];
+  uint64_t last_try[MAX_WAITERS];
+};
+
+struct client {
+  int fd;
+  pid_t pid;
+};
+
+static struct process processes[MAX_PROCESSES];
+static unsigned int process_count;
+static struct lock locks[MAX_LOCKS];
+static unsigned int lock_count;
+static struct client clients[MAX_CLIENTS];
+static unsigned int client_count;
+
+static volatile sig_atomic_t stop;
+
+
+static uint64_t _now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Builds the socket address
+// Return value: true on success. false if XDG_RUNTIME_DIR is missing or too long.
+static bool _socket_address(struct sockaddr_un* addr) {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (!runtime_dir || !runtime_dir[0]) {
+    fprintf(stderr, "lockdev-redirect: XDG_RUNTIME_DIR not set!\n");
+    return false;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  int n = snprintf(addr->sun_path, sizeof(addr->sun_path), "%s/%s", runtime_dir, LOCK_BROKER_SOCKET);
+  if (n < 0 || (size_t)n >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "lockdev-redirect: XDG_RUNTIME_DIR too long\n");
+    return false;
+  }
+  return true;
+}
+
+// Connects to a running daemon
+// Return value: Socket. -1 if no daemon is running.
+static int _connect(const struct sockaddr_un* addr) {
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return -1;
+  if (connect(fd, (const struct sockaddr*)addr, sizeof(*addr)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+
+// Process tracking
+
+static struct process* _find_process(pid_t pid) {
+  for (unsigned int i = 0; i < process_count; i++) {
+    if (processes[i].pid == pid)
+      return &processes[i];
+  }
+  return NULL;
+}
+
+// Starts watching a process
+// Return value: false if the table is full or the process is gone
+static bool _watch_process(pid_t pid) {
+  if (_find_process(pid))
+    return true;
+  if (process_count == MAX_PROCESSES)
+    return false;
+  int pidfd = -1;
+#ifdef SYS_pidfd_open
+  pidfd = syscall(SYS_pidfd_open, pid, 0);
+  if (pidfd == -1 && errno == ESRCH)
+    return false;
+  if (pidfd != -1)
+    fcntl(pidfd, F_SETFD, FD_CLOEXEC);
+#endif
+  processes[process_count++] = (struct process) { pid, pidfd };
+  return true;
+}
+
+// Return value: Parent of a process. 0 if unknown.
+static pid_t _parent_of(pid_t pid) {
+  char path[32];
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return 0;
+  char buf[512];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return 0;
+  buf[len] = '\0';
+  // "PID (COMM) STATE PPID ...", COMM may contain anything
+  const char* end = strrchr(buf, ')');
+  char state;
+  int ppid;
+  if (!end || sscanf(end + 1, " %c %d", &state, &ppid) != 2)
+    return 0;
+  return ppid;
+}
+
+// Checks if a lock file still is the one its owner created
+static bool _owner_file(const struct lock* lock) {
+  if (!lock->ino)
+    return false;
+#ifdef SYS_statx
+  struct statx statx_buf;
+  if (statx(AT_FDCWD, lock->path, AT_SYMLINK_NOFOLLOW, STATX_INO | STATX_BTIME, &statx_buf) == 0) {
+    uint64_t birth = (statx_buf.stx_mask & STATX_BTIME) ? (uint64_t)statx_buf.stx_btime.tv_sec * 1000000000 + statx_buf.stx_btime.tv_nsec : 0;
+    return makedev(statx_buf.stx_dev_major, statx_buf.stx_dev_minor) == lock->dev &&
+           statx_buf.stx_ino == lock->ino && birth == lock->birth;
+  }
+#endif
+  struct stat stat_buf;
+  return stat(lock->path, &stat_buf) == 0 && stat_buf.st_dev == lock->dev &&
+         stat_buf.st_ino == lock->ino && lock->birth == 0;
+}
+
+// Checks processes without pidfd
+static bool _alive(pid_t pid) {
+  struct process* process = _find_process(pid);
+  if (process && process->pidfd != -1)
+    return true;   // Exits are noticed by poll
+  return kill(pid, 0) == 0 || errno == EPERM;
+}
+
+
+// Lock bookkeeping
+
+static struct lock* _find_lock(const char* path) {
+  for (unsigned int i = 0; i < lock_count; i++) {
+    if (strcmp(locks[i].path, path) == 0)
+      return &locks[i];
+  }
+  return NULL;
+}
+
+static struct lock* _add_lock(const char* path) {
+  if (lock_count == MAX_LOCKS)
+    return NULL;
+  char* copy = strdup(path);
+  if (!copy)
+    return NULL;
+  struct lock* lock = &locks[lock_count++];
+  memset(lock, 0, sizeof(*lock));
+  lock->path = copy;
+  return lock;
+}
+
+static void _remove_waiter(struct lock* lock, unsigned int index) {
+  lock->waiter_count--;
+  memmove(&lock->waiters[index], &lock->waiters[index + 1], (lock->waiter_count - index) * sizeof(lock->waiters[0]));
+  memmove(&lock->last_try[index], &lock->last_try[index + 1], (lock->waiter_count - index) * sizeof(lock->last_try[0]));
+}
+
+// Queues a process for a busy lock or updates its last try
+static void _add_waiter(struct lock* lock, pid_t pid, uint64_t now) {
+  for (unsigned int i = 0; i < lock->waiter_count; i++) {
+    if (lock->waiters[i] == pid) {
+      lock->last_try[i] = now;
+      return;
+    }
+  }
+  if (lock->waiter_count == MAX_WAITERS || !_watch_process(pid))
+    return;
+  lock->waiters[lock->waiter_count] = pid;
+  lock->last_try[lock->waiter_count] = now;
+  lock->waiter_count++;
+}
+
+// Drops waiters which stopped trying. The first waiter is dropped if it
+// didn't take the free lock in time, then the next one gets its chance.
+static void _expire_waiters(struct lock* lock, uint64_t now) {
+  for (unsigned int i = 0; i < lock->waiter_count; ) {
+    if (now - lock->last_try[i] > WAITER_TIMEOUT_MS)
+      _remove_waiter(lock, i);
+    else
+      i++;
+  }
+  if (!lock->owner && lock->waiter_count && now >= lock->reserved_until) {
+    _remove_waiter(lock, 0);
+    lock->reserved_until = now + RESERVE_MS;
+  }
+}
+
+// Gives a lock back. The first waiter may take it now.
+static void _release(struct lock* lock, uint64_t now) {
+  lock->owner = 0;
+  lock->ino = 0;
+  lock->reserved_until = now + RESERVE_MS;
+}
+
+static bool _handle_client(struct client* client);
+
+// Forgets a process and everything it held
+static void _process_exited(pid_t pid) {
+  // Handle what it sent before, like the inode of its last lock file
+  for (unsigned int i = 0; i < client_count; i++) {
+    char c;
+    while (clients[i].pid == pid && recv(clients[i].fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) > 0 &&
+           _handle_client(&clients[i]));
+  }
+
+  uint64_t now = _now_ms();
+  for (unsigned int i = 0; i < lock_count; i++) {
+    struct lock* lock = &locks[i];
+    if (lock->owner == pid) {
+      if (_owner_file(lock))
+        unlink(lock->path);
+      _release(lock, now);
+    }
+    for (unsigned int j = 0; j < lock->waiter_count; ) {
+      if (lock->waiters[j] == pid)
+        _remove_waiter(lock, j);
+      else
+        j++;
+    }
+  }
+  struct process* process = _find_process(pid);
+  if (process) {
+    if (process->pidfd != -1)
+      close(process->pidfd);
+    *process = processes[--process_count];
+  }
+}
+
+// Drops the owner of a lock if it exited or if its lock file is gone or
+// was replaced. Until the owner reported its file, the owner is trusted.
+static void _check_owner(struct lock* lock) {
+  if (!lock->owner)
+    return;
+  if (!_alive(lock->owner))
+    _process_exited(lock->owner);
+  else if (lock->ino && !_owner_file(lock))
+    _release(lock, _now_ms());
+}
+
+// Drops unused locks and processes
+static void _collect(void) {
+  uint64_t now = _now_ms();
+  for (unsigned int i = 0; i < lock_count; ) {
+    struct lock* lock = &locks[i];
+    if (lock->owner && !_alive(lock->owner))
+      _process_exited(lock->owner);
+    _expire_waiters(lock, now);
+    if (!lock->owner && !lock->waiter_count) {
+      free(lock->path);
+      *lock = locks[--lock_count];
+    }
+    else
+      i++;
+  }
+
+  for (unsigned int i = 0; i < process_count; ) {
+    pid_t pid = processes[i].pid;
+    bool used = false;
+    for (unsigned int j = 0; !used && j < client_count; j++)
+      used = clients[j].pid == pid;
+    for (unsigned int j = 0; !used && j < lock_count; j++) {
+      used = locks[j].owner == pid;
+      for (unsigned int k = 0; !used && k < locks[j].waiter_count; k++)
+        used = locks[j].waiters[k] == pid;
+    }
+    if (used)
+      i++;
+    else {
+      if (processes[i].pidfd != -1)
+        close(processes[i].pidfd);
+      processes[i] = processes[--process_count];
+    }
+  }
+}
+
+
+// Requests
+
+static int _acquire(pid_t pid, const char* path) {
+  uint64_t now = _now_ms();
+  struct lock* lock = _find_lock(path);
+  if (!lock)
+    lock = _add_lock(path);
+  if (!lock || !_watch_process(pid))
+    return LOCK_BROKER_UNTRACKED;
+
+  if (lock->owner != pid)
+    _check_owner(lock);
+  _expire_waiters(lock, now);
+  if ((lock->owner && lock->owner != pid) ||
+      (!lock->owner && lock->waiter_count && lock->waiters[0] != pid)) {
+    _add_waiter(lock, pid, now);
+    return EEXIST;
+  }
+
+  if (lock->waiter_count && lock->waiters[0] == pid)
+    _remove_waiter(lock, 0);
+  if (lock->owner != pid)
+    lock->ino = 0;
+  lock->owner = pid;
+  return 0;
+}
+
+static void _created(pid_t pid, const char* path, const struct lock_broker_request* request) {
+  struct lock* lock = _find_lock(path);
+  if (lock && lock->owner == pid) {
+    lock->dev = request->dev;
+    lock->ino = request->ino;
+    lock->birth = request->birth;
+  }
+}
+
+static int _cancel(pid_t pid, const char* path) {
+  struct lock* lock = _find_lock(path);
+  if (lock && lock->owner == pid)
+    _release(lock, _now_ms());
+  return 0;
+}
+
+// Child processes may remove the locks of their parent
+static int _remove(pid_t pid, const char* path) {
+  struct lock* lock = _find_lock(path);
+  if (lock && lock->owner && lock->owner != pid && _alive(lock->owner) && lock->owner != _parent_of(pid))
+    return EBUSY;
+  if (unlink(path) != 0)
+    return errno;
+  if (lock && lock->owner)
+    _release(lock, _now_ms());
+  return 0;
+}
+
+static void _status(const char* path, struct lock_broker_status* status) {
+  struct lock* lock = _find_lock(path);
+  if (lock)
+    _check_owner(lock);
+  status->owner = lock ? lock->owner : 0;
+  status->waiters = lock ? lock->waiter_count : 0;
+}
+
+// Answers one request of a client
+// Return value: false if the connection has to be closed
+static bool _handle_client(struct client* client) {
+  struct lock_broker_request request;
+  ssize_t len = recv(client->fd, &request, sizeof(request), MSG_DONTWAIT);
+  if (len == -1 && (errno == EAGAIN || errno == EINTR))
+    return true;
+  if (len < (ssize_t)offsetof(struct lock_broker_request, paths) || request.version != LOCK_BROKER_VERSION)
+    return false;
+
+  // Make sure all paths are terminated
+  size_t size = len - offsetof(struct lock_broker_request, paths);
+  const char* paths[LOCK_BROKER_BATCH];
+  unsigned int count = 0;
+  for (size_t offset = 0; count < request.count && count < LOCK_BROKER_BATCH && offset < size; count++) {
+    const char* end = memchr(request.paths + offset, '\0', size - offset);
+    if (!end)
+      return false;
+    paths[count] = request.paths + offset;
+    offset = end - request.paths + 1;
+  }
+  if (count != request.count)
+    return false;
+
+  struct lock_broker_reply reply;
+  reply.id = request.id;
+  reply.result = EINVAL;
+  reply.count = 0;
+  switch (request.op) {
+    case LOCK_BROKER_ACQUIRE:
+      if (count == 1)
+        reply.result = _acquire(client->pid, paths[0]);
+      break;
+    case LOCK_BROKER_CANCEL:
+      if (count == 1)
+        reply.result = _cancel(client->pid, paths[0]);
+      break;
+    case LOCK_BROKER_REMOVE:
+      if (count == 1)
+        reply.result = _remove(client->pid, paths[0]);
+      break;
+    case LOCK_BROKER_CREATED:
+      if (count == 1)
+        _created(client->pid, paths[0], &request);
+      return true;
+    case LOCK_BROKER_STATUS:
+      for (unsigned int i = 0; i < count; i++)
+        _status(paths[i], &reply.status[i]);
+      reply.count = count;
+      reply.result = 0;
+      break;
+    case LOCK_BROKER_SHUTDOWN:
+      stop = 1;
+      reply.result = 0;
+      break;
+  }
+  size_t reply_len = offsetof(struct lock_broker_reply, status) + reply.count * sizeof(reply.status[0]);
+  return send(client->fd, &reply, reply_len, MSG_NOSIGNAL) == (ssize_t)reply_len;
+}
+
+static void _accept(int listen_fd) {
+  int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+  if (fd == -1)
+    return;
+  struct ucred cred;
+  socklen_t cred_len = sizeof(cred);
+  if (client_count == MAX_CLIENTS || getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) != 0 ||
+      cred.uid != getuid()) {
+    close(fd);
+    return;
+  }
+  clients[client_count++] = (struct client) { fd, cred.pid };
+  _watch_process(cred.pid);
+}
+
+static void _handle_signal(int sig) {
+  stop = 1;
+}
+
+// Main loop
+static void _serve(int listen_fd) {
+  struct sigaction action = { .sa_handler = _handle_signal };
+  sigaction(SIGTERM, &action, NULL);
+  sigaction(SIGINT, &action, NULL);
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+
+  static struct pollfd fds[1 + MAX_CLIENTS + MAX_PROCESSES];
+  uint64_t idle_since = _now_ms();
+  while (!stop) {
+    // Processes without pidfd are checked once per second
+    bool polling = false;
+    unsigned int nfds = 0;
+    fds[nfds++] = (struct pollfd) { listen_fd, POLLIN, 0 };
+    for (unsigned int i = 0; i < client_count; i++)
+      fds[nfds++] = (struct pollfd) { clients[i].fd, POLLIN, 0 };
+    for (unsigned int i = 0; i < process_count; i++) {
+      fds[nfds++] = (struct pollfd) { processes[i].pidfd, POLLIN, 0 };
+      polling |= processes[i].pidfd == -1;
+    }
+
+    int timeout = polling ? 1000 : -1;
+    if (!client_count && !lock_count) {
+      uint64_t idle = _now_ms() - idle_since;
+      if (idle >= IDLE_MS)
+        break;
+      timeout = IDLE_MS - idle;
+    }
+    else
+      idle_since = _now_ms();
+
+    if (poll(fds, nfds, timeout) == -1) {
+      if (errno == EINTR)
+        continue;
+      fprintf(stderr, "lockdev-redirect: poll failed, %s\n", strerror(errno));
+      break;
+    }
+
+    // Exits first, so new requests don't see stale owners. Clients are
+    // handled in reverse, removing one moves the last one into its place.
+    pid_t exited[MAX_PROCESSES];
+    unsigned int exit_count = 0;
+    for (unsigned int i = 1 + client_count; i < nfds; i++) {
+      if (fds[i].revents)
+        exited[exit_count++] = processes[i - 1 - client_count].pid;
+    }
+    for (unsigned int i = 0; i < exit_count; i++)
+      _process_exited(exited[i]);
+    for (unsigned int i = client_count; i > 0; i--) {
+      struct client* client = &clients[i - 1];
+      if (fds[i].revents && !_handle_client(client)) {
+        close(client->fd);
+        *client = clients[--client_count];
+      }
+    }
+    if (fds[0].revents & POLLIN)
+      _accept(listen_fd);
+    _collect();
+  }
+}
+
+// Binds the socket. Only the daemon holding the lock file next to the
+// socket may replace a stale one.
+// Return value: Listening socket. -1 if another daemon runs or on error.
+static int _listen(const struct sockaddr_un* addr) {
+  char path[sizeof(addr->sun_path) + 8];
+  snprintf(path, sizeof(path), "%s.lock", addr->sun_path);
+  char* slash = strrchr(path, '/');
+  *slash = '\0';
+  if (mkdir(path, 0700) != 0 && errno != EEXIST) {
+    fprintf(stderr, "lockdev-redirect: Failed to create %s, %s\n", path, strerror(errno));
+    return -1;
+  }
+  *slash = '/';
+
+  // Kept open (and locked) while the daemon runs
+  int lock_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (lock_fd == -1 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+    if (lock_fd != -1)
+      close(lock_fd);
+    return -1;
+  }
+
+  unlink(addr->sun_path);
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  mode_t mask = umask(0077);
+  if (fd == -1 || bind(fd, (const struct sockaddr*)addr, sizeof(*addr)) != 0 || listen(fd, 64) != 0) {
+    fprintf(stderr, "lockdev-redirect: Failed to listen on %s, %s\n", addr->sun_path, strerror(errno));
+    umask(mask);
+    if (fd != -1)
+      close(fd);
+    close(lock_fd);
+    return -1;
+  }
+  umask(mask);
+  return fd;
+}
+
+// Starts the daemon in the background unless it already runs
+// Return value: Exit code
+static int _start(const struct sockaddr_un* addr) {
+  int fd = _connect(addr);
+  if (fd != -1) {
+    close(fd);
+    return 0;
+  }
+
+  int ready[2];
+  if (pipe2(ready, O_CLOEXEC) != 0) {
+    fprintf(stderr, "lockdev-redirect: pipe failed, %s\n", strerror(errno));
+    return 1;
+  }
+  pid_t pid = fork();
+  if (pid == -1) {
+    fprintf(stderr, "lockdev-redirect: fork failed, %s\n", strerror(errno));
+    return 1;
+  }
+  if (pid == 0) {
+    close(ready[0]);
+    setsid();
+    if (chdir("/") != 0)
+      _exit(1);
+    int listen_fd = _listen(addr);
+    char result = listen_fd != -1;
+    // Another daemon may just be starting
+    for (int i = 0; !result && i < 100; i++) {
+      fd = _connect(addr);
+      if (fd != -1) {
+        close(fd);
+        result = 1;
+      }
+      else
+        usleep(10000);
+    }
+    int null_fd = open("/dev/null", O_RDWR);
+    if (null_fd != -1) {
+      dup2(null_fd, STDIN_FILENO);
+      dup2(null_fd, STDOUT_FILENO);
+      dup2(null_fd, STDERR_FILENO);
+      if (null_fd > STDERR_FILENO)
+        close(null_fd);
+    }
+    if (write(ready[1], &result, 1) != 1 || listen_fd == -1)
+      _exit(result ? 0 : 1);
+    close(ready[1]);
+    _serve(listen_fd);
+    unlink(addr->sun_path);
+    _exit(0);
+  }
+
+  close(ready[1]);
+  char result = 0;
+  if (read(ready[0], &result, 1) != 1 || !result) {
+    fprintf(stderr, "lockdev-redirect: Failed to start the lock broker\n");
+    return 1;
+  }
+  return 0;
+}
+
+// Sends one request and waits for the reply
+// Return value: true on success
+static bool _request(int fd, struct lock_broker_request* request, size_t size, struct lock_broker_reply* reply) {
+  request->version = LOCK_BROKER_VERSION;
+  size_t len = offsetof(struct lock_broker_request, paths) + size;
+  return send(fd, request, len, MSG_NOSIGNAL) == (ssize_t)len &&
+         recv(fd, reply, sizeof(*reply), 0) >= (ssize_t)offsetof(struct lock_broker_reply, status);
+}
+
+// Prints owner and waiters of lock files. Names without "/" are looked up
+// in the default redirect directory. Without names all lock files there
+// are listed.
+// Return value: Exit code
+static int _show_status(const struct sockaddr_un* addr, int argc, char* argv[]) {
+  int fd = _connect(addr);
+  if (fd == -1) {
+    fprintf(stderr, "lockdev-redirect: Lock broker not running\n");
+    return 1;
+  }
+
+  char dir[PATH_MAX];
+  snprintf(dir, PATH_MAX, "%s/lock", getenv("XDG_RUNTIME_DIR"));
+  DIR* dir_stream = NULL;
+  if (argc == 0)
+    dir_stream = opendir(dir);
+
+  struct lock_broker_request request = { .op = LOCK_BROKER_STATUS };
+  struct lock_broker_reply reply;
+  int index = 0;
+  bool done = false;
+  while (!done) {
+    // Fill one batch
+    size_t size = 0;
+    request.count = 0;
+    while (request.count < LOCK_BROKER_BATCH) {
+      const char* name = NULL;
+      if (dir_stream) {
+        struct dirent* entry = readdir(dir_stream);
+        while (entry && strncmp(entry->d_name, "LCK.", 4) != 0)
+          entry = readdir(dir_stream);
+        name = entry ? entry->d_name : NULL;
+      }
+      else if (index < argc)
+        name = argv[index++];
+      if (!name) {
+        done = true;
+        break;
+      }
+      char path[PATH_MAX];
+      int n = strchr(name, '/') ? snprintf(path, PATH_MAX, "%s", name) : snprintf(path, PATH_MAX, "%s/%s", dir, name);
+      if (n < 0 || size + n + 1 > LOCK_BROKER_PATHS) {
+        fprintf(stderr, "lockdev-redirect: Path too long: %s\n", name);
+        done = true;
+        break;
+      }
+      memcpy(request.paths + size, path, n + 1);
+      size += n + 1;
+      request.count++;
+      // Leave room for another long path
+      if (size + NAME_MAX > LOCK_BROKER_PATHS)
+        break;
+    }
+    if (!request.count)
+      break;
+
+    if (!_request(fd, &request, size, &reply) || reply.result != 0 || reply.count != request.count) {
+      fprintf(stderr, "lockdev-redirect: Status request failed\n");
+      close(fd);
+      return 1;
+    }
+    const char* path = request.paths;
+    for (unsigned int i = 0; i < reply.count; i++) {
+      printf("%s %d %u\n", path, reply.status[i].owner, reply.status[i].waiters);
+      path += strlen(path) + 1;
+    }
+  }
+  if (dir_stream)
+    closedir(dir_stream);
+  close(fd);
+  return 0;
+}
+
+static int _stop(const struct sockaddr_un* addr) {
+  int fd = _connect(addr);
+  if (fd == -1)
+    return 0;
+  struct lock_broker_request request = { .op = LOCK_BROKER_SHUTDOWN };
+  struct lock_broker_reply reply;
+  bool success = _request(fd, &request, 0, &reply);
+  // Wait for the socket to go away
+  if (success) {
+    char c;
+    while (recv(fd, &c, 1, 0) > 0);
+  }
+  close(fd);
+  return success ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+  struct sockaddr_un addr;
+  if (!_socket_address(&addr))
+    return 1;
+
+  if (argc >= 2 && strcmp(argv[1], "--start") == 0)
+    return _start(&addr);
+  if (argc >= 2 && strcmp(argv[1], "--stop") == 0)
+    return _stop(&addr);
+  if (argc >= 2 && strcmp(argv[1], "--status") == 0)
+    return _show_status(&addr, argc - 2, argv + 2);
+  if (argc >= 2) {
+    fprintf(stderr, "Usage: %s [--start | --stop | --status [LOCKFILE...]]\n", argv[0]);
+    return 1;
+  }
+
+  int listen_fd = _listen(&addr);
+  if (listen_fd == -1) {
+    fprintf(stderr, "lockdev-redirect: Lock broker already running\n");
+    return 1;
+  }
+  _serve(listen_fd);
+  unlink(addr.sun_path);
+  return 0;
+}
@@ -0,0 +1,718 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "utilities.h"
+#include "symbols.h"
+
+/*
+ Known device lock file paths:
+ /var/lock          is used by both, java rxtx and lockdev by default
+ /var/lock/lockdev  is used by java rxtx on Arch and Fedora (patched)
+ /run/lock/lockdev  is used by lockdev on Arch and Fedora (patched)
+
+ The list of prefixes can be replaced with the LOCKDEV_REDIRECT_PATHS
+ environment variable (entries separated by ":") or with a config file
+ (one entry per line, "#" starts a comment). Config files are searched in
+ $XDG_CONFIG_HOME/lockdev-redirect.conf and /etc/lockdev-redirect.conf.
+ Every entry has the form PREFIX[=TARGET]. TARGET is the directory to
+ redirect to. Relative targets are placed below $XDG_RUNTIME_DIR. The
+ default target is "lock".
+
+ Entries of the form !PREFIX are blackholes: Legacy lock directories which
+ rxtx probes on every lock check, but which don't exist on modern systems.
+ Prefixes which don't exist at startup fail every call below them with
+ ENOENT, without a syscall. Every second one call checks again if the
+ directory appeared. Blackholes are not in the default list. Their first
+ bytes would let every path below /etc and /usr pass _lock_path_heads and
+ cost a matcher walk in all applications, not only in rxtx users.
+*/
+
+// Used if no configuration is found
+static const char DEFAULT_LOCK_PATHS[] = "/var/lock:/run/lock";
+static const char DEFAULT_LOCK_TARGET[] = "lock";
+
+#define MAX_LOCK_PREFIXES 64
+#define MAX_CONFIG_SIZE 4096
+#define MAX_ALIAS_SIZE 2048
+#define BLACKHOLE_CHECK_NS 1000000000ull
+
+// Compiled lock path prefixes
+// The prefixes are stored as a trie which is used as a DFA. To keep the
+// transition table small, input bytes are mapped to classes first. Every
+// byte that does not appear in any prefix maps to class 0 which always
+// leads to the dead state. Matching costs one class and one table lookup
+// per input byte, no matter how many prefixes are configured.
+struct lock_matcher {
+  unsigned char classes[256];
+  unsigned int class_count;
+  unsigned int state_count;
+  unsigned int prefix_count;
+  unsigned int root_count;
+  struct lock_prefix prefixes[MAX_LOCK_PREFIXES];
+  const char* roots[MAX_LOCK_ROOTS];
+  uint16_t* accept;     // Per state: Index of the matched prefix + 1
+  uint16_t* next;       // Transition table: state * class_count + class
+  char strings[MAX_CONFIG_SIZE];
+  size_t alias_len;
+  char aliases[MAX_ALIAS_SIZE];  // Paths of the alias prefixes
+};
+
+static struct lock_matcher* current_matcher = NULL;
+
+// Per prefix: Time of the next check if a blackhole directory appeared.
+// UINT64_MAX once it did.
+static uint64_t blackhole_checks[MAX_LOCK_PREFIXES];
+
+// Per-thread cache of recent match results for absolute paths. Lock
+// pollers check the same few lock files over and over again. A hit costs a
+// strnlen and a memcmp instead of the automaton walk. The matcher never
+// changes once published, so entries never get stale. Redirect targets are
+// not cached, _redirect_path checks the lock root on every call.
+#define MATCH_CACHE_SIZE 8      // Entries per thread. Power of two.
+#define MATCH_CACHE_PATH 64     // Longer paths are not cached
+#define MATCH_CACHE_MIN_PATH 8  // Shorter paths are cheap to match anyway
+
+struct match_cache_entry {
+  uint16_t len;                 // Path length. 0 if unused.
+  uint16_t suffix;              // Offset of the suffix in the path
+  unsigned int state;
+  const struct lock_prefix* prefix;
+  char path[MATCH_CACHE_PATH];
+};
+
+// "sequence" is odd while an entry is written. A signal handler on the same
+// thread then doesn't touch the cache, and a reader interrupted by a writer
+// notices the changed sequence.
+struct match_cache {
+  unsigned int sequence;
+  struct match_cache_entry entries[MATCH_CACHE_SIZE];
+};
+
+static __thread struct match_cache match_cache __attribute__ ((tls_model ("initial-exec")));
+
+// Bytes which may follow the leading "/" of a lock path or of one of its
+// parent directories. Lets the wrappers reject most absolute paths inline.
+// Everything is allowed until the matcher is built.
+__attribute__ ((visibility ("hidden"))) unsigned char _lock_path_heads[256] = { [0 ... 255] = 1 };
+
+
+// Reads the whole config file into the given buffer.
+// Return value: true if the file was found. false otherwise.
+static bool _read_config_file(const char* filename, char* buffer, size_t size) {
+  // Don't use our own fopen wrapper. It would need the matcher we build.
+  FILE* fp = ORIG(fopen)(filename, "re");
+  if (!fp)
+    return false;
+
+  size_t n = fread(buffer, 1, size - 1, fp);
+  buffer[n] = '\0';
+  if (!feof(fp))
+    fprintf(stderr, "lockdev-redirect: %s too large, ignoring the rest\n", filename);
+  fclose(fp);
+  return true;
+}
+
+// Fetches the configured prefix list into the given buffer
+// Return value: Separator character used between the entries
+static char _read_config(char* buffer, size_t size) {
+  const char* env = getenv("LOCKDEV_REDIRECT_PATHS");
+  if (env) {
+    snprintf(buffer, size, "%s", env);
+    return ':';
+  }
+
+  char filename[PATH_MAX];
+  const char* config_home = getenv("XDG_CONFIG_HOME");
+  const char* home = getenv("HOME");
+  int n = -1;
+  if (config_home && config_home[0])
+    n = snprintf(filename, PATH_MAX, "%s/lockdev-redirect.conf", config_home);
+  else if (home)
+    n = snprintf(filename, PATH_MAX, "%s/.config/lockdev-redirect.conf", home);
+  if (n > 0 && n < PATH_MAX && _read_config_file(filename, buffer, size))
+    return '\n';
+
+  if (_read_config_file("/etc/lockdev-redirect.conf", buffer, size))
+    return '\n';
+
+  snprintf(buffer, size, "%s", DEFAULT_LOCK_PATHS);
+  return ':';
+}
+
+static uint64_t _now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Checks if a blackhole directory exists. Calls fstatat directly, as our
+// stat wrappers need the matcher.
+static bool _directory_exists(const char* path) {
+  struct stat stat_buf;
+  return fstatat(AT_FDCWD, path, &stat_buf, 0) == 0;
+}
+
+// Strips leading and trailing whitespace in place
+static char* _strip(char* string) {
+  while (isspace((unsigned char)*string))
+    string++;
+  char* end = string + strlen(string);
+  while (end > string && isspace((unsigned char)end[-1]))
+    end--;
+  *end = '\0';
+  return string;
+}
+
+// Adds one PREFIX[=TARGET] or !PREFIX entry to the prefix list of the
+// matcher
+static void _add_entry(struct lock_matcher* matcher, char* entry) {
+  char* comment = strchr(entry, '#');
+  if (comment)
+    *comment = '\0';
+  entry = _strip(entry);
+  if (!entry[0])
+    return;
+
+  bool blackhole = entry[0] == '!';
+  if (blackhole)
+    entry++;
+
+  const char* target = DEFAULT_LOCK_TARGET;
+  char* separator = strchr(entry, '=');
+  if (separator) {
+    *separator = '\0';
+    target = _strip(separator + 1);
+    if (!target[0])
+      target = DEFAULT_LOCK_TARGET;
+    if (blackhole)
+      fprintf(stderr, "lockdev-redirect: Ignoring target of blackhole \"%s\"\n", _strip(entry));
+  }
+
+  char* prefix = _strip(entry);
+  size_t len = strlen(prefix);
+  while (len > 1 && prefix[len - 1] == '/')
+    prefix[--len] = '\0';
+  if (prefix[0] != '/' || len < 2) {
+    fprintf(stderr, "lockdev-redirect: Ignoring invalid lock path \"%s\"\n", prefix);
+    return;
+  }
+
+  if (matcher->prefix_count == MAX_LOCK_PREFIXES) {
+    fprintf(stderr, "lockdev-redirect: Too many lock paths, ignoring \"%s\"\n", prefix);
+    return;
+  }
+
+  // Existing directories are left alone. Blackholes need no lock root.
+  if (blackhole) {
+    if (_directory_exists(prefix))
+      return;
+    blackhole_checks[matcher->prefix_count] = _now() + BLACKHOLE_CHECK_NS;
+    struct lock_prefix* entry_prefix = &matcher->prefixes[matcher->prefix_count++];
+    entry_prefix->path = prefix;
+    entry_prefix->len = len;
+    entry_prefix->blackhole = true;
+    return;
+  }
+
+  // Lock roots are shared between all prefixes with the same target
+  unsigned int root;
+  for (root = 0; root < matcher->root_count; root++) {
+    if (strcmp(matcher->roots[root], target) == 0)
+      break;
+  }
+  if (root == matcher->root_count) {
+    if (root == MAX_LOCK_ROOTS) {
+      fprintf(stderr, "lockdev-redirect: Too many lock targets, ignoring \"%s\"\n", prefix);
+      return;
+    }
+    matcher->roots[matcher->root_count++] = target;
+  }
+
+  struct lock_prefix* entry_prefix = &matcher->prefixes[matcher->prefix_count++];
+  entry_prefix->path = prefix;
+  entry_prefix->len = len;
+  entry_prefix->root = root;
+}
+
+// Identity of a configured prefix. "ino" is 0 if the prefix doesn't exist
+// or is a blackhole.
+struct prefix_identity {
+  dev_t dev;
+  ino_t ino;
+};
+
+// Places where lock directories are commonly reachable as well. Every one
+// with the identity of a configured prefix becomes an alias prefix.
+static const char* const KNOWN_LOCK_ALIASES[] = { "/var/lock", "/run/lock", "/var/run/lock", NULL };
+
+// Adds an alias prefix if the given directory is one of the configured
+// prefixes under another name
+// Parameters:
+//   matcher: The matcher to add to
+//   configured: Number of configured prefixes
+//   identities: Identities of the configured prefixes
+//   path: Absolute path of the possible alias
+static void _add_alias(struct lock_matcher* matcher, unsigned int configured, const struct prefix_identity* identities, const char* path) {
+  size_t len = strlen(path);
+  if (len < 2 || path[0] != '/' || strchr(path, '\\') || matcher->prefix_count == MAX_LOCK_PREFIXES)
+    return;
+  for (unsigned int i = 0; i < matcher->prefix_count; i++) {
+    if (matcher->prefixes[i].len == len && memcmp(matcher->prefixes[i].path, path, len) == 0)
+      return;
+  }
+
+  struct stat stat_buf;
+  if (fstatat(AT_FDCWD, path, &stat_buf, 0) != 0)
+    return;
+  unsigned int i;
+  for (i = 0; i < configured; i++) {
+    if (identities[i].ino && identities[i].ino == stat_buf.st_ino && identities[i].dev == stat_buf.st_dev)
+      break;
+  }
+  if (i == configured || matcher->alias_len + len + 1 > MAX_ALIAS_SIZE)
+    return;
+
+  char* alias = memcpy(matcher->aliases + matcher->alias_len, path, len + 1);
+  matcher->alias_len += len + 1;
+  struct lock_prefix* prefix = &matcher->prefixes[matcher->prefix_count++];
+  prefix->path = alias;
+  prefix->len = len;
+  prefix->root = matcher->prefixes[i].root;
+}
+
+// Adds the mount points of bind mounts in /proc/self/mountinfo as
+// aliases. Only mounts of a subdirectory (root other than "/") can be a
+// bind mounted lock directory, so nothing else gets a stat.
+static void _add_mount_aliases(struct lock_matcher* matcher, unsigned int configured, const struct prefix_identity* identities) {
+  FILE* fp = ORIG(fopen)("/proc/self/mountinfo", "re");
+  if (!fp)
+    return;
+
+  char line[1024];
+  while (fgets(line, sizeof(line), fp)) {
+    char* saveptr;
+    char* root = NULL;
+    char* mount_point = NULL;
+    char* field = strtok_r(line, " ", &saveptr);
+    for (int i = 0; field && i < 4; i++) {
+      field = strtok_r(NULL, " ", &saveptr);
+      if (i == 2)
+        root = field;
+      else if (i == 3)
+        mount_point = field;
+    }
+    if (root && mount_point && strcmp(root, "/") != 0)
+      _add_alias(matcher, configured, identities, mount_point);
+  }
+  fclose(fp);
+}
+
+// Finds other names of the configured lock directories: Their canonical
+// path, the commonly used lock paths and bind mounts. Everything is
+// resolved once here. Aliases are plain prefixes afterwards, so matching
+// them costs nothing extra and realpath never runs on the hot path.
+static void _add_aliases(struct lock_matcher* matcher) {
+  unsigned int configured = matcher->prefix_count;
+  struct prefix_identity identities[MAX_LOCK_PREFIXES];
+  bool any = false;
+  for (unsigned int i = 0; i < configured; i++) {
+    struct stat stat_buf;
+    identities[i].ino = 0;
+    if (matcher->prefixes[i].blackhole || fstatat(AT_FDCWD, matcher->prefixes[i].path, &stat_buf, 0) != 0 || !S_ISDIR(stat_buf.st_mode))
+      continue;
+    identities[i].dev = stat_buf.st_dev;
+    identities[i].ino = stat_buf.st_ino;
+    any = true;
+  }
+  if (!any)
+    return;
+
+  char canonical[PATH_MAX];
+  for (unsigned int i = 0; i < configured; i++) {
+    if (identities[i].ino && realpath(matcher->prefixes[i].path, canonical))
+      _add_alias(matcher, configured, identities, canonical);
+  }
+  for (const char* const* known = KNOWN_LOCK_ALIASES; *known; known++)
+    _add_alias(matcher, configured, identities, *known);
+  _add_mount_aliases(matcher, configured, identities);
+}
+
+// Parses the configuration and compiles the automaton
+// Return value: New matcher on success. NULL on error.
+static struct lock_matcher* _build_matcher(void) {
+  struct lock_matcher* matcher = calloc(1, sizeof(struct lock_matcher));
+  if (!matcher)
+    return NULL;
+
+  // Split the configuration into entries. All strings stay in "strings".
+  char separator = _read_config(matcher->strings, MAX_CONFIG_SIZE);
+  char* saveptr;
+  char separators[2] = { separator, '\0' };
+  for (char* entry = strtok_r(matcher->strings, separators, &saveptr); entry; entry = strtok_r(NULL, separators, &saveptr))
+    _add_entry(matcher, entry);
+  _add_aliases(matcher);
+
+  // Assign one class to every byte used in any prefix
+  size_t total_len = 0;
+  matcher->class_count = 1;
+  for (unsigned int i = 0; i < matcher->prefix_count; i++) {
+    const struct lock_prefix* prefix = &matcher->prefixes[i];
+    total_len += prefix->len;
+    for (size_t j = 0; j < prefix->len; j++) {
+      unsigned char c = prefix->path[j];
+      if (!matcher->classes[c])
+        matcher->classes[c] = matcher->class_count++;
+    }
+  }
+
+  // Dead state, start state and at most one state per prefix byte
+  size_t max_states = total_len + 2;
+  matcher->accept = calloc(max_states, sizeof(uint16_t));
+  matcher->next = calloc(max_states * matcher->class_count, sizeof(uint16_t));
+  if (!matcher->accept || !matcher->next) {
+    free(matcher->accept);
+    free(matcher->next);
+    free(matcher);
+    return NULL;
+  }
+
+  // Insert all prefixes into the trie
+  matcher->state_count = STATE_START + 1;
+  for (unsigned int i = 0; i < matcher->prefix_count; i++) {
+    const struct lock_prefix* prefix = &matcher->prefixes[i];
+    unsigned int state = STATE_START;
+    for (size_t j = 0; j < prefix->len; j++) {
+      uint16_t* next = &matcher->next[state * matcher->class_count + matcher->classes[(unsigned char)prefix->path[j]]];
+      if (*next == STATE_DEAD)
+        *next = matcher->state_count++;
+      state = *next;
+    }
+    // The first entry wins on duplicates
+    if (!matcher->accept[state])
+      matcher->accept[state] = i + 1;
+  }
+
+  return matcher;
+}
+
+// Fills _lock_path_heads from the transitions of the state after "/"
+static void _publish_heads(const struct lock_matcher* matcher) {
+  unsigned int root = matcher->next[STATE_START * matcher->class_count + matcher->classes['/']];
+  for (unsigned int c = 1; c < 256; c++) {
+    bool live = root != STATE_DEAD && matcher->classes[c] && matcher->next[root * matcher->class_count + matcher->classes[c]] != STATE_DEAD;
+    __atomic_store_n(&_lock_path_heads[c], live, __ATOMIC_RELAXED);
+  }
+  // Aliases like "//var" or "/./var" need normalizing first
+  if (root != STATE_DEAD) {
+    __atomic_store_n(&_lock_path_heads['/'], 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&_lock_path_heads['.'], 1, __ATOMIC_RELAXED);
+  }
+}
+
+// Returns the compiled matcher. Builds it on first use.
+static inline const struct lock_matcher* _get_matcher(void) {
+  struct lock_matcher* matcher = __atomic_load_n(&current_matcher, __ATOMIC_ACQUIRE);
+  if (__builtin_expect(matcher != NULL, 1))
+    return matcher;
+
+  struct lock_matcher* new_matcher = _build_matcher();
+  if (!new_matcher)
+    return NULL;
+
+  // Publish. If another thread was faster, then use its result.
+  if (!__atomic_compare_exchange_n(&current_matcher, &matcher, new_matcher, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(new_matcher->accept);
+    free(new_matcher->next);
+    free(new_matcher);
+    return matcher;
+  }
+  _publish_heads(new_matcher);
+  return new_matcher;
+}
+
+// Build the matcher at load time, so the configuration is parsed only once
+__attribute__ ((constructor (102))) static void _init_matcher(void) {
+  _get_matcher();
+}
+
+
+// Returns the cache slot for an absolute path. The last eight bytes of lock
+// paths differ most (LCK..ttyUSB0, LCK..ttyUSB1).
+// Return value: Cache slot. NULL if the path is not cached.
+static inline struct match_cache_entry* _match_cache_slot(const char* path, size_t* len) {
+  *len = strnlen(path, MATCH_CACHE_PATH);
+  if (*len < MATCH_CACHE_MIN_PATH || *len == MATCH_CACHE_PATH)
+    return NULL;
+
+  uint64_t tail;
+  memcpy(&tail, path + *len - 8, 8);
+  uint64_t hash = (tail ^ *len) * 0x9e3779b97f4a7c15ull;
+  return &match_cache.entries[hash >> (64 - __builtin_ctz(MATCH_CACHE_SIZE))];
+}
+
+// Looks up a path in the match cache
+// Return value: true on hit. "match" is filled then.
+static inline bool _match_cache_get(struct lock_match* match, const struct match_cache_entry* entry, const char* path, size_t len) {
+  unsigned int sequence = match_cache.sequence;
+  if (sequence & 1)
+    return false;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  if (entry->len != len || memcmp(entry->path, path, len) != 0)
+    return false;
+  match->prefix = entry->prefix;
+  match->suffix = path + entry->suffix;
+  match->state = entry->state;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  return match_cache.sequence == sequence;
+}
+
+// Stores a match result in the match cache
+static inline void _match_cache_put(struct match_cache_entry* entry, const struct lock_match* match, const char* path, size_t len) {
+  if (match_cache.sequence & 1)
+    return;
+  match_cache.sequence++;
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  entry->len = len;
+  entry->suffix = match->prefix ? match->suffix - path : 0;
+  entry->state = match->state;
+  entry->prefix = match->prefix;
+  memcpy(entry->path, path, len);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  match_cache.sequence++;
+}
+
+
+// Checks if a path component starts with an alias: An empty component, "."
+// or "..".
+static inline bool _is_alias_component(const char* c) {
+  if (c[0] == '/')
+    return true;
+  if (c[0] != '.')
+    return false;
+  if (c[1] == '.')
+    c++;
+  return c[1] == '/' || c[1] == '\0';
+}
+
+// Checks if the rest of a matched path contains a ".." component. The
+// kernel resolves "." and empty components below the lock root just fine.
+static inline bool _has_parent_component(const char* suffix) {
+  for (const char* c = strstr(suffix, "/.."); c; c = strstr(c + 1, "/.."))
+    if (c[3] == '/' || c[3] == '\0')
+      return true;
+  return false;
+}
+
+// Lexically normalizes a path without any syscall. Drops empty and "."
+// components and removes ".." together with the component before it. This
+// differs from the kernel if a component before ".." is a symlink, which is
+// fine for lock directories. A trailing "/" is kept if the path has to be a
+// directory.
+// Parameters:
+//   destination: Destination string buffer
+//   size: Size of the destination buffer
+//   path: The path to normalize
+// Return value: true on success. false if the result doesn't fit or if a
+//               relative path leaves its starting directory.
+static bool _normalize_path(char* destination, size_t size, const char* path) {
+  size_t base = path[0] == '/' ? 1 : 0;
+  size_t len = base;
+  bool directory = false;
+  destination[0] = '/';
+
+  for (const char* c = path; *c; ) {
+    if (*c == '/') {
+      directory = true;
+      c++;
+      continue;
+    }
+    const char* end = strchrnul(c, '/');
+    size_t component = end - c;
+    if (component == 1 && c[0] == '.')
+      directory = true;
+    else if (component == 2 && c[0] == '.' && c[1] == '.') {
+      if (len == base && !base)
+        return false;
+      while (len > base && destination[len - 1] != '/')
+        len--;
+      if (len > base)
+        len--;
+      directory = true;
+    }
+    else {
+      // Room for the separator, the component, a trailing "/" and "\0"
+      if (len + component + 3 > size)
+        return false;
+      if (len > base)
+        destination[len++] = '/';
+      memcpy(destination + len, c, component);
+      len += component;
+      directory = false;
+    }
+    c = end;
+  }
+
+  if (len == 0)
+    destination[len++] = '.';
+  else if (directory && len > base)
+    destination[len++] = '/';
+  destination[len] = '\0';
+  return true;
+}
+
+// Runs the automaton on a path
+// Return value: Position the automaton died at. NULL if it reached the end.
+static inline const char* _walk_lockpath(const struct lock_matcher* matcher, struct lock_match* match, unsigned int state, const char* path) {
+  char last = '\0';
+  for (const char* c = path; ; c++) {
+    // A prefix only matches at a path component boundary
+    if (matcher->accept[state] && (*c == '\0' || *c == '/')) {
+      match->prefix = &matcher->prefixes[matcher->accept[state] - 1];
+      match->suffix = c;
+    }
+
+    if (*c == '\0') {
+      // Path ended while still on the way to a prefix. Paths relative to
+      // this directory continue after the next "/".
+      if (!match->prefix && last != '/')
+        state = matcher->next[state * matcher->class_count + matcher->classes['/']];
+      if (!match->prefix)
+        match->state = state;
+      return NULL;
+    }
+
+    state = matcher->next[state * matcher->class_count + matcher->classes[(unsigned char)*c]];
+    if (__builtin_expect(state == STATE_DEAD, 1))
+      return c;
+    last = *c;
+  }
+}
+
+
+// First stage of path rewrite
+// Detects if the given path is below our known lock paths. This is called
+// for every single path the application uses. Non-lock paths usually leave
+// the automaton after the first few bytes, so they are rejected without
+// scanning the whole string. If several prefixes match, then the longest
+// one wins. If the path is a parent directory of a lock path (like "/var"),
+// then the state to continue from is returned for paths relative to it.
+// Recent results for absolute paths come from the per-thread match cache.
+// Prameters:
+//   match: Receives the match result
+//   state: State to start from. STATE_START for absolute paths.
+//   path: The path to check
+// Return value: Lock path prefix on match. NULL otherwise.
+__attribute__ ((visibility ("hidden"))) const struct lock_prefix* _match_lockpath(struct lock_match* match, unsigned int state, const char* path) {
+  match->prefix = NULL;
+  match->state = STATE_DEAD;
+  if (state == STATE_DEAD)
+    return NULL;
+
+  const struct lock_matcher* matcher = _get_matcher();
+  if (!matcher)
+    return NULL;
+
+  size_t len = 0;
+  struct match_cache_entry* entry = state == STATE_START ? _match_cache_slot(path, &len) : NULL;
+  if (entry && _match_cache_get(match, entry, path, len))
+    return match->prefix;
+  match->prefix = NULL;
+  match->state = STATE_DEAD;
+
+  const char* dead = _walk_lockpath(matcher, match, state, path);
+
+  // Aliased paths ("//var/lock", "/var/./lock", "/var/lock/../lock") are
+  // matched again in normalized form. Only checked where the automaton
+  // died and in the rest of matched paths.
+  if (__builtin_expect(match->prefix ? _has_parent_component(match->suffix) :
+                       dead && (dead == path || dead[-1] == '/') && _is_alias_component(dead), 0)) {
+    match->prefix = NULL;
+    match->state = STATE_DEAD;
+    if (!_normalize_path(match->normalized, LOCK_NORMALIZED_MAX, path))
+      return NULL;
+    LOCKDEV_PROBE2(normalize, path, match->normalized);
+    _walk_lockpath(matcher, match, state, match->normalized);
+    return match->prefix;
+  }
+
+  // Paths which leave the automaton early are cheap, don't let them evict
+  // lock paths
+  if (entry && (match->prefix || match->state != STATE_DEAD))
+    _match_cache_put(entry, match, path, len);
+  return match->prefix;
+}
+
+// Decides if a call on a path below a blackhole prefix fails with ENOENT.
+// Calls on the directory itself only fail if they just look it up, so it
+// still can be created.
+// Parameters:
+//   match: The match result of the path
+//   lookup: true if the call doesn't create anything
+// Return value: true if the call has to fail with ENOENT
+__attribute__ ((visibility ("hidden"))) bool _is_blackholed(const struct lock_match* match, bool lookup) {
+  const struct lock_prefix* prefix = match->prefix;
+  const struct lock_matcher* matcher = _get_matcher();
+  if (!prefix->blackhole || _strict_lookups || !matcher)
+    return false;
+
+  uint64_t* check = &blackhole_checks[prefix - matcher->prefixes];
+  uint64_t next = __atomic_load_n(check, __ATOMIC_RELAXED);
+  if (next == UINT64_MAX)
+    return false;
+
+  const char* suffix = match->suffix;
+  while (*suffix == '/')
+    suffix++;
+  if (!*suffix && !lookup) {
+    // Check again on next use, this call may create the directory
+    __atomic_store_n(check, 0, __ATOMIC_RELAXED);
+    return false;
+  }
+
+  uint64_t now = _now();
+  if (now >= next) {
+    int saved_errno = errno;
+    bool exists = _directory_exists(prefix->path);
+    errno = saved_errno;
+    __atomic_store_n(check, exists ? UINT64_MAX : now + BLACKHOLE_CHECK_NS, __ATOMIC_RELAXED);
+    if (exists)
+      return false;
+  }
+  LOCKDEV_PROBE1(blackhole, prefix->path);
+  return true;
+}
+
+// Returns the configured target for the given lock root index
+// Return value: Target directory. Relative to $XDG_RUNTIME_DIR if relative.
+__attribute__ ((visibility ("hidden"))) const char* _get_lock_target(unsigned int root) {
+  const struct lock_matcher* matcher = _get_matcher();
+  if (!matcher || root >= matcher->root_count)
+    return DEFAULT_LOCK_TARGET;
+  return matcher->roots[root];
+}
@@ -0,0 +1,431 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include "utilities.h"
+#include "symbols.h"
+
+/*
+ Lock table
+ The uucp lock protocols decide ownership of a device with lock files
+ holding the PID of the owner: A lock is taken by creating the file
+ exclusively (open with O_EXCL or link) and given back by removing it.
+ Locks of crashed processes are detected by reading the PID and checking
+ it with kill(pid, 0), which is racy and several calls per attempt.
+
+ With LOCKDEV_REDIRECT_MUTEX=1 we keep the ownership in memory as well. A
+ file per lock root holds a table of robust, process shared mutexes, one
+ per lock file name ("LCK." prefix). The mutex is taken right
+ before the lock file gets created exclusively and held until the file is
+ removed again. The lock files are still created, so applications without
+ lockdev-redirect see the same locks. With the table:
+
+ - Creating a lock file whose mutex is held by another live process fails
+   with EEXIST without a call.
+ - If the owner died, the next creation gets EOWNERDEAD and removes the
+   stale lock file first. No PID has to be read or checked. The file is
+   only removed if it still is the one the owner created (same device and
+   inode and birth time), processes without the table may have taken the lock meanwhile.
+ - Removing a lock file whose mutex is held by another live process fails
+   with EBUSY. This stops "stale lock" cleanups racing with an owner which
+   created the file but didn't write its PID yet.
+
+ Robust mutexes are owned by threads. A lock file removed by another
+ thread of the owning process (or by its child) is marked as released and
+ left to the file protocol until the owning thread takes it again or
+ exits. The same happens if the table is full or can't be created.
+*/
+
+// The tables live next to the lock roots, not inside them: Applications
+// listing a lock directory don't see them, and removing a lock directory
+// doesn't take the table away from the processes using it. A table is
+// named by the identity of its lock root, so a re-created lock root gets a
+// new one. Tables of removed lock roots stay until the runtime directory is
+// cleaned up.
+#define LOCK_TABLE_DIR "lockdev-redirect"   // Below $XDG_RUNTIME_DIR
+#define LOCK_TABLE_MAGIC 0x4c434b54u   // "LCKT"
+#define LOCK_TABLE_SLOTS 256           // Power of two
+#define LOCK_TABLE_NAME_MAX 56
+
+struct lock_table_slot {
+  unsigned int used;          // Set once hash and name are written
+  uint32_t hash;
+  char name[LOCK_TABLE_NAME_MAX];   // Lock file path below the lock root
+  pthread_mutex_t mutex;
+  pid_t owner_pid;            // Only written while holding "mutex"
+  pid_t owner_tid;
+  unsigned int released;      // Lock file removed behind the owner's back
+  struct lock_file_id owner_file;   // Lock file created by the owner
+} __attribute__ ((aligned (128)));
+
+struct lock_table {
+  unsigned int magic;
+  unsigned int size;
+  pthread_mutex_t alloc;      // Held while a slot is claimed
+  struct lock_table_slot slots[LOCK_TABLE_SLOTS];
+};
+
+// Mapped table per lock root and the root generation it belongs to.
+// Tables of older generations stay mapped, other threads may still use
+// them.
+static struct lock_table* tables[MAX_LOCK_ROOTS];
+static unsigned int table_generations[MAX_LOCK_ROOTS];
+#define TABLE_FAILED ((struct lock_table*)MAP_FAILED)
+
+// LOCKDEV_REDIRECT_MUTEX=1
+__attribute__ ((visibility ("hidden"))) bool _lock_table_enabled = false;
+
+
+static pid_t _gettid(void) {
+  return syscall(SYS_gettid);
+}
+
+// FNV-1a
+static uint32_t _hash_name(const char* name) {
+  uint32_t h = 2166136261u;
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 16777619u;
+  return h;
+}
+
+static bool _init_mutex(pthread_mutex_t* mutex) {
+  pthread_mutexattr_t attr;
+  if (pthread_mutexattr_init(&attr) != 0)
+    return false;
+  bool success = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) == 0 &&
+                 pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) == 0 &&
+                 pthread_mutex_init(mutex, &attr) == 0;
+  pthread_mutexattr_destroy(&attr);
+  return success;
+}
+
+static struct lock_table* _map_table(int fd) {
+  struct stat stat_buf;
+  if (fstat(fd, &stat_buf) != 0 || stat_buf.st_size != sizeof(struct lock_table))
+    return NULL;
+  struct lock_table* table = mmap(NULL, sizeof(struct lock_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (table == MAP_FAILED)
+    return NULL;
+  if (table->magic != LOCK_TABLE_MAGIC || table->size != sizeof(struct lock_table)) {
+    munmap(table, sizeof(struct lock_table));
+    return NULL;
+  }
+  return table;
+}
+
+// Opens the directory of the tables and names the table of a lock root
+// Parameters:
+//   root_fd: Descriptor of the lock root
+//   name: Receives the file name of the table
+//   size: Size of "name"
+// Return value: Directory descriptor. -1 on error.
+static int _open_table_dir(int root_fd, char* name, size_t size) {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  struct lock_target root = { root_fd, ".", 0 };
+  struct lock_file_id id;
+  _get_lock_file_id(&root, &id);
+  if (!runtime_dir || !runtime_dir[0] || !id.ino)
+    return -1;
+  snprintf(name, size, "table-%llx-%llx-%llx", (unsigned long long)id.dev, (unsigned long long)id.ino,
+           (unsigned long long)id.birth);
+
+  char path[PATH_MAX];
+  int n = snprintf(path, sizeof(path), "%s/" LOCK_TABLE_DIR, runtime_dir);
+  if (n < 0 || n >= PATH_MAX)
+    return -1;
+  ORIG(mkdir)(path, 0700);
+  return ORIG(open)(path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+}
+
+// Creates the table under a temporary name and links it into place, so
+// nobody ever maps a half initialized table
+// Return value: true if a table exists now
+static bool _create_table(int dirfd, const char* table_name) {
+  char name[96];
+  snprintf(name, sizeof(name), "%s.%d", table_name, getpid());
+  int fd = ORIG(openat)(dirfd, name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return false;
+
+  bool success = false;
+  struct lock_table* table = MAP_FAILED;
+  if (ftruncate(fd, sizeof(struct lock_table)) == 0)
+    table = mmap(NULL, sizeof(struct lock_table), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (table != MAP_FAILED) {
+    success = _init_mutex(&table->alloc);
+    for (unsigned int i = 0; success && i < LOCK_TABLE_SLOTS; i++)
+      success = _init_mutex(&table->slots[i].mutex);
+    table->size = sizeof(struct lock_table);
+    table->magic = LOCK_TABLE_MAGIC;
+    munmap(table, sizeof(struct lock_table));
+  }
+  ORIG(close)(fd);
+  // Someone else may have been faster
+  if (success)
+    success = ORIG(linkat)(dirfd, name, dirfd, table_name, 0) == 0 || errno == EEXIST;
+  unlinkat(dirfd, name, 0);
+  return success;
+}
+
+// Return value: The table of the lock root of "target". NULL if there is none.
+static struct lock_table* _get_table(const struct lock_target* target) {
+  unsigned int index = target->root;
+  const struct lock_root* root = _get_lock_root(index);
+  if (!root)
+    return NULL;
+  struct lock_table* table = __atomic_load_n(&tables[index], __ATOMIC_ACQUIRE);
+  if (__builtin_expect(table != NULL && __atomic_load_n(&table_generations[index], __ATOMIC_RELAXED) == root->generation, 1))
+    return table == TABLE_FAILED ? NULL : table;
+
+  char name[64];
+  int dirfd = _open_table_dir(target->dirfd, name, sizeof(name));
+  int fd = -1;
+  if (dirfd != -1) {
+    fd = ORIG(openat)(dirfd, name, O_RDWR | O_CLOEXEC);
+    if (fd == -1 && errno == ENOENT && _create_table(dirfd, name))
+      fd = ORIG(openat)(dirfd, name, O_RDWR | O_CLOEXEC);
+    ORIG(close)(dirfd);
+  }
+  struct lock_table* mapped = NULL;
+  if (fd != -1) {
+    mapped = _map_table(fd);
+    ORIG(close)(fd);
+  }
+
+  // Don't try again for this generation if it failed
+  __atomic_store_n(&table_generations[index], root->generation, __ATOMIC_RELAXED);
+  __atomic_store_n(&tables[index], mapped ? mapped : TABLE_FAILED, __ATOMIC_RELEASE);
+  return mapped;
+}
+
+// Looks for the slot of a lock file name. Claims a free slot if "claim" is
+// set, the caller has to hold "alloc" then.
+// Return value: Slot index. -1 if not found or the table is full.
+static int _probe_slots(struct lock_table* table, uint32_t hash, const char* name, bool claim) {
+  for (unsigned int i = 0; i < LOCK_TABLE_SLOTS; i++) {
+    struct lock_table_slot* slot = &table->slots[(hash + i) & (LOCK_TABLE_SLOTS - 1)];
+    // Slots are never given back, so the first free slot ends the search
+    if (!__atomic_load_n(&slot->used, __ATOMIC_ACQUIRE)) {
+      if (!claim)
+        return -1;
+      slot->hash = hash;
+      strcpy(slot->name, name);
+      __atomic_store_n(&slot->used, 1, __ATOMIC_RELEASE);
+      return slot - table->slots;
+    }
+    if (slot->hash == hash && strcmp(slot->name, name) == 0)
+      return slot - table->slots;
+  }
+  return -1;
+}
+
+// Return value: The slot of a lock file name. NULL if there is none and
+//   "create" isn't set or the table is full.
+static struct lock_table_slot* _find_slot(struct lock_table* table, const char* name, bool create) {
+  uint32_t hash = _hash_name(name);
+  int index = _probe_slots(table, hash, name, false);
+  if (index == -1 && create) {
+    int result = pthread_mutex_lock(&table->alloc);
+    if (result == EOWNERDEAD)
+      pthread_mutex_consistent(&table->alloc);
+    if (result == 0 || result == EOWNERDEAD) {
+      index = _probe_slots(table, hash, name, true);
+      pthread_mutex_unlock(&table->alloc);
+    }
+  }
+  return index == -1 ? NULL : &table->slots[index];
+}
+
+// Only lock files ("LCK..ttyS0", lockdev's "LCK.004 064") are tracked
+static bool _is_lock_file(const char* path) {
+  const char* name = strrchr(path, '/');
+  name = name ? name + 1 : path;
+  return strncmp(name, "LCK.", 4) == 0 && strlen(path) < LOCK_TABLE_NAME_MAX;
+}
+
+static bool _is_owner(const struct lock_table_slot* slot, pid_t pid) {
+  return slot->owner_pid == pid && slot->owner_tid == _gettid();
+}
+
+// Checks if the process holding the lock of a slot is still there
+static bool _owner_alive(const struct lock_table_slot* slot) {
+  return slot->owner_pid > 0 && (kill(slot->owner_pid, 0) == 0 || errno == EPERM);
+}
+
+// Checks if the lock file still is the one the owner of a slot created
+static bool _owner_file(const struct lock_table_slot* slot, const struct lock_target* target) {
+  struct lock_file_id id;
+  _get_lock_file_id(target, &id);
+  return _same_lock_file(&slot->owner_file, &id);
+}
+
+// Gives a slot back after "mutex" was taken and the lock file wasn't kept
+static void _release(struct lock_table_slot* slot) {
+  slot->owner_pid = 0;
+  slot->owner_tid = 0;
+  slot->owner_file.ino = 0;
+  __atomic_store_n(&slot->released, 0, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&slot->mutex);
+}
+
+// Finds the slot of a lock file
+static struct lock_table_slot* _get_slot(const struct lock_target* target, bool create) {
+  if (!_is_lock_file(target->path))
+    return NULL;
+  struct lock_table* table = _get_table(target);
+  return table ? _find_slot(table, target->path, create) : NULL;
+}
+
+// Called before a lock file is created exclusively
+// Parameters:
+//   target: Redirect target of the lock file
+//   held: Set to the slot of the lock file if the caller holds it now. Has
+//     to be passed to _lock_table_end_create then. NULL if the file protocol
+//     decides.
+// Return value: false if another process holds the lock
+__attribute__ ((visibility ("hidden"))) bool _lock_table_begin_create(const struct lock_target* target, struct lock_table_slot** held) {
+  int saved_errno = errno;
+  *held = NULL;
+  struct lock_table_slot* slot = _get_slot(target, true);
+  if (!slot) {
+    errno = saved_errno;
+    return true;
+  }
+
+  pid_t pid = getpid();
+  int result = _is_owner(slot, pid) ? 0 : pthread_mutex_trylock(&slot->mutex);
+  if (result == EOWNERDEAD) {
+    // The owning thread is gone. If its whole process is gone, then the lock
+    // file is stale.
+    pthread_mutex_consistent(&slot->mutex);
+    // A process without the table could still replace the file between
+    // the check and the unlink, but it had to find the lock stale in the
+    // same moment.
+    if (!__atomic_load_n(&slot->released, __ATOMIC_RELAXED) && !_owner_alive(slot) &&
+        _owner_file(slot, target)) {
+      LOCKDEV_PROBE2(lock_table_stale, target->path, slot->owner_pid);
+      unlinkat(target->dirfd, target->path, 0);
+    }
+    slot->owner_pid = 0;
+    slot->owner_tid = 0;
+    slot->owner_file.ino = 0;
+    __atomic_store_n(&slot->released, 0, __ATOMIC_RELAXED);
+    result = 0;
+  }
+  bool available = true;
+  if (result == 0)
+    *held = slot;
+  // Locks of our own process and released locks are left to the file
+  // protocol. So is a lock file someone removed without us.
+  else if (result == EBUSY && !__atomic_load_n(&slot->released, __ATOMIC_RELAXED) &&
+           slot->owner_pid != pid && slot->owner_pid != getppid() && !_lookup_absent(target)) {
+    LOCKDEV_PROBE2(lock_table_busy, target->path, slot->owner_pid);
+    available = false;
+  }
+  errno = saved_errno;
+  return available;
+}
+
+// Called after the exclusive creation
+// Parameters:
+//   slot: Slot returned by _lock_table_begin_create
+//   target: Redirect target of the lock file
+//   success: true if the lock file was created
+__attribute__ ((visibility ("hidden"))) void _lock_table_end_create(struct lock_table_slot* slot, const struct lock_target* target, bool success) {
+  pid_t pid = getpid();
+  if (success) {
+    slot->owner_pid = pid;
+    slot->owner_tid = _gettid();
+    _get_lock_file_id(target, &slot->owner_file);
+    __atomic_store_n(&slot->released, 0, __ATOMIC_RELAXED);
+  }
+  else if (!_is_owner(slot, pid)) {
+    int saved_errno = errno;
+    _release(slot);
+    errno = saved_errno;
+  }
+}
+
+// Called before a lock file is removed
+// Parameters:
+//   target: Redirect target of the lock file
+//   held: Set to the slot of the lock file if the caller holds it now. Has
+//     to be passed to _lock_table_end_remove then. NULL if the file protocol
+//     decides.
+// Return value: false if another live process holds the lock
+__attribute__ ((visibility ("hidden"))) bool _lock_table_begin_remove(const struct lock_target* target, struct lock_table_slot** held) {
+  int saved_errno = errno;
+  *held = NULL;
+  struct lock_table_slot* slot = _get_slot(target, false);
+  if (!slot) {
+    errno = saved_errno;
+    return true;
+  }
+
+  pid_t pid = getpid();
+  int result = _is_owner(slot, pid) ? 0 : pthread_mutex_trylock(&slot->mutex);
+  if (result == EOWNERDEAD) {
+    pthread_mutex_consistent(&slot->mutex);
+    result = 0;
+  }
+  bool available = true;
+  if (result == 0)
+    *held = slot;
+  else if (result == EBUSY) {
+    // Other threads of the owner and its children may give the lock back,
+    // but the owning thread keeps the mutex until it takes the lock again
+    if (__atomic_load_n(&slot->released, __ATOMIC_RELAXED) || slot->owner_pid == pid || slot->owner_pid == getppid())
+      __atomic_store_n(&slot->released, 1, __ATOMIC_RELAXED);
+    else {
+      LOCKDEV_PROBE2(lock_table_busy, target->path, slot->owner_pid);
+      available = false;
+    }
+  }
+  errno = saved_errno;
+  return available;
+}
+
+// Called after the removal
+// Parameters:
+//   slot: Slot returned by _lock_table_begin_remove
+//   success: true if the lock file was removed
+__attribute__ ((visibility ("hidden"))) void _lock_table_end_remove(struct lock_table_slot* slot, bool success) {
+  if (!success && _is_owner(slot, getpid()))
+    return;
+  int saved_errno = errno;
+  _release(slot);
+  errno = saved_errno;
+}
+
+__attribute__ ((constructor (104))) static void _init_lock_table(void) {
+  const char* enabled = getenv("LOCKDEV_REDIRECT_MUTEX");
+  _lock_table_enabled = enabled && strcmp(enabled, "1") == 0;
+}
@@ -0,0 +1,396 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+#include "utilities.h"
+#include "symbols.h"
+
+/*
+ Negative lookup cache
+ Lock pollers and the "is this device locked" checks of rxtx stat lock
+ files which almost never exist. To answer these lookups without walking
+ the path in the kernel, we keep the names found in the lock root (and in
+ directories directly below it) in memory. A name which is not in this
+ view does not exist.
+
+ Every viewed directory has an inotify watch. Creations by us and by other
+ processes are queued there by the kernel before the creating call
+ returns. Before answering from memory we check with FIONREAD if the queue
+ is empty, and apply the pending events otherwise. This is one cheap
+ syscall without path lookup, and keeps the answers exact.
+
+ LOCKDEV_REDIRECT_STRICT=1 disables the cache, for example if the lock
+ root is on a file system where inotify misses changes (like NFS). It also
+ disables the blackhole prefixes (see lockpaths.c).
+*/
+
+#define LOOKUP_VIEWS 8
+#define LOOKUP_SLOTS 512          // Power of two
+#define LOOKUP_MAX_ENTRIES 384    // Larger directories are not cached
+#define LOOKUP_RETRY 256          // Lookups until a failed view is built again
+
+// Names of one directory. Identity and names are only written while the
+// view is invalid, so readers check "state" before and after reading.
+// Names are stored as hash with a count of entries in the low byte, so a
+// hash collision can't make a removal hide an existing name.
+struct lookup_view {
+  unsigned int state;         // Invalidation count << 1 | valid bit
+  unsigned int root;          // Lock root index and generation
+  unsigned int generation;
+  int wd;                     // inotify watch. -1 if none.
+  unsigned int retry;         // Lookups to skip after the view failed to build
+  unsigned int used;          // Slots which are not free
+  char dir[NAME_MAX + 1];     // Directory below the lock root. "" for the root.
+  uint64_t names[LOOKUP_SLOTS];   // 0 for free slots. Count 0 for removed names.
+};
+
+#define NAME_COUNT 0xffull
+
+static struct lookup_view views[LOOKUP_VIEWS];
+static unsigned int view_count = 0;
+static int notify_fd = -1;
+static bool disabled = false;
+
+// LOCKDEV_REDIRECT_STRICT=1. Also disables the blackhole prefixes.
+__attribute__ ((visibility ("hidden"))) bool _strict_lookups = false;
+
+// Held while events are applied or views are built. Never waited for:
+// Whoever doesn't get it just does the real lookup.
+static int busy = 0;
+
+// Buffers for event and directory reading. Only used while "busy" is held,
+// so wrappers don't need them on their stack.
+static char buffer[4096] __attribute__ ((aligned (8)));
+static char path_buffer[PATH_MAX];
+
+
+static bool _try_lock(void) {
+  int expected = 0;
+  return __atomic_compare_exchange_n(&busy, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void _unlock(void) {
+  __atomic_store_n(&busy, 0, __ATOMIC_RELEASE);
+}
+
+// FNV-1a without the count byte. Never 0, as 0 marks free slots.
+static uint64_t _hash_name(const char* name) {
+  uint64_t h = 14695981039346656037ull;
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 1099511628211ull;
+  h &= ~NAME_COUNT;
+  return h ? h : NAME_COUNT + 1;
+}
+
+// Return value: Slot holding the hash, free slot ending its probe sequence
+// or -1 if the table is full
+static int _find_slot(const struct lookup_view* view, uint64_t hash) {
+  for (unsigned int i = 0; i < LOOKUP_SLOTS; i++) {
+    unsigned int index = ((hash >> 8) + i) & (LOOKUP_SLOTS - 1);
+    uint64_t slot = __atomic_load_n(&view->names[index], __ATOMIC_RELAXED);
+    if (slot == 0 || (slot & ~NAME_COUNT) == hash)
+      return index;
+  }
+  return -1;
+}
+
+// Return value: true if a name with this hash may exist
+static bool _view_contains(const struct lookup_view* view, uint64_t hash) {
+  int index = _find_slot(view, hash);
+  return index < 0 || (__atomic_load_n(&view->names[index], __ATOMIC_RELAXED) & NAME_COUNT);
+}
+
+static void _invalidate(struct lookup_view* view) {
+  unsigned int state = __atomic_load_n(&view->state, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&view->state, &state, ((state >> 1) + 1) << 1, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void _invalidate_all(void) {
+  for (unsigned int i = 0; i < LOOKUP_VIEWS; i++)
+    _invalidate(&views[i]);
+}
+
+// Adds (or removes with "delta" -1) a name. Invalidates the view if it
+// gets too large. Only called with "busy" held.
+// Return value: false if the view got invalid
+static bool _view_update(struct lookup_view* view, const char* name, int delta) {
+  uint64_t hash = _hash_name(name);
+  int index = _find_slot(view, hash);
+  uint64_t slot = index < 0 ? 0 : view->names[index];
+  uint64_t count = (slot & NAME_COUNT) + delta;
+  if (index < 0 || count > NAME_COUNT || (slot == 0 && view->used >= LOOKUP_MAX_ENTRIES)) {
+    _invalidate(view);
+    view->retry = LOOKUP_RETRY;
+    return false;
+  }
+  if (slot == 0)
+    view->used++;
+  __atomic_store_n(&view->names[index], hash | count, __ATOMIC_RELAXED);
+  return true;
+}
+
+// Applies all queued inotify events. Only called with "busy" held.
+static void _apply_events(int fd) {
+  ssize_t len;
+  while ((len = read(fd, buffer, sizeof(buffer))) > 0) {
+    for (char* p = buffer; p < buffer + len; ) {
+      struct inotify_event* event = (struct inotify_event*)p;
+      p += sizeof(struct inotify_event) + event->len;
+
+      if (event->mask & IN_Q_OVERFLOW) {
+        _invalidate_all();
+        continue;
+      }
+      for (unsigned int i = 0; i < view_count; i++) {
+        struct lookup_view* view = &views[i];
+        if (view->wd != event->wd)
+          continue;
+        if (event->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED | IN_UNMOUNT))
+          _invalidate(view);
+        else if (event->len)
+          _view_update(view, event->name, (event->mask & (IN_CREATE | IN_MOVED_TO)) ? 1 : -1);
+        if (event->mask & IN_IGNORED)
+          view->wd = -1;
+      }
+    }
+  }
+}
+
+// Makes sure that no change to viewed directories is pending
+// Return value: true if the views are up to date
+static bool _sync_events(int fd) {
+  int pending = 0;
+  if (ioctl(fd, FIONREAD, &pending) != 0)
+    return false;
+
+  // Someone else may be applying the events just taken from the queue
+  if (pending == 0)
+    return __atomic_load_n(&busy, __ATOMIC_ACQUIRE) == 0;
+
+  if (!_try_lock())
+    return false;
+  _apply_events(fd);
+  _unlock();
+  return true;
+}
+
+// Reads all names of a directory into a view. The watch is set up before,
+// so no change gets lost. Only called with "busy" held.
+// Return value: true on success
+static bool _fill_view(struct lookup_view* view, int fd, const struct lock_root* root) {
+  size_t len = root->len;
+  size_t dir_len = strlen(view->dir);
+  if (len + 1 + dir_len >= PATH_MAX)
+    return false;
+  memcpy(path_buffer, root->path, len);
+  if (dir_len) {
+    path_buffer[len++] = '/';
+    memcpy(path_buffer + len, view->dir, dir_len);
+    len += dir_len;
+  }
+  path_buffer[len] = '\0';
+
+  if (view->wd >= 0)
+    inotify_rm_watch(fd, view->wd);
+  view->wd = inotify_add_watch(fd, path_buffer, IN_CREATE | IN_MOVED_TO | IN_DELETE | IN_MOVED_FROM | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+  if (view->wd < 0)
+    return false;
+
+  int dirfd = ORIG(open)(path_buffer, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0)
+    return false;
+  memset(view->names, 0, sizeof(view->names));
+  view->used = 0;
+  bool success = true;
+  long n;
+  while (success && (n = syscall(SYS_getdents64, dirfd, buffer, sizeof(buffer))) > 0) {
+    for (long pos = 0; success && pos < n; ) {
+      struct dirent64* entry = (struct dirent64*)(buffer + pos);
+      pos += entry->d_reclen;
+      if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+        success = _view_update(view, entry->d_name, 1);
+    }
+  }
+  ORIG(close)(dirfd);
+  return success && n == 0;
+}
+
+// Builds the view of a directory. Reuses the view of the same directory in
+// an older generation of the lock root. If building fails (the directory
+// is missing or too large), then the following lookups skip the cache.
+// Return value: true if the view is valid now
+static bool _build_view(unsigned int index, const struct lock_root* root, const char* dir, size_t dir_len) {
+  if (!_try_lock())
+    return false;
+
+  int fd = __atomic_load_n(&notify_fd, __ATOMIC_ACQUIRE);
+  if (fd < 0) {
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0) {
+      // Probably out of inotify instances. Don't try again.
+      __atomic_store_n(&disabled, true, __ATOMIC_RELAXED);
+      _unlock();
+      return false;
+    }
+    _track_internal_fd(fd);
+    for (unsigned int i = 0; i < view_count; i++)
+      views[i].wd = -1;
+    __atomic_store_n(&notify_fd, fd, __ATOMIC_RELEASE);
+  }
+  _apply_events(fd);
+
+  struct lookup_view* view = NULL;
+  for (unsigned int i = 0; i < view_count; i++) {
+    if (views[i].root == index && strncmp(views[i].dir, dir, dir_len) == 0 && views[i].dir[dir_len] == '\0') {
+      view = &views[i];
+      break;
+    }
+  }
+  if (!view && view_count < LOOKUP_VIEWS) {
+    view = &views[view_count];
+    view->wd = -1;
+    view->root = index;
+    memcpy(view->dir, dir, dir_len);
+    view->dir[dir_len] = '\0';
+    __atomic_store_n(&view_count, view_count + 1, __ATOMIC_RELEASE);
+  }
+
+  bool valid = false;
+  if (view && view->retry && view->generation == root->generation)
+    view->retry--;
+  else if (view) {
+    _invalidate(view);
+    unsigned int state = __atomic_load_n(&view->state, __ATOMIC_RELAXED);
+    view->generation = root->generation;
+    view->retry = 0;
+    if (_fill_view(view, fd, root))
+      valid = __atomic_compare_exchange_n(&view->state, &state, state | 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    else
+      view->retry = LOOKUP_RETRY;
+  }
+  _unlock();
+  return valid;
+}
+
+// Looks up a name in the matching view
+// Return value: 1 if absent, 0 if it may exist, -1 if there is no valid view
+static int _lookup(unsigned int index, const struct lock_root* root, const char* dir, size_t dir_len, uint64_t hash) {
+  unsigned int count = __atomic_load_n(&view_count, __ATOMIC_ACQUIRE);
+  for (unsigned int i = 0; i < count; i++) {
+    struct lookup_view* view = &views[i];
+    unsigned int state = __atomic_load_n(&view->state, __ATOMIC_ACQUIRE);
+    if (!(state & 1) || view->root != index || view->generation != root->generation ||
+        strncmp(view->dir, dir, dir_len) != 0 || view->dir[dir_len] != '\0')
+      continue;
+
+    bool contains = _view_contains(view, hash);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&view->state, __ATOMIC_RELAXED) != state)
+      return -1;
+    return contains ? 0 : 1;
+  }
+  return -1;
+}
+
+// Checks if a redirected path is known not to exist. Used by the lookup
+// wrappers (stat, access, open without O_CREAT, ...) to answer ENOENT
+// without a path lookup. Only names in the lock root or in a directory
+// directly below it are cached.
+// Parameters:
+//   target: Redirect target as returned by _redirect_path
+// Return value: true if the path does not exist. false if unknown.
+__attribute__ ((visibility ("hidden"))) bool _lookup_absent(const struct lock_target* target) {
+  if (__atomic_load_n(&disabled, __ATOMIC_RELAXED))
+    return false;
+
+  // Split into directory and name. Deeper paths and "." or ".." aren't cached.
+  const char* path = target->path;
+  const char* name = strchr(path, '/');
+  size_t dir_len = 0;
+  if (name) {
+    dir_len = name - path;
+    name++;
+    if (dir_len > NAME_MAX || strchr(name, '/') ||
+        (path[0] == '.' && (dir_len == 1 || (dir_len == 2 && path[1] == '.'))))
+      return false;
+  }
+  else
+    name = path;
+  if (!name[0] || (name[0] == '.' && (!name[1] || (name[1] == '.' && !name[2]))))
+    return false;
+
+  const struct lock_root* root = _get_lock_root(target->root);
+  if (!root)
+    return false;
+  uint64_t hash = _hash_name(name);
+
+  // Existing names are never answered from memory, so they don't need the
+  // queue to be checked
+  int result = _lookup(target->root, root, path, dir_len, hash);
+  if (result == 0)
+    return false;
+  int fd = __atomic_load_n(&notify_fd, __ATOMIC_ACQUIRE);
+  if (result == 1)
+    result = (fd >= 0 && _sync_events(fd)) ? _lookup(target->root, root, path, dir_len, hash) : 0;
+  if (result < 0 && _build_view(target->root, root, path, dir_len))
+    result = _lookup(target->root, root, path, dir_len, hash);
+  if (result == 1)
+    LOCKDEV_PROBE2(lookup_cached, root->path, path);
+  return result == 1;
+}
+
+// Called by the close wrappers. Our inotify descriptor gets replaced by a
+// new one on next use.
+// Parameters:
+//   first: First closed descriptor
+//   last: Last closed descriptor
+__attribute__ ((visibility ("hidden"))) void _forget_lookup_fds(int first, int last) {
+  int fd = __atomic_load_n(&notify_fd, __ATOMIC_ACQUIRE);
+  if (fd >= first && fd <= last && __atomic_compare_exchange_n(&notify_fd, &fd, -1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    _invalidate_all();
+}
+
+// The child shares the inotify queue with its parent. Reading from it would
+// steal events of the parent, so the child starts over with its own.
+static void _reset_after_fork(void) {
+  if (notify_fd >= 0)
+    ORIG(close)(notify_fd);
+  notify_fd = -1;
+  busy = 0;
+  _invalidate_all();
+}
+
+__attribute__ ((constructor (104))) static void _init_lookup(void) {
+  const char* strict = getenv("LOCKDEV_REDIRECT_STRICT");
+  _strict_lookups = strict && strcmp(strict, "1") == 0;
+  if (_strict_lookups || pthread_atfork(NULL, NULL, _reset_after_fork))
+    disabled = true;
+}
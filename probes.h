@@ -0,0 +1,34 @@
+// USDT probes for bpftrace, perf and SystemTap
+// Provider "lockdev_redirect" with these probes:
+//   entry(function, path, path2)        Every intercepted call. Paths may be NULL.
+//   exit(function, result)              Return of the call. Pointers as integer.
+//   match(path, prefix, suffix)         Path matched a lock path prefix
+//   redirect(prefix, root, target)      Matched path gets forwarded to "target"
+//                                       relative to the lock root "root"
+//   redirect_failed(prefix)             Lock root not available, call is forwarded unchanged
+//   rewrite(destination, success)       Path rewritten to an absolute path (mktemp)
+//   lookup_cached(root, target)         ENOENT answered by the negative lookup cache
+//   blackhole(prefix)                   ENOENT answered for a missing blackhole directory
+//   normalize(path, normalized)         Aliased path matched again in normalized form
+//   lock_table_stale(path, owner)       Lock file of a dead owner removed (LOCKDEV_REDIRECT_MUTEX)
+//   lock_table_busy(path, owner)        Lock held by another live process (LOCKDEV_REDIRECT_MUTEX)
+//   broker_request(path, result)        Answer of lockdev-redirectd (LOCKDEV_REDIRECT_BROKER)
+// A probe is a single NOP until a tracer attaches to it. Without
+// <sys/sdt.h> or with -DLOCKDEV_NO_PROBES there are no probes at all.
+
+#if !defined(LOCKDEV_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LOCKDEV_PROBES 1
+#endif
+#endif
+
+#ifdef LOCKDEV_PROBES
+#define LOCKDEV_PROBE1(name, a) STAP_PROBE1(lockdev_redirect, name, a)
+#define LOCKDEV_PROBE2(name, a, b) STAP_PROBE2(lockdev_redirect, name, a, b)
+#define LOCKDEV_PROBE3(name, a, b, c) STAP_PROBE3(lockdev_redirect, name, a, b, c)
+#else
+#define LOCKDEV_PROBE1(name, a) do {} while (0)
+#define LOCKDEV_PROBE2(name, a, b) do {} while (0)
+#define LOCKDEV_PROBE3(name, a, b, c) do {} while (0)
+#endif
@@ -0,0 +1,418 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <linux/limits.h>
+#include "stats.h"
+#include "stats_segment.h"
+#include "symbols.h"
+
+// Counters of one thread. Blocks are never freed. The block of an exited
+// thread is handed to the next new thread, as only the sum is reported.
+struct lock_stats_block {
+  struct lock_stats_counters functions[LOCK_STATS_FUNCTIONS];
+  struct lock_stats_block* next;
+  int in_use;
+} __attribute__ ((aligned (64)));
+
+__attribute__ ((visibility ("hidden"))) const char* const _stats_function_names[] = {
+#define LOCK_STATS_NAME(name, ...) #name,
+#define LOCK_STATS_NO_NAME(name, ...)
+  LOCKDEV_WRAPPERS(LOCK_STATS_NAME, LOCK_STATS_NAME, LOCK_STATS_NAME, LOCK_STATS_NAME, LOCK_STATS_NAME, LOCK_STATS_NAME, LOCK_STATS_NO_NAME)
+#undef LOCK_STATS_NAME
+#undef LOCK_STATS_NO_NAME
+};
+
+__attribute__ ((visibility ("hidden"))) int _stats_enabled = 0;
+
+static struct lock_stats_block* blocks = NULL;
+static __thread struct lock_stats_block* current_block __attribute__ ((tls_model ("initial-exec")));
+static pthread_key_t block_key;
+static char report_path[PATH_MAX];
+
+#define REPORT_SIZE (64 * 1024)
+
+// Live segment, see stats_segment.h. Published from within the wrappers at
+// most once per interval, so an idle process costs nothing.
+#define PUBLISH_INTERVAL_NS 1000000000ull
+static bool live = false;
+static struct lock_stats_segment* segment = NULL;
+static char segment_path[PATH_MAX];
+static uint64_t next_publish = 0;
+static int publishing = 0;
+
+#define SEGMENT_SIZE (sizeof(struct lock_stats_segment) + LOCK_STATS_FUNCTIONS * sizeof(struct lock_stats_entry))
+
+
+static uint64_t _now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Returns the counter block of the calling thread. Takes a free block or
+// allocates a new one on first use.
+// Return value: Counter block. NULL on error.
+static struct lock_stats_block* _get_block(void) {
+  struct lock_stats_block* block = current_block;
+  if (__builtin_expect(block != NULL, 1))
+    return block;
+
+  for (block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block; block = block->next) {
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&block->in_use, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      break;
+  }
+
+  if (!block) {
+    // Don't use malloc. We may be called from within malloc'ing code.
+    block = mmap(NULL, sizeof(struct lock_stats_block), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (block == MAP_FAILED)
+      return NULL;
+    block->in_use = 1;
+    block->next = __atomic_load_n(&blocks, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&blocks, &block->next, block, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      ;
+  }
+
+  current_block = block;
+  pthread_setspecific(block_key, block);
+  return block;
+}
+
+// Thread exit: Hand our block over to the next thread
+static void _release_block(void* block) {
+  current_block = NULL;
+  __atomic_store_n(&((struct lock_stats_block*)block)->in_use, 0, __ATOMIC_RELEASE);
+}
+
+// Only the forking thread lives on in the child. Drop the counts of the
+// parent, so they are not reported twice. The child gets its own segment,
+// but not before one interval, so fork+exec does not leave segments behind.
+static void _reset_after_fork(void) {
+  for (struct lock_stats_block* block = blocks; block; block = block->next) {
+    memset(block->functions, 0, sizeof(block->functions));
+    if (block != current_block)
+      block->in_use = 0;
+  }
+
+  if (segment)
+    munmap(segment, SEGMENT_SIZE);
+  segment = NULL;
+  if (next_publish != UINT64_MAX)
+    next_publish = _now() + PUBLISH_INTERVAL_NS;
+  publishing = 0;
+}
+
+// Sums up the counters of all threads
+static void _merge(struct lock_stats_counters* total) {
+  memset(total, 0, sizeof(struct lock_stats_counters) * LOCK_STATS_FUNCTIONS);
+  for (struct lock_stats_block* block = __atomic_load_n(&blocks, __ATOMIC_ACQUIRE); block; block = block->next) {
+    for (unsigned int id = 0; id < LOCK_STATS_FUNCTIONS; id++) {
+      const struct lock_stats_counters* counters = &block->functions[id];
+      total[id].calls += counters->calls;
+      total[id].hits += counters->hits;
+      total[id].rewrite_failures += counters->rewrite_failures;
+      for (unsigned int i = 0; i < LOCK_STATS_ERRNOS; i++)
+        total[id].errors[i] += counters->errors[i];
+      for (unsigned int i = 0; i < LOCK_STATS_BUCKETS; i++)
+        total[id].overhead[i] += counters->overhead[i];
+    }
+  }
+}
+
+
+// Creates and maps the live segment of this process
+// Return value: Segment. NULL on error.
+static struct lock_stats_segment* _create_segment(void) {
+  const char* runtime_dir = getenv("XDG_RUNTIME_DIR");
+  if (!runtime_dir || !runtime_dir[0])
+    return NULL;
+
+  // Create "lockdev-redirect" and the segment directory below it. Errors
+  // show up on open.
+  int n = snprintf(segment_path, PATH_MAX, "%s/%s", runtime_dir, LOCK_STATS_SEGMENT_DIR);
+  if (n < 0 || n >= PATH_MAX)
+    return NULL;
+  char* slash = strrchr(segment_path, '/');
+  *slash = '\0';
+  ORIG(mkdir)(segment_path, 0700);
+  *slash = '/';
+  ORIG(mkdir)(segment_path, 0700);
+
+  int m = snprintf(segment_path + n, PATH_MAX - n, "/%d", getpid());
+  if (m < 0 || m >= PATH_MAX - n)
+    return NULL;
+
+  int fd = ORIG(open)(segment_path, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return NULL;
+  struct lock_stats_segment* result = NULL;
+  if (ftruncate(fd, SEGMENT_SIZE) == 0) {
+    result = mmap(NULL, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (result == MAP_FAILED)
+      result = NULL;
+  }
+  ORIG(close)(fd);
+  if (!result)
+    ORIG(remove)(segment_path);
+  return result;
+}
+
+// Writes the current counters to the live segment
+static void _publish(uint64_t now) {
+  static struct lock_stats_counters total[LOCK_STATS_FUNCTIONS];
+  int saved_errno = errno;
+
+  if (!segment) {
+    segment = _create_segment();
+    if (!segment) {
+      fprintf(stderr, "lockdev-redirect: Failed to create live statistics segment, %s\n", strerror(errno));
+      __atomic_store_n(&next_publish, UINT64_MAX, __ATOMIC_RELAXED);
+      errno = saved_errno;
+      return;
+    }
+  }
+
+  _merge(total);
+
+  uint64_t sequence = __atomic_load_n(&segment->sequence, __ATOMIC_RELAXED) | 1;
+  __atomic_store_n(&segment->sequence, sequence, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  segment->magic = LOCK_STATS_SEGMENT_MAGIC;
+  segment->version = LOCK_STATS_SEGMENT_VERSION;
+  segment->pid = getpid();
+  segment->function_count = LOCK_STATS_FUNCTIONS;
+  strncpy(segment->command, program_invocation_short_name, sizeof(segment->command) - 1);
+  for (unsigned int id = 0; id < LOCK_STATS_FUNCTIONS; id++) {
+    struct lock_stats_entry* entry = &segment->functions[id];
+    uint64_t errors = 0;
+    for (unsigned int i = 0; i < LOCK_STATS_ERRNOS; i++)
+      errors += total[id].errors[i];
+    strncpy(entry->name, _stats_function_names[id], sizeof(entry->name) - 1);
+    __atomic_store_n(&entry->calls, total[id].calls, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->hits, total[id].hits, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->rewrite_failures, total[id].rewrite_failures, __ATOMIC_RELAXED);
+    __atomic_store_n(&entry->errors, errors, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&segment->published_ns, now, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&segment->sequence, sequence + 1, __ATOMIC_RELEASE);
+  errno = saved_errno;
+}
+
+// Publishes if the interval is over and no other thread does it already
+static void _maybe_publish(uint64_t now) {
+  if (now < __atomic_load_n(&next_publish, __ATOMIC_RELAXED))
+    return;
+  int expected = 0;
+  if (!__atomic_compare_exchange_n(&publishing, &expected, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    return;
+  if (now >= next_publish) {
+    next_publish = now + PUBLISH_INTERVAL_NS;
+    _publish(now);
+  }
+  __atomic_store_n(&publishing, 0, __ATOMIC_RELEASE);
+}
+
+
+// Called by _stats_enter if statistics, tracing or capturing are enabled
+__attribute__ ((visibility ("hidden"))) void _stats_begin(struct lock_stats_call* call, unsigned int id, const char* path, const char* path2) {
+  int enabled = __atomic_load_n(&_stats_enabled, __ATOMIC_RELAXED);
+  call->counters = NULL;
+  if (enabled & LOCK_STATS_COUNTING) {
+    struct lock_stats_block* block = _get_block();
+    if (block) {
+      call->counters = &block->functions[id];
+      call->counters->calls++;
+    }
+  }
+  if (!call->counters && !(enabled & (LOCK_STATS_TRACING | LOCK_STATS_CAPTURING)))
+    return;
+
+  call->active = true;
+  call->path = path;
+  call->path2 = path2;
+  call->decision = LOCK_STATS_MISS;
+  if (enabled & LOCK_STATS_TRACING)
+    call->trace_start = _trace_clock();
+  if (call->counters || (enabled & LOCK_STATS_CAPTURING))
+    call->start = _now();
+  if (live && call->counters)
+    _maybe_publish(call->start);
+}
+
+__attribute__ ((visibility ("hidden"))) void _stats_arguments(struct lock_stats_call* call, unsigned int count, ...) {
+  va_list args;
+  va_start(args, count);
+  if (count > LOCK_CAPTURE_ARGS)
+    count = LOCK_CAPTURE_ARGS;
+  for (unsigned int i = 0; i < count; i++) {
+    call->arg_kinds[i] = va_arg(args, int);
+    call->args[i] = va_arg(args, int64_t);
+  }
+  va_end(args);
+  call->arg_count = count;
+}
+
+__attribute__ ((visibility ("hidden"))) void _stats_decision(struct lock_stats_call* call, int decision) {
+  struct lock_stats_counters* counters = call->counters;
+  call->decision = decision;
+  if (counters) {
+    if (decision == LOCK_STATS_HIT)
+      counters->hits++;
+    else if (decision == LOCK_STATS_REWRITE_FAILED)
+      counters->rewrite_failures++;
+
+    uint64_t elapsed = _now() - call->start;
+    unsigned int bucket = 0;
+    while (bucket < LOCK_STATS_BUCKETS - 1 && elapsed >= (1ull << bucket))
+      bucket++;
+    counters->overhead[bucket]++;
+  }
+
+  // A failed call that doesn't set errno is not counted with the stale
+  // errno of an earlier call. Restored on success.
+  call->saved_errno = errno;
+  errno = 0;
+}
+
+__attribute__ ((visibility ("hidden"))) void _stats_end(struct lock_stats_call* call, int64_t result, bool failed) {
+  // Successful calls may change errno as well
+  int error = failed ? errno : 0;
+  if (error && call->counters)
+    call->counters->errors[error < LOCK_STATS_ERRNOS ? error : LOCK_STATS_ERRNOS - 1]++;
+  int enabled = __atomic_load_n(&_stats_enabled, __ATOMIC_RELAXED);
+  if (enabled & LOCK_STATS_TRACING)
+    _trace_record(call, result, failed, error);
+  if (enabled & LOCK_STATS_CAPTURING)
+    _capture_record(call, result, failed, error);
+  if (!failed)
+    errno = call->saved_errno;
+}
+
+
+// Appends formatted text to the report buffer
+static void _report_printf(char* buffer, size_t* pos, const char* format, ...) {
+  if (*pos >= REPORT_SIZE)
+    return;
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(buffer + *pos, REPORT_SIZE - *pos, format, args);
+  va_end(args);
+  if (n > 0)
+    *pos += n;
+}
+
+// Merges the counters of all threads and appends them to the report file.
+// One line per called function:
+//   PID FUNCTION calls=N hits=N rewrite_failures=N errno=E:N,... overhead_ns=B:N,...
+// "overhead_ns" counts calls which took less than B ns before forwarding.
+static void _stats_report(void) {
+  static struct lock_stats_counters total[LOCK_STATS_FUNCTIONS];
+  static char buffer[REPORT_SIZE];
+  _merge(total);
+
+  size_t pos = 0;
+  int pid = getpid();
+  _report_printf(buffer, &pos, "# lockdev-redirect statistics for pid %d (%s)\n", pid, program_invocation_name);
+  for (unsigned int id = 0; id < LOCK_STATS_FUNCTIONS; id++) {
+    const struct lock_stats_counters* counters = &total[id];
+    if (!counters->calls)
+      continue;
+
+    _report_printf(buffer, &pos, "%d %s calls=%llu hits=%llu rewrite_failures=%llu errno=", pid, _stats_function_names[id],
+                   (unsigned long long)counters->calls, (unsigned long long)counters->hits,
+                   (unsigned long long)counters->rewrite_failures);
+    const char* separator = "";
+    for (unsigned int i = 0; i < LOCK_STATS_ERRNOS; i++) {
+      if (counters->errors[i]) {
+        _report_printf(buffer, &pos, "%s%u:%llu", separator, i, (unsigned long long)counters->errors[i]);
+        separator = ",";
+      }
+    }
+
+    _report_printf(buffer, &pos, " overhead_ns=");
+    separator = "";
+    for (unsigned int i = 0; i < LOCK_STATS_BUCKETS; i++) {
+      if (counters->overhead[i]) {
+        _report_printf(buffer, &pos, "%s%llu:%llu", separator, 1ull << i, (unsigned long long)counters->overhead[i]);
+        separator = ",";
+      }
+    }
+    _report_printf(buffer, &pos, "\n");
+  }
+  if (pos > REPORT_SIZE - 1)
+    pos = REPORT_SIZE - 1;
+
+  // One write with O_APPEND, so reports of several processes don't mix
+  int fd = ORIG(open)(report_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "lockdev-redirect: Failed to write statistics to %s, %s\n", report_path, strerror(errno));
+    return;
+  }
+  if (write(fd, buffer, pos) != (ssize_t)pos)
+    fprintf(stderr, "lockdev-redirect: Failed to write statistics to %s\n", report_path);
+  ORIG(close)(fd);
+}
+
+// A live segment of a process that is gone would only confuse the viewer
+__attribute__ ((destructor)) static void _stats_exit(void) {
+  if (!(_stats_enabled & LOCK_STATS_COUNTING))
+    return;
+  if (report_path[0])
+    _stats_report();
+  if (segment) {
+    ORIG(remove)(segment_path);
+    segment = NULL;
+  }
+}
+
+__attribute__ ((constructor (103))) static void _init_stats(void) {
+  const char* path = getenv("LOCKDEV_REDIRECT_STATS");
+  const char* live_env = getenv("LOCKDEV_REDIRECT_LIVE");
+  live = live_env && strcmp(live_env, "1") == 0;
+  if (path && path[0]) {
+    if (strlen(path) < PATH_MAX)
+      strcpy(report_path, path);
+    else
+      fprintf(stderr, "lockdev-redirect: LOCKDEV_REDIRECT_STATS too long, report disabled\n");
+  }
+  if (!report_path[0] && !live)
+    return;
+
+  if (pthread_key_create(&block_key, _release_block) || pthread_atfork(NULL, NULL, _reset_after_fork)) {
+    fprintf(stderr, "lockdev-redirect: Failed to set up statistics\n");
+    return;
+  }
+  __atomic_or_fetch(&_stats_enabled, LOCK_STATS_COUNTING, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,148 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include "wrappers.h"
+#include "probes.h"
+#include "capture_file.h"
+
+// Call statistics
+// Enabled with LOCKDEV_REDIRECT_STATS=<file>. Every thread counts into its
+// own block of cache line aligned counters, so the wrappers never use
+// atomic operations or shared cache lines. The blocks are merged and
+// appended to the given file when the process exits. If statistics are
+// disabled, then every wrapper only pays one predictable branch.
+// With LOCKDEV_REDIRECT_LIVE=1 the merged counters are also published to a
+// shared segment while the process runs (see stats_segment.h).
+// LOCKDEV_REDIRECT_TRACE uses the same hooks to record every single call,
+// LOCKDEV_REDIRECT_CAPTURE to record calls on lock paths for replay.
+
+// One ID per intercepted function
+enum {
+#define LOCK_STATS_ID(name, ...) LOCK_STATS_##name,
+#define LOCK_STATS_NO_ID(name, ...)
+  LOCKDEV_WRAPPERS(LOCK_STATS_ID, LOCK_STATS_ID, LOCK_STATS_ID, LOCK_STATS_ID, LOCK_STATS_ID, LOCK_STATS_ID, LOCK_STATS_NO_ID)
+#undef LOCK_STATS_ID
+#undef LOCK_STATS_NO_ID
+  LOCK_STATS_FUNCTIONS
+};
+
+// errno values above this share the last counter
+#define LOCK_STATS_ERRNOS 48
+// Overhead histogram: Bucket n counts calls which took less than 2^n ns
+#define LOCK_STATS_BUCKETS 24
+
+struct lock_stats_counters {
+  uint64_t calls;
+  uint64_t hits;                // Path was redirected
+  uint64_t rewrite_failures;    // Path matched but could not be redirected
+  uint64_t errors[LOCK_STATS_ERRNOS];    // errno of failed calls
+  uint64_t overhead[LOCK_STATS_BUCKETS]; // Time spent before forwarding
+} __attribute__ ((aligned (64)));
+
+// State of one wrapper call
+struct lock_stats_call {
+  struct lock_stats_counters* counters;   // NULL if calls are not counted
+  const char* path;             // Path arguments. Only set while tracing.
+  const char* path2;
+  uint64_t start;               // CLOCK_MONOTONIC at entry if counted or captured
+  uint64_t trace_start;         // Trace timestamp at entry if traced
+  unsigned int id;              // LOCK_STATS_* of the function
+  int decision;
+  int saved_errno;
+  bool active;                  // Counted, traced or captured
+  unsigned char arg_count;      // Arguments. Only set while capturing.
+  unsigned char arg_kinds[LOCK_CAPTURE_ARGS];
+  int64_t args[LOCK_CAPTURE_ARGS];
+};
+
+// Decision of a wrapper, passed to _stats_forward
+enum {
+  LOCK_STATS_MISS,
+  LOCK_STATS_HIT,
+  LOCK_STATS_REWRITE_FAILED
+};
+
+// Bits of _stats_enabled
+#define LOCK_STATS_COUNTING 1   // LOCKDEV_REDIRECT_STATS or LOCKDEV_REDIRECT_LIVE
+#define LOCK_STATS_TRACING 2    // LOCKDEV_REDIRECT_TRACE, see trace_ring.h
+#define LOCK_STATS_CAPTURING 4  // LOCKDEV_REDIRECT_CAPTURE, see capture_file.h
+
+extern int _stats_enabled;
+extern const char* const _stats_function_names[];
+
+void _stats_begin(struct lock_stats_call* call, unsigned int id, const char* path, const char* path2);
+void _stats_decision(struct lock_stats_call* call, int decision);
+void _stats_end(struct lock_stats_call* call, int64_t result, bool failed);
+void _stats_arguments(struct lock_stats_call* call, unsigned int count, ...);
+uint64_t _trace_clock(void);
+void _trace_record(const struct lock_stats_call* call, int64_t result, bool failed, int error);
+void _capture_record(const struct lock_stats_call* call, int64_t result, bool failed, int error);
+
+// Starts counting a call of the given function. "path" and "path2" are the
+// path arguments of the call or NULL.
+static inline void _stats_enter(struct lock_stats_call* call, unsigned int id, const char* path, const char* path2) {
+  LOCKDEV_PROBE3(entry, _stats_function_names[id], path, path2);
+  call->id = id;
+  call->active = false;
+  call->arg_count = 0;
+  if (__builtin_expect(__atomic_load_n(&_stats_enabled, __ATOMIC_RELAXED) != 0, 0))
+    _stats_begin(call, id, path, path2);
+}
+
+// Kind and value of one argument as passed to _stats_arguments
+#define LOCK_STATS_ARG(x) \
+  _Generic((x), char*: LOCK_CAPTURE_ARG_STRING, const char*: LOCK_CAPTURE_ARG_STRING, \
+           int: LOCK_CAPTURE_ARG_INT, unsigned int: LOCK_CAPTURE_ARG_INT, \
+           long: LOCK_CAPTURE_ARG_INT, unsigned long: LOCK_CAPTURE_ARG_INT, \
+           default: LOCK_CAPTURE_ARG_OTHER), (int64_t)(intptr_t)(x)
+
+#define LOCK_STATS_NARGS(...) LOCK_STATS_NARGS_(__VA_ARGS__, 6, 5, 4, 3, 2, 1)
+#define LOCK_STATS_NARGS_(a1, a2, a3, a4, a5, a6, n, ...) n
+#define LOCK_STATS_EACH(...) LOCK_STATS_EACH_(LOCK_STATS_NARGS(__VA_ARGS__), __VA_ARGS__)
+#define LOCK_STATS_EACH_(n, ...) LOCK_STATS_EACH__(n, __VA_ARGS__)
+#define LOCK_STATS_EACH__(n, ...) LOCK_STATS_EACH_##n(__VA_ARGS__)
+#define LOCK_STATS_EACH_1(a) LOCK_STATS_ARG(a)
+#define LOCK_STATS_EACH_2(a, ...) LOCK_STATS_ARG(a), LOCK_STATS_EACH_1(__VA_ARGS__)
+#define LOCK_STATS_EACH_3(a, ...) LOCK_STATS_ARG(a), LOCK_STATS_EACH_2(__VA_ARGS__)
+#define LOCK_STATS_EACH_4(a, ...) LOCK_STATS_ARG(a), LOCK_STATS_EACH_3(__VA_ARGS__)
+#define LOCK_STATS_EACH_5(a, ...) LOCK_STATS_ARG(a), LOCK_STATS_EACH_4(__VA_ARGS__)
+#define LOCK_STATS_EACH_6(a, ...) LOCK_STATS_ARG(a), LOCK_STATS_EACH_5(__VA_ARGS__)
+
+// Remembers the arguments of a call for capturing. "args" is the
+// parenthesized argument list of the wrapper.
+#define LOCK_STATS_ARGUMENTS(stats, args) \
+  do { \
+    if (__builtin_expect((stats).active, 0) && (__atomic_load_n(&_stats_enabled, __ATOMIC_RELAXED) & LOCK_STATS_CAPTURING)) \
+      _stats_arguments(&(stats), LOCK_STATS_NARGS args, LOCK_STATS_EACH args); \
+  } while (0)
+
+// Records the decision right before the call is forwarded
+static inline void _stats_forward(struct lock_stats_call* call, int decision) {
+  if (__builtin_expect(call->active, 0))
+    _stats_decision(call, decision);
+}
+
+// Records result and errno of the forwarded call. errno is only looked at
+// if the call failed.
+static inline void _stats_leave(struct lock_stats_call* call, int64_t result, bool failed) {
+  LOCKDEV_PROBE2(exit, _stats_function_names[call->id], result);
+  if (__builtin_expect(call->active, 0))
+    _stats_end(call, result, failed);
+}
+
+// Tells from the return value of a wrapper if the call failed. Descriptors
+// and status codes are -1 then, streams and directories NULL. mktemp
+// returns an empty template.
+static inline bool _stats_failed_int(int result) { return result == -1; }
+static inline bool _stats_failed_string(const char* result) { return !result || !result[0]; }
+static inline bool _stats_failed_pointer(const void* result) { return !result; }
+#define LOCK_STATS_FAILED(result) \
+  _Generic((result), int: _stats_failed_int, char*: _stats_failed_string, default: _stats_failed_pointer)(result)
+
+// Returns "expr" from a wrapper after recording its result and errno
+#define LOCK_STATS_RETURN(stats, expr) \
+  do { \
+    __typeof__(expr) _stats_result = (expr); \
+    _stats_leave(&(stats), (int64_t)(intptr_t)_stats_result, LOCK_STATS_FAILED(_stats_result)); \
+    return _stats_result; \
+  } while (0)
@@ -0,0 +1,37 @@
+#include <stdint.h>
+
+// Live statistics segment
+// With LOCKDEV_REDIRECT_LIVE=1 every process publishes its merged counters
+// to the file $XDG_RUNTIME_DIR/lockdev-redirect/stats/<pid>, which is
+// mapped shared. It is kept out of the redirect target, where applications
+// would see it and where removing the lock directory would remove it.
+// "lockdev-redirect --stats" reads all of them. This header is the only
+// thing the library and the viewer share, so the layout must only change
+// together with LOCK_STATS_SEGMENT_VERSION.
+//
+// Writers use a sequence lock: "sequence" is odd while the segment is
+// updated. Readers copy the segment and retry if "sequence" was odd or
+// changed in the meantime. The target never waits for a reader.
+
+#define LOCK_STATS_SEGMENT_MAGIC 0x53524c44  // "DLRS"
+#define LOCK_STATS_SEGMENT_VERSION 1
+#define LOCK_STATS_SEGMENT_DIR "lockdev-redirect/stats"  // Below $XDG_RUNTIME_DIR
+
+struct lock_stats_entry {
+  char name[24];
+  uint64_t calls;
+  uint64_t hits;
+  uint64_t rewrite_failures;
+  uint64_t errors;            // Sum over all errno values
+};
+
+struct lock_stats_segment {
+  uint32_t magic;
+  uint32_t version;
+  int32_t pid;
+  uint32_t function_count;
+  char command[64];
+  uint64_t sequence;
+  uint64_t published_ns;      // CLOCK_MONOTONIC of the last update
+  struct lock_stats_entry functions[];
+};
@@ -0,0 +1,56 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdio.h>
+#include "symbols.h"
+
+// Dispatch table with pointers to the original glibc functions
+__attribute__ ((visibility ("hidden"))) struct orig_symbols _orig;
+
+// Resolves one symbol and stores it into its slot of the dispatch table.
+// This may run concurrently in several threads. All of them get the same
+// pointer from dlsym, so the stores are idempotent. A missing symbol is
+// reported once and then remembered as ORIG_SYMBOL_MISSING, so later calls
+// neither repeat the lookup nor the message.
+// Parameters:
+//   slot: The slot in "_orig" to fill
+//   name: The symbol name to look up
+// Return value: Pointer to the original function. NULL on error.
+__attribute__ ((visibility ("hidden"))) void* _resolve_symbol(void** slot, const char* name) {
+  void* func = dlsym(RTLD_NEXT, name);
+  if (func == NULL) {
+    fprintf(stderr, "lockdev-redirect: CRITICAL ERROR: can't call %s\n", name);
+    __atomic_store_n(slot, ORIG_SYMBOL_MISSING, __ATOMIC_RELEASE);
+    return NULL;
+  }
+
+  __atomic_store_n(slot, func, __ATOMIC_RELEASE);
+  return func;
+}
+
+// Fills the whole dispatch table once at load time. Doing this early means
+// that no dlsym call (which takes loader locks) has to happen later, for
+// example in a vfork child or in a signal handler. Symbols missing in older
+// glibc versions are only reported once something actually calls them.
+__attribute__ ((constructor (101))) static void _resolve_symbols(void) {
+#define ORIG_SYMBOL(name, ret, params) __atomic_store_n((void**)&_orig.name, dlsym(RTLD_NEXT, #name), __ATOMIC_RELEASE);
+  ORIG_SYMBOLS
+#undef ORIG_SYMBOL
+}
@@ -0,0 +1,38 @@
+#include <stdint.h>
+#include "wrappers.h"
+
+// Every function listed in wrappers.h gets a slot in the dispatch table
+// "_orig" which holds the pointer to the next (original) implementation, as
+// returned by dlsym(RTLD_NEXT, ...). Our own code has to use this table for
+// every function we override.
+#define ORIG_SYMBOL_OPEN(name, params, ...) ORIG_SYMBOL(name, int, params)
+#define ORIG_SYMBOL_ANY(name, ret, params, ...) ORIG_SYMBOL(name, ret, params)
+#define ORIG_SYMBOLS LOCKDEV_WRAPPERS(ORIG_SYMBOL_OPEN, ORIG_SYMBOL_OPEN, ORIG_SYMBOL_ANY, ORIG_SYMBOL_ANY, ORIG_SYMBOL_ANY, ORIG_SYMBOL_ANY, ORIG_SYMBOL_ANY)
+
+struct orig_symbols {
+#define ORIG_SYMBOL(name, ret, params) ret (*name) params;
+  ORIG_SYMBOLS
+#undef ORIG_SYMBOL
+};
+
+extern struct orig_symbols _orig;
+
+// Stored in a slot of "_orig" for a symbol that isn't there
+#define ORIG_SYMBOL_MISSING ((void*)1)
+
+void* _resolve_symbol(void** slot, const char* name);
+
+// Fetches the original function for the given symbol name. The table is
+// filled at load time, so this usually is one (relaxed) load. Calls that
+// arrive before our constructor did run resolve their symbol on demand.
+// Return value: Pointer to the original function. NULL if it is missing.
+static inline __attribute__ ((always_inline)) void* _orig_symbol(void** slot, const char* name) {
+  void* func = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (__builtin_expect((uintptr_t)func > (uintptr_t)ORIG_SYMBOL_MISSING, 1))
+    return func;
+  if (func == ORIG_SYMBOL_MISSING)
+    return NULL;
+  return _resolve_symbol(slot, name);
+}
+
+#define ORIG(name) ((__typeof__(_orig.name))_orig_symbol((void**)&_orig.name, #name))
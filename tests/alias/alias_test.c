@@ -0,0 +1,63 @@
+// Checks that lock directories are recognized under other names: The
+// directory a configured symlink points to and /var/run/lock.
+//
+// Usage: testrun DIR
+//   DIR/link has to be a symlink to DIR/real and has to be configured as
+//   lock path.
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); failed = 1; }
+
+// stat behind the back of lockdev-redirect
+static int raw_stat(const char* path, struct stat* buf) {
+  return syscall(SYS_newfstatat, AT_FDCWD, path, buf, 0);
+}
+
+static int create(const char* path) {
+  int fd = open(path, O_CREAT | O_WRONLY, 0644);
+  if (fd == -1)
+    return -1;
+  return close(fd);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2)
+    return 1;
+  int failed = 0;
+  char link_path[PATH_MAX];
+  char real_path[PATH_MAX];
+  snprintf(link_path, PATH_MAX, "%s/link/LCK..alias%d", argv[1], getpid());
+  snprintf(real_path, PATH_MAX, "%s/real/LCK..alias%d", argv[1], getpid());
+
+  // The symlink target is redirected like the symlink
+  struct stat st;
+  CHECK(create(link_path) == 0);
+  CHECK(stat(real_path, &st) == 0);
+  CHECK(raw_stat(real_path, &st) == -1 && errno == ENOENT);
+  CHECK(unlink(real_path) == 0);
+  CHECK(stat(link_path, &st) == -1 && errno == ENOENT);
+
+  // /var/run/lock, if it is /run/lock on this system
+  struct stat run_lock;
+  struct stat var_run_lock;
+  if (raw_stat("/run/lock", &run_lock) == 0 && raw_stat("/var/run/lock", &var_run_lock) == 0 &&
+      run_lock.st_dev == var_run_lock.st_dev && run_lock.st_ino == var_run_lock.st_ino) {
+    snprintf(link_path, PATH_MAX, "/run/lock/LCK..alias%d", getpid());
+    snprintf(real_path, PATH_MAX, "/var/run/lock/LCK..alias%d", getpid());
+    CHECK(create(link_path) == 0);
+    CHECK(stat(real_path, &st) == 0);
+    CHECK(unlink(real_path) == 0);
+    CHECK(stat(link_path, &st) == -1 && errno == ENOENT);
+  }
+
+  return failed;
+}
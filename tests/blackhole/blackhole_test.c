@@ -0,0 +1,81 @@
+// Checks that calls below missing blackhole directories fail with ENOENT
+// and that the directories are noticed once they appear. Directories are
+// created with raw syscalls, so lockdev-redirect doesn't see them.
+//
+// Usage: testrun DIR1 DIR2 [strict]
+//   DIR1 and DIR2 have to be configured as blackholes and must not exist
+//   at startup. With "strict" blackholes have to be disabled
+//   (LOCKDEV_REDIRECT_STRICT=1).
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); return 1; }
+
+// Creates the directory and a lock file in it behind the back of
+// lockdev-redirect
+static int raw_create(const char* dir, const char* file) {
+  if (syscall(SYS_mkdirat, AT_FDCWD, dir, 0755) == -1)
+    return -1;
+  int fd = syscall(SYS_openat, AT_FDCWD, file, O_CREAT | O_WRONLY, 0644);
+  if (fd == -1)
+    return -1;
+  return syscall(SYS_close, fd);
+}
+
+static bool is_enoent(int result) {
+  return result == -1 && errno == ENOENT;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 3)
+    return 1;
+  bool strict = argc > 3 && strcmp(argv[3], "strict") == 0;
+  const char* dir1 = argv[1];
+  const char* dir2 = argv[2];
+  char file1[PATH_MAX];
+  char file2[PATH_MAX];
+  snprintf(file1, PATH_MAX, "%s/LCK..ttyS0", dir1);
+  snprintf(file2, PATH_MAX, "%s/LCK..ttyS0", dir2);
+
+  // Missing directories fail as usual
+  struct stat st;
+  CHECK(is_enoent(stat(file1, &st)));
+  CHECK(is_enoent(access(file1, F_OK)));
+  CHECK(is_enoent(open(file1, O_RDONLY)));
+  CHECK(is_enoent(open(file1, O_CREAT | O_WRONLY, 0644)));
+  CHECK(is_enoent(stat(dir1, &st)));
+
+  // Existing directories are never blackholed, even if configured
+  CHECK(stat("/tmp", &st) == 0);
+
+  // Within the first second a blackhole answers without looking
+  CHECK(raw_create(dir1, file1) == 0);
+  int result = stat(file1, &st);
+  CHECK(strict ? result == 0 : is_enoent(result));
+
+  // Creating the directory itself is always forwarded and makes the next
+  // call check again
+  CHECK(raw_create(dir2, file2) == 0);
+  result = stat(file2, &st);
+  CHECK(strict ? result == 0 : is_enoent(result));
+  CHECK(mkdir(dir2, 0755) == -1 && errno == EEXIST);
+  CHECK(stat(file2, &st) == 0);
+  result = stat(file1, &st);
+  CHECK(strict ? result == 0 : is_enoent(result));
+
+  // After one second the directory is checked again
+  usleep(1100000);
+  CHECK(stat(file1, &st) == 0);
+  CHECK(access(file1, F_OK) == 0);
+
+  return 0;
+}
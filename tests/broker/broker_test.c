@@ -0,0 +1,217 @@
+// Checks the lock broker (LOCKDEV_REDIRECT_BROKER=1): Locks of live
+// processes can't be taken or removed, a released lock goes to the process
+// which waited first, and lock files of killed owners are removed. A lock
+// whose file was removed behind the back of the daemon is free. Threads
+// share the connection. Without the daemon, lock files work as usual.
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define LOCKDIR "/var/lock"
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); return 1; }
+
+static char name[64];
+static char path[PATH_MAX];
+
+// Takes a lock the way rxtx does
+static int create_lock(void) {
+  int fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+  if (fd == -1)
+    return -1;
+  char pid[16];
+  int len = snprintf(pid, sizeof(pid), "%10d\n", getpid());
+  write(fd, pid, len);
+  close(fd);
+  return 0;
+}
+
+// Tries to take the lock from a new process
+// Return value: errno of the attempt. 0 on success.
+static int create_lock_in_child(void) {
+  pid_t child = fork();
+  if (child == 0)
+    _exit(create_lock() == 0 ? 0 : errno);
+  int status;
+  if (child == -1 || waitpid(child, &status, 0) != child || !WIFEXITED(status))
+    return -1;
+  return WEXITSTATUS(status);
+}
+
+// Takes and gives back a lock of its own many times
+static void* lock_thread(void* arg) {
+  char file[PATH_MAX];
+  snprintf(file, PATH_MAX, "%s/%s.%ld", LOCKDIR, name, (long)arg);
+  for (int i = 0; i < 200; i++) {
+    int fd = open(file, O_CREAT | O_EXCL | O_WRONLY, 0644);
+    if (fd == -1)
+      return (void*)1;
+    close(fd);
+    if (unlink(file) != 0)
+      return (void*)1;
+  }
+  return NULL;
+}
+
+// Asks the daemon for owner and waiters
+static int query_status(const char* daemon, int* owner, unsigned int* waiters) {
+  char command[PATH_MAX];
+  snprintf(command, PATH_MAX, "%s --status %s", daemon, name);
+  FILE* fp = popen(command, "r");
+  if (!fp)
+    return -1;
+  char line[PATH_MAX];
+  int result = -1;
+  if (fgets(line, sizeof(line), fp) && sscanf(line, "%*s %d %u", owner, waiters) == 2)
+    result = 0;
+  pclose(fp);
+  return result;
+}
+
+int main(int argc, char *argv[]) {
+  snprintf(name, sizeof(name), "LCK..broker%d", getpid());
+  snprintf(path, PATH_MAX, "%s/%s", LOCKDIR, name);
+  struct stat st;
+
+  // Without the daemon
+  if (argc < 2) {
+    CHECK(create_lock() == 0);
+    CHECK(create_lock() == -1 && errno == EEXIST);
+    CHECK(unlink(path) == 0);
+    CHECK(stat(path, &st) == -1 && errno == ENOENT);
+    return 0;
+  }
+  const char* daemon = argv[1];
+
+  // Lock held by another process
+  int ready[2];
+  int release[2];
+  int released[2];
+  CHECK(pipe(ready) == 0 && pipe(release) == 0 && pipe(released) == 0);
+  pid_t child = fork();
+  CHECK(child != -1);
+  if (child == 0) {
+    // Ends if we do
+    close(release[1]);
+    char c = create_lock() == 0 ? 'y' : 'n';
+    write(ready[1], &c, 1);
+    read(release[0], &c, 1);
+    c = unlink(path) == 0 ? 'y' : 'n';
+    write(released[1], &c, 1);
+    read(release[0], &c, 1);
+    _exit(0);
+  }
+  char c;
+  CHECK(read(ready[0], &c, 1) == 1 && c == 'y');
+  CHECK(create_lock() == -1 && errno == EEXIST);
+  CHECK(unlink(path) == -1 && errno == EBUSY);
+  CHECK(stat(path, &st) == 0);
+  int owner;
+  unsigned int waiters;
+  CHECK(query_status(daemon, &owner, &waiters) == 0 && owner == child && waiters == 1);
+
+  // Another process comes later, the lock is kept for us
+  CHECK(create_lock_in_child() == EEXIST);
+  CHECK(write(release[1], "x", 1) == 1);
+  CHECK(read(released[0], &c, 1) == 1 && c == 'y');
+  CHECK(stat(path, &st) == -1 && errno == ENOENT);
+  CHECK(create_lock_in_child() == EEXIST);
+  CHECK(create_lock() == 0);
+  CHECK(query_status(daemon, &owner, &waiters) == 0 && owner == getpid());
+  CHECK(write(release[1], "x", 1) == 1);
+  CHECK(waitpid(child, NULL, 0) == child);
+
+  // Children of the owner may give the lock back
+  child = fork();
+  CHECK(child != -1);
+  if (child == 0)
+    _exit(unlink(path) == 0 ? 0 : 1);
+  int status;
+  CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(stat(path, &st) == -1 && errno == ENOENT);
+  CHECK(query_status(daemon, &owner, &waiters) == 0 && owner == 0);
+
+  // Owner killed: The daemon removes the stale lock file
+  child = fork();
+  CHECK(child != -1);
+  if (child == 0) {
+    c = create_lock() == 0 ? 'y' : 'n';
+    write(ready[1], &c, 1);
+    close(release[1]);
+    read(release[0], &c, 1);
+    _exit(0);
+  }
+  CHECK(read(ready[0], &c, 1) == 1 && c == 'y');
+  CHECK(kill(child, SIGKILL) == 0);
+  CHECK(waitpid(child, NULL, 0) == child);
+  for (int i = 0; i < 200 && stat(path, &st) == 0; i++)
+    usleep(10000);
+  CHECK(stat(path, &st) == -1 && errno == ENOENT);
+  CHECK(create_lock() == 0);
+  CHECK(unlink(path) == 0);
+
+  // Owner killed, but a process without the broker took the lock meanwhile:
+  // Its lock file is kept
+  child = fork();
+  CHECK(child != -1);
+  if (child == 0) {
+    c = create_lock() == 0 ? 'y' : 'n';
+    write(ready[1], &c, 1);
+    close(release[1]);
+    read(release[0], &c, 1);
+    _exit(0);
+  }
+  CHECK(read(ready[0], &c, 1) == 1 && c == 'y');
+  char target[PATH_MAX];
+  char replacement[PATH_MAX];
+  snprintf(target, PATH_MAX, "%s/lock/%s", getenv("XDG_RUNTIME_DIR"), name);
+  snprintf(replacement, PATH_MAX, "%s/lock/LTMP.%s", getenv("XDG_RUNTIME_DIR"), name);
+  int fd = open(replacement, O_CREAT | O_EXCL | O_WRONLY, 0644);
+  CHECK(fd != -1 && close(fd) == 0);
+  CHECK(rename(replacement, target) == 0);
+  CHECK(kill(child, SIGKILL) == 0);
+  CHECK(waitpid(child, NULL, 0) == child);
+  CHECK(query_status(daemon, &owner, &waiters) == 0 && owner == 0);
+  CHECK(stat(path, &st) == 0);
+  CHECK(unlink(path) == 0);
+
+  // Lock file of a live owner removed without the broker: The lock is free
+  child = fork();
+  CHECK(child != -1);
+  if (child == 0) {
+    c = create_lock() == 0 ? 'y' : 'n';
+    write(ready[1], &c, 1);
+    close(release[1]);
+    read(release[0], &c, 1);
+    _exit(0);
+  }
+  CHECK(read(ready[0], &c, 1) == 1 && c == 'y');
+  CHECK(query_status(daemon, &owner, &waiters) == 0 && owner == child);
+  CHECK(unlink(target) == 0);
+  CHECK(create_lock() == 0);
+  CHECK(query_status(daemon, &owner, &waiters) == 0 && owner == getpid());
+  CHECK(unlink(path) == 0);
+  CHECK(write(release[1], "x", 1) == 1);
+  CHECK(waitpid(child, NULL, 0) == child);
+
+  // Threads with concurrent requests
+  pthread_t threads[4];
+  for (long i = 0; i < 4; i++)
+    CHECK(pthread_create(&threads[i], NULL, lock_thread, (void*)i) == 0);
+  for (int i = 0; i < 4; i++) {
+    void* result;
+    CHECK(pthread_join(threads[i], &result) == 0 && result == NULL);
+  }
+
+  return 0;
+}
@@ -0,0 +1,44 @@
+// Produces some calls on lock paths and one call elsewhere. The Makefile
+// replays the capture and checks that only the lock calls were recorded.
+
+#include <linux/limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define LOCKDIR "/var/lock"
+
+
+int main (int argc, char *argv[]) {
+  char lockfilepath[PATH_MAX];
+  char newpath[PATH_MAX];
+  struct stat st;
+  snprintf(lockfilepath, PATH_MAX, "%s/LCK..capture%d", LOCKDIR, getpid());
+  snprintf(newpath, PATH_MAX, "%s/LCK..capture%d.new", LOCKDIR, getpid());
+
+  // Not a lock path, must not be captured
+  if (stat("/", &st))
+    return 1;
+
+  int fd = open(lockfilepath, O_CREAT | O_WRONLY, 0644);
+  if (fd == -1)
+    return 1;
+  int fd2 = dup2(fd, fd + 1);
+  if (fd2 == -1)
+    return 1;
+  close(fd);
+  close(fd2);
+  if (stat(lockfilepath, &st))
+    return 1;
+  if (rename(lockfilepath, newpath))
+    return 1;
+  if (unlink(newpath))
+    return 1;
+
+  // Fails with ENOENT
+  if (unlink(newpath) == 0 || errno != ENOENT)
+    return 1;
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Checks that relative paths are redirected after chdir or fchdir into a
+// lock directory or one of its parents
+//
+// Usage: testrun [RELATIVE]
+//   With RELATIVE the test only checks that the lock file RELATIVE to the
+//   working directory the test was started in is redirected
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define LOCKDIR "/var/lock"
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); return 1; }
+
+// stat behind the back of lockdev-redirect
+static int raw_stat(const char* path, struct stat* buf) {
+  return syscall(SYS_newfstatat, AT_FDCWD, path, buf, 0);
+}
+
+int main(int argc, char *argv[]) {
+  char name[64];
+  char path[PATH_MAX];
+  char relative[PATH_MAX];
+  snprintf(name, sizeof(name), "LCK..chdir%d", getpid());
+  snprintf(path, PATH_MAX, "%s/%s", LOCKDIR, name);
+  snprintf(relative, PATH_MAX, "lock/%s", name);
+  struct stat st;
+
+  // Working directory at startup
+  if (argc > 1) {
+    snprintf(relative, PATH_MAX, "%s%s", argv[1], name);
+    FILE* fp = fopen(relative, "w");
+    CHECK(fp != NULL);
+    fclose(fp);
+    CHECK(stat(path, &st) == 0);
+    CHECK(access(relative, F_OK) == 0);
+    CHECK(unlink(relative) == 0);
+    CHECK(stat(path, &st) == -1 && errno == ENOENT);
+    return 0;
+  }
+
+  // Inside the lock directory
+  CHECK(chdir(LOCKDIR) == 0);
+  FILE* fp = fopen(name, "w");
+  CHECK(fp != NULL);
+  fclose(fp);
+  CHECK(stat(path, &st) == 0);
+  CHECK(unlink(name) == 0);
+  CHECK(stat(path, &st) == -1 && errno == ENOENT);
+
+  // In a parent of the lock directory
+  CHECK(chdir("/var") == 0);
+  int fd = open(relative, O_CREAT | O_WRONLY, 0644);
+  CHECK(fd != -1);
+  close(fd);
+  CHECK(stat(path, &st) == 0);
+  CHECK(access(relative, F_OK) == 0);
+  CHECK(unlink(relative) == 0);
+
+  // Relative chdir from a parent
+  CHECK(chdir("/") == 0);
+  CHECK(chdir("var/lock") == 0);
+  CHECK(creat(name, 0644) != -1);
+  CHECK(stat(path, &st) == 0);
+  CHECK(unlink(path) == 0);
+
+  // fchdir to a parent
+  int dirfd = open("/var", O_RDONLY | O_DIRECTORY);
+  CHECK(dirfd != -1);
+  CHECK(chdir("/") == 0);
+  CHECK(fchdir(dirfd) == 0);
+  close(dirfd);
+  fd = open(relative, O_CREAT | O_WRONLY, 0644);
+  CHECK(fd != -1);
+  close(fd);
+  CHECK(stat(path, &st) == 0);
+  CHECK(unlink(path) == 0);
+
+  // Leaving again stops redirecting
+  char tmpdir[] = "/tmp/lockdev-redirect-chdir-XXXXXX";
+  CHECK(mkdtemp(tmpdir) != NULL);
+  CHECK(chdir(tmpdir) == 0);
+  CHECK(mkdir("lock", 0755) == 0);
+  fd = open(relative, O_CREAT | O_WRONLY, 0644);
+  CHECK(fd != -1);
+  close(fd);
+  CHECK(raw_stat(relative, &st) == 0);
+  CHECK(stat(path, &st) == -1 && errno == ENOENT);
+  CHECK(unlink(relative) == 0 && rmdir("lock") == 0 && chdir("/") == 0 && rmdir(tmpdir) == 0);
+
+  return 0;
+}
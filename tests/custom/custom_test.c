@@ -1,6 +1,7 @@
 // The code here is meant to test functions that are not used by any
 // open source libraries and so need selfmade test code
 
+#define _GNU_SOURCE
 #include <linux/limits.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -9,9 +10,15 @@
 #include <stdbool.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
 
 #define LOCKDIR "/var/lock"
 
+// main() has its own "dirfd"
+static int stream_fd(DIR* dir) {
+  return dir ? dirfd(dir) : -1;
+}
 
 int main (int argc, char *argv[]) {
   char lockfilename[PATH_MAX];
@@ -68,6 +75,131 @@ int main (int argc, char *argv[]) {
   else
     printf("PASS\n");
 
+  // Test openat relative to a parent directory of the lock directory
+  printf("Testing openat: ");
+  int dirfd = open("/var", O_RDONLY | O_DIRECTORY);
+  if (dirfd == -1) {
+    printf("FAIL\n");
+    return 1;
+  }
+  char relativepath[PATH_MAX];
+  n = snprintf(relativepath, PATH_MAX, "lock/%s", lockfilename);
+  if (n < 0 || n >= PATH_MAX)
+    return 1;
+  int fd = openat(dirfd, relativepath, O_WRONLY);
+  close(dirfd);
+  if (fd == -1) {
+    printf("FAIL\n");
+    return 1;
+  }
+  else
+    printf("PASS\n");
+  close(fd);
+
+  // Test openat relative to duplicated descriptors and to the descriptor
+  // of a directory stream
+  printf("Testing openat on dup, fcntl and dirfd: ");
+  DIR* parent = opendir("/var");
+  dirfd = open("/var", O_RDONLY | O_DIRECTORY);
+  int dirfds[] = { dup(dirfd), fcntl(dirfd, F_DUPFD, 0), fcntl(dirfd, F_DUPFD_CLOEXEC, 0), stream_fd(parent) };
+  close(dirfd);
+  for (int i = 0; i < 4; i++) {
+    fd = dirfds[i] == -1 ? -1 : openat(dirfds[i], relativepath, O_WRONLY);
+    if (fd == -1) {
+      printf("FAIL\n");
+      return 1;
+    }
+    close(fd);
+    if (i < 3)
+      close(dirfds[i]);
+  }
+  closedir(parent);
+  printf("PASS\n");
+
+  // Test open64
+  printf("Testing open64: ");
+  fd = open64(lockfilepath, O_RDONLY);
+  if (fd == -1) {
+    printf("FAIL\n");
+    return 1;
+  }
+  else
+    printf("PASS\n");
+  close(fd);
+
+  // Test stat, lstat and statx
+  printf("Testing stat: ");
+  struct stat st;
+  if (stat(lockfilepath, &st) || !S_ISREG(st.st_mode) || lstat(lockfilepath, &st) || !S_ISREG(st.st_mode)) {
+    printf("FAIL\n");
+    return 1;
+  }
+  struct statx stx;
+
+  // No path at all. Kernels before 6.11 fail with EFAULT.
+  fd = open(lockfilepath, O_RDONLY);
+  int result = statx(fd, NULL, AT_EMPTY_PATH, STATX_MODE, &stx);
+  if (fd == -1 || (result == 0 && !S_ISREG(stx.stx_mode)) || (result != 0 && errno != EFAULT)) {
+    printf("FAIL\n");
+    return 1;
+  }
+  close(fd);
+
+  if (statx(AT_FDCWD, lockfilepath, 0, STATX_MODE, &stx) || !S_ISREG(stx.stx_mode)) {
+    printf("FAIL\n");
+    return 1;
+  }
+  else
+    printf("PASS\n");
+
+  // Test access
+  printf("Testing access: ");
+  if (access(lockfilepath, R_OK | W_OK)) {
+    printf("FAIL\n");
+    return 1;
+  }
+  else
+    printf("PASS\n");
+
+  // Test mkdir and opendir
+  printf("Testing mkdir: ");
+  char dirpath[PATH_MAX];
+  n = snprintf(dirpath, PATH_MAX, "%s.d", lockfilepath);
+  if (n < 0 || n >= PATH_MAX)
+    return 1;
+  if (mkdir(dirpath, S_IRWXU)) {
+    printf("FAIL\n");
+    return 1;
+  }
+  else
+    printf("PASS\n");
+
+  printf("Testing opendir: ");
+  DIR* dir = opendir(dirpath);
+  if (!dir) {
+    printf("FAIL\n");
+    return 1;
+  }
+  else
+    printf("PASS\n");
+  closedir(dir);
+  if (remove(dirpath))
+    return 1;
+
+  // Test mkstemp
+  printf("Testing mkstemp: ");
+  char template[] = LOCKDIR "/lockdev-redirect-custom-XXXXXX";
+  fd = mkstemp(template);
+  if (fd == -1 || strncmp(template, LOCKDIR "/", strlen(LOCKDIR "/")) || strstr(template, "XXXXXX")) {
+    printf("FAIL\n");
+    return 1;
+  }
+  else
+    printf("PASS\n");
+  close(fd);
+  if (unlink(template))
+    return 1;
+
   // Finally test remove
   printf("Testing remove: ");
   n = remove(lockfilepath);
@@ -2,7 +2,7 @@
 
 set -e
 
-TESTS="rxtx lockdev custom"
+TESTS="rxtx lockdev custom stack stats trace capture lookup blackhole matchcache normalize alias chdir namespace seccomp locktable broker"
 
 
 # If we run as "root", then we have write access to /var/lock even without
@@ -0,0 +1,135 @@
+// Checks the lock table (LOCKDEV_REDIRECT_MUTEX=1): Locks of live processes
+// can't be taken or removed, locks of killed processes are cleaned up
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define LOCKDIR "/var/lock"
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); return 1; }
+
+static char path[PATH_MAX];
+
+// Takes a lock the way rxtx does
+static int create_lock(const char* file) {
+  int fd = open(file, O_CREAT | O_EXCL | O_WRONLY, 0644);
+  if (fd == -1)
+    return -1;
+  char pid[16];
+  int len = snprintf(pid, sizeof(pid), "%10d\n", getpid());
+  write(fd, pid, len);
+  close(fd);
+  return 0;
+}
+
+static void* unlink_thread(void* arg) {
+  return (void*)(long)unlink(path);
+}
+
+int main(int argc, char *argv[]) {
+  char temp[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/LCK..mutex%d", LOCKDIR, getpid());
+  snprintf(temp, PATH_MAX, "%s/LTMP.mutex%d", LOCKDIR, getpid());
+  struct stat st;
+
+  // Lock held by another process
+  int ready[2];
+  int done[2];
+  CHECK(pipe(ready) == 0 && pipe(done) == 0);
+  pid_t child = fork();
+  CHECK(child != -1);
+  if (child == 0) {
+    char c = create_lock(path) == 0 ? 'y' : 'n';
+    write(ready[1], &c, 1);
+    read(done[0], &c, 1);
+    _exit(0);
+  }
+  char c;
+  CHECK(read(ready[0], &c, 1) == 1 && c == 'y');
+  CHECK(create_lock(path) == -1 && errno == EEXIST);
+  CHECK(unlink(path) == -1 && errno == EBUSY);
+  CHECK(remove(path) == -1 && errno == EBUSY);
+  CHECK(stat(path, &st) == 0);
+  // lockdev style: Link a temporary file to the lock name
+  CHECK(create_lock(temp) == 0);
+  CHECK(link(temp, path) == -1 && errno == EEXIST);
+  CHECK(unlink(temp) == 0);
+
+  // Owner killed: The stale lock file gets replaced
+  CHECK(kill(child, SIGKILL) == 0);
+  CHECK(waitpid(child, NULL, 0) == child);
+  CHECK(create_lock(path) == 0);
+  CHECK(unlink(path) == 0);
+  CHECK(stat(path, &st) == -1 && errno == ENOENT);
+
+  // Owner killed, but a process without the table took the lock meanwhile:
+  // Its lock file is kept
+  CHECK(pipe(ready) == 0);
+  child = fork();
+  CHECK(child != -1);
+  if (child == 0) {
+    char c = create_lock(path) == 0 ? 'y' : 'n';
+    write(ready[1], &c, 1);
+    pause();
+    _exit(0);
+  }
+  CHECK(read(ready[0], &c, 1) == 1 && c == 'y');
+  char target[PATH_MAX];
+  char replacement[PATH_MAX];
+  snprintf(target, PATH_MAX, "%s/lock/LCK..mutex%d", getenv("XDG_RUNTIME_DIR"), getpid());
+  snprintf(replacement, PATH_MAX, "%s/lock/LTMP.other%d", getenv("XDG_RUNTIME_DIR"), getpid());
+  CHECK(create_lock(replacement) == 0);
+  CHECK(rename(replacement, target) == 0);
+  CHECK(kill(child, SIGKILL) == 0);
+  CHECK(waitpid(child, NULL, 0) == child);
+  CHECK(create_lock(path) == -1 && errno == EEXIST);
+  CHECK(stat(path, &st) == 0);
+  CHECK(unlink(path) == 0);
+
+  // Lock given back by another thread of the owner
+  CHECK(create_lock(path) == 0);
+  pthread_t thread;
+  void* result;
+  CHECK(pthread_create(&thread, NULL, unlink_thread, NULL) == 0);
+  CHECK(pthread_join(thread, &result) == 0 && result == NULL);
+  CHECK(stat(path, &st) == -1 && errno == ENOENT);
+  CHECK(create_lock(path) == 0);
+  CHECK(create_lock(path) == -1 && errno == EEXIST);
+  CHECK(unlink(path) == 0);
+
+  // Lock given back by a child of the owner
+  CHECK(create_lock(path) == 0);
+  child = fork();
+  CHECK(child != -1);
+  if (child == 0)
+    _exit(unlink(path) == 0 ? 0 : 1);
+  int status;
+  CHECK(waitpid(child, &status, 0) == child && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(stat(path, &st) == -1 && errno == ENOENT);
+
+  // Lock file created without O_EXCL is still seen
+  FILE* fp = fopen(path, "w");
+  CHECK(fp != NULL);
+  fclose(fp);
+  CHECK(create_lock(path) == -1 && errno == EEXIST);
+  CHECK(unlink(path) == 0);
+
+  // Taken with link
+  CHECK(create_lock(temp) == 0);
+  CHECK(link(temp, path) == 0);
+  CHECK(link(temp, path) == -1 && errno == EEXIST);
+  CHECK(unlink(temp) == 0);
+  CHECK(unlink(path) == 0);
+
+  return 0;
+}
@@ -0,0 +1,109 @@
+// Checks that the negative lookup cache notices every change to the lock
+// directory. Changes by "other processes" are made with raw syscalls on the
+// redirect target, so lockdev-redirect doesn't see them.
+//
+// Usage: testrun [strict]
+//   With "strict" the cache has to be disabled (LOCKDEV_REDIRECT_STRICT=1)
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define LOCKDIR "/var/lock"
+
+static char target_dir[PATH_MAX];
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); return 1; }
+
+// Creates a file behind the back of lockdev-redirect
+static int raw_create(const char* name) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s", target_dir, name);
+  int fd = syscall(SYS_openat, AT_FDCWD, path, O_CREAT | O_WRONLY, 0644);
+  if (fd == -1)
+    return -1;
+  return syscall(SYS_close, fd);
+}
+
+static int raw_rename(const char* from, const char* to) {
+  char from_path[PATH_MAX];
+  char to_path[PATH_MAX];
+  snprintf(from_path, PATH_MAX, "%s/%s", target_dir, from);
+  snprintf(to_path, PATH_MAX, "%s/%s", target_dir, to);
+  return syscall(SYS_renameat, AT_FDCWD, from_path, AT_FDCWD, to_path);
+}
+
+static int stat_errno(const char* path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? 0 : errno;
+}
+
+
+int main (int argc, char *argv[]) {
+  bool strict = argc > 1 && strcmp(argv[1], "strict") == 0;
+  snprintf(target_dir, PATH_MAX, "%s/lock", getenv("XDG_RUNTIME_DIR"));
+
+  char name[64], lockfile[PATH_MAX], subdir_lockfile[PATH_MAX], own_lockfile[PATH_MAX];
+  snprintf(name, sizeof(name), "LCK..lookup%d", getpid());
+  snprintf(lockfile, PATH_MAX, "%s/%s", LOCKDIR, name);
+  snprintf(subdir_lockfile, PATH_MAX, "%s/lockdev/%s", LOCKDIR, name);
+  snprintf(own_lockfile, PATH_MAX, "%s/%s.own", LOCKDIR, name);
+
+  // Builds the view of the lock directory
+  CHECK(stat_errno(lockfile) == ENOENT);
+
+  // Without search permission only the cache can tell that the file is missing
+  CHECK(chmod(target_dir, 0) == 0);
+  int error = stat_errno(lockfile);
+  CHECK(chmod(target_dir, 0700) == 0);
+  CHECK(error == (strict ? EACCES : ENOENT));
+
+  // Created by someone else
+  CHECK(raw_create(name) == 0);
+  CHECK(stat_errno(lockfile) == 0);
+  CHECK(access(lockfile, F_OK) == 0);
+
+  // Moved into the subdirectory
+  CHECK(stat_errno(subdir_lockfile) == ENOENT);
+  char subdir_name[PATH_MAX];
+  snprintf(subdir_name, PATH_MAX, "lockdev/%s", name);
+  CHECK(raw_rename(name, subdir_name) == 0);
+  CHECK(stat_errno(lockfile) == ENOENT);
+  CHECK(stat_errno(subdir_lockfile) == 0);
+  CHECK(unlink(subdir_lockfile) == 0);
+  CHECK(stat_errno(subdir_lockfile) == ENOENT);
+
+  // Our own changes
+  CHECK(open(own_lockfile, O_RDONLY) == -1 && errno == ENOENT);
+  CHECK(fopen(own_lockfile, "r") == NULL && errno == ENOENT);
+  int fd = open(own_lockfile, O_CREAT | O_WRONLY, 0644);
+  CHECK(fd != -1);
+  close(fd);
+  fd = open(own_lockfile, O_RDONLY);
+  CHECK(fd != -1);
+  close(fd);
+  CHECK(unlink(own_lockfile) == 0);
+  CHECK(stat_errno(own_lockfile) == ENOENT);
+
+  // A child has its own view. Its changes have to show up in ours.
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (stat_errno(lockfile) != ENOENT || raw_create(name) != 0 || stat_errno(lockfile) != 0)
+      _exit(1);
+    _exit(0);
+  }
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(stat_errno(lockfile) == 0);
+  CHECK(unlink(lockfile) == 0);
+  return 0;
+}
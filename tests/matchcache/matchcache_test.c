@@ -0,0 +1,96 @@
+// Checks that the per-thread match cache never mixes up paths. Every lock
+// name is used below two lock paths of the same length with different
+// targets, so both land in the same cache slot. A timer signal checks the
+// same paths from a signal handler while the main loop runs.
+//
+// Needs LOCKDEV_REDIRECT_PATHS="/var/lock:/var/lokk=matchcache"
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#define LOCKDIR "/var/lock"
+#define OTHERDIR "/var/lokk"
+#define NAMES 32
+#define ROUNDS 2000
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); return 1; }
+
+static char lock_paths[NAMES][PATH_MAX];
+static char other_paths[NAMES][PATH_MAX];
+static volatile sig_atomic_t handler_failed = 0;
+static volatile sig_atomic_t handler_calls = 0;
+
+// Lock files exist below LOCKDIR for even names, below OTHERDIR for odd
+// names
+static bool check_name(int i) {
+  struct stat st;
+  bool lock_exists = stat(lock_paths[i], &st) == 0;
+  bool other_exists = stat(other_paths[i], &st) == 0;
+  return lock_exists == (i % 2 == 0) && other_exists == (i % 2 == 1);
+}
+
+static void handler(int sig) {
+  int saved_errno = errno;
+  for (int i = 0; i < NAMES; i++) {
+    if (!check_name(i))
+      handler_failed = 1;
+  }
+  handler_calls++;
+  errno = saved_errno;
+}
+
+static void cleanup(void) {
+  for (int i = 0; i < NAMES; i++) {
+    unlink(lock_paths[i]);
+    unlink(other_paths[i]);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 0; i < NAMES; i++) {
+    snprintf(lock_paths[i], PATH_MAX, "%s/LCK..mc%d.%02d", LOCKDIR, getpid(), i);
+    snprintf(other_paths[i], PATH_MAX, "%s/LCK..mc%d.%02d", OTHERDIR, getpid(), i);
+    int fd = open(i % 2 == 0 ? lock_paths[i] : other_paths[i], O_CREAT | O_WRONLY, 0644);
+    if (fd == -1) {
+      cleanup();
+      return 1;
+    }
+    close(fd);
+  }
+
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handler;
+  action.sa_flags = SA_RESTART;
+  sigaction(SIGALRM, &action, NULL);
+  struct itimerval timer = { { 0, 200 }, { 0, 200 } };
+  setitimer(ITIMER_REAL, &timer, NULL);
+
+  bool failed = false;
+  for (int round = 0; round < ROUNDS && !failed; round++) {
+    for (int i = 0; i < NAMES; i++) {
+      if (!check_name(i)) {
+        fprintf(stderr, "Wrong result for %s in round %d\n", lock_paths[i], round);
+        failed = true;
+        break;
+      }
+    }
+  }
+
+  struct itimerval stop = { { 0, 0 }, { 0, 0 } };
+  setitimer(ITIMER_REAL, &stop, NULL);
+  cleanup();
+  CHECK(!failed);
+  CHECK(!handler_failed);
+  CHECK(handler_calls > 0);
+  return 0;
+}
@@ -0,0 +1,56 @@
+// Checks the namespace mode of the launcher. Started without
+// lockdev-redirect.so, so it works either through the bind mount or through
+// the fallback to the preload library.
+//
+// Usage: testrun [preload]
+//   With "preload" the fallback has to be used
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#define LOCKDIR "/var/lock"
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); return 1; }
+
+// stat behind the back of lockdev-redirect
+static int raw_stat(const char* path, struct stat* buf) {
+  return syscall(SYS_newfstatat, AT_FDCWD, path, buf, 0);
+}
+
+int main(int argc, char *argv[]) {
+  bool want_preload = argc > 1 && strcmp(argv[1], "preload") == 0;
+  const char* preload = getenv("LD_PRELOAD");
+  bool preloaded = preload && strstr(preload, "lockdev-redirect.so");
+  CHECK(!want_preload || preloaded);
+
+  // Without the library the lock directory has to be the bind mount
+  struct stat lock_dir;
+  struct stat target_dir;
+  char target[PATH_MAX];
+  snprintf(target, PATH_MAX, "%s/lock", getenv("XDG_RUNTIME_DIR"));
+  CHECK(raw_stat(target, &target_dir) == 0);
+  if (!preloaded) {
+    CHECK(raw_stat(LOCKDIR, &lock_dir) == 0);
+    CHECK(lock_dir.st_dev == target_dir.st_dev && lock_dir.st_ino == target_dir.st_ino);
+  }
+
+  char path[PATH_MAX];
+  char target_path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/LCK..namespace%d", LOCKDIR, getpid());
+  snprintf(target_path, PATH_MAX, "%s/LCK..namespace%d", target, getpid());
+  int fd = open(path, O_CREAT | O_WRONLY, 0644);
+  CHECK(fd != -1);
+  close(fd);
+  struct stat st;
+  CHECK(raw_stat(target_path, &st) == 0);
+  CHECK(unlink(path) == 0);
+  return 0;
+}
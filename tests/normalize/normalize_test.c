@@ -0,0 +1,76 @@
+// Checks that aliased spellings of lock paths ("//", "/./", "/../") are
+// redirected like the plain path, and that ".." leaving the lock directory
+// is not redirected.
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#define LOCKDIR "/var/lock"
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); failed = 1; }
+
+int main(int argc, char *argv[]) {
+  int failed = 0;
+  char name[64];
+  snprintf(name, sizeof(name), "LCK..normalize%d", getpid());
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s", LOCKDIR, name);
+
+  // Create the lock file through an alias
+  char alias[PATH_MAX];
+  snprintf(alias, PATH_MAX, "//var/./lock/%s", name);
+  int fd = open(alias, O_CREAT | O_WRONLY, 0644);
+  if (fd == -1) {
+    fprintf(stderr, "Failed to create %s\n", alias);
+    return 1;
+  }
+  close(fd);
+
+  const char* aliases[] = {
+    "%s/%s", "//var/lock/%s", "/var//lock/%s", "/./var/lock/%s",
+    "/var/./lock/%s", "/var/lock/../lock/%s", "/var/lock//./%s",
+    "/var/lock/lockdev/../%s", "/../var/lock/%s"
+  };
+  struct stat st;
+  for (unsigned int i = 0; i < sizeof(aliases) / sizeof(aliases[0]); i++) {
+    if (i == 0)
+      snprintf(alias, PATH_MAX, aliases[i], LOCKDIR, name);
+    else
+      snprintf(alias, PATH_MAX, aliases[i], name);
+    if (stat(alias, &st) != 0) {
+      fprintf(stderr, "stat failed for %s\n", alias);
+      failed = 1;
+    }
+  }
+
+  // The lock directory itself
+  CHECK(stat("/var/./lock/", &st) == 0 && S_ISDIR(st.st_mode));
+
+  // Relative to a parent of the lock directory
+  int dirfd = open("/var", O_RDONLY | O_DIRECTORY);
+  CHECK(dirfd != -1);
+  const char* relative[] = { "./lock/%s", "lock/../lock/%s", ".//lock/./%s" };
+  for (unsigned int i = 0; i < sizeof(relative) / sizeof(relative[0]); i++) {
+    snprintf(alias, PATH_MAX, relative[i], name);
+    fd = openat(dirfd, alias, O_RDONLY);
+    if (fd == -1) {
+      fprintf(stderr, "openat failed for %s\n", alias);
+      failed = 1;
+    }
+    else
+      close(fd);
+  }
+  close(dirfd);
+
+  // Leaving the lock directory is not redirected
+  CHECK(stat("/var/lock/../../etc/passwd", &st) == 0);
+  CHECK(stat("/var/./lock/../../etc/passwd", &st) == 0);
+
+  CHECK(unlink(path) == 0);
+  return failed;
+}
@@ -0,0 +1,139 @@
+// Checks the seccomp mode of the launcher. Uses raw syscalls only, so
+// lockdev-redirect.so couldn't redirect anything even if it was loaded.
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#define LOCKDIR "/var/lock"
+
+#define CHECK(cond) if (!(cond)) { fprintf(stderr, "Line %d: Check failed: %s\n", __LINE__, #cond); return 1; }
+
+static int raw_openat(int dirfd, const char* path, int flags, int mode) {
+  return syscall(SYS_openat, dirfd, path, flags, mode);
+}
+
+static int raw_stat(const char* path, struct stat* buf) {
+  return syscall(SYS_newfstatat, AT_FDCWD, path, buf, 0);
+}
+
+// Checks that "path" below the lock root exists
+static int in_root(const char* root, const char* name, struct stat* buf) {
+  char path[PATH_MAX];
+  snprintf(path, PATH_MAX, "%s/%s", root, name);
+  return raw_stat(path, buf);
+}
+
+int main(int argc, char *argv[]) {
+  char root[PATH_MAX];
+  snprintf(root, PATH_MAX, "%s/lock", getenv("XDG_RUNTIME_DIR"));
+
+  char name[64], name2[64], dir[64];
+  char path[PATH_MAX], path2[PATH_MAX], dir_path[PATH_MAX];
+  snprintf(name, sizeof(name), "LCK..seccomp%d", getpid());
+  snprintf(name2, sizeof(name2), "LCK..seccomp%d.2", getpid());
+  snprintf(dir, sizeof(dir), "seccomp%d", getpid());
+  snprintf(path, PATH_MAX, "%s/%s", LOCKDIR, name);
+  snprintf(path2, PATH_MAX, "%s/%s", LOCKDIR, name2);
+  snprintf(dir_path, PATH_MAX, "%s/%s", LOCKDIR, dir);
+
+  // Created with the umask of the caller, descriptor flags are kept
+  umask(027);
+  int fd = raw_openat(AT_FDCWD, path, O_CREAT | O_EXCL | O_WRONLY | O_CLOEXEC, 0666);
+  CHECK(fd != -1);
+  CHECK(fcntl(fd, F_GETFD) == FD_CLOEXEC);
+  CHECK(write(fd, "1234\n", 5) == 5);
+  close(fd);
+  struct stat target;
+  struct stat st;
+  CHECK(in_root(root, name, &target) == 0);
+  CHECK((target.st_mode & 0777) == 0640);
+  CHECK(target.st_size == 5);
+
+  // Lookups see the redirected file
+  CHECK(raw_stat(path, &st) == 0 && st.st_ino == target.st_ino);
+  struct statx stx;
+  CHECK(syscall(SYS_statx, AT_FDCWD, path, 0, STATX_INO, &stx) == 0 && stx.stx_ino == target.st_ino);
+  CHECK(syscall(SYS_faccessat, AT_FDCWD, path, R_OK) == 0);
+  CHECK(raw_openat(AT_FDCWD, path, O_EXCL | O_CREAT | O_WRONLY, 0644) == -1);
+
+  // Relative to the working directory and to a descriptor
+  CHECK(syscall(SYS_chdir, "/var") == 0);
+  snprintf(path2, PATH_MAX, "lock/%s", name);
+  fd = raw_openat(AT_FDCWD, path2, O_RDONLY, 0);
+  CHECK(fd != -1);
+  close(fd);
+  int dirfd = raw_openat(AT_FDCWD, "/var", O_RDONLY | O_DIRECTORY, 0);
+  CHECK(dirfd != -1);
+  fd = raw_openat(dirfd, path2, O_RDONLY, 0);
+  CHECK(fd != -1);
+  close(fd);
+  close(dirfd);
+  snprintf(path2, PATH_MAX, "%s/%s", LOCKDIR, name2);
+
+  // Two path calls, directories and modes
+  CHECK(syscall(SYS_linkat, AT_FDCWD, path, AT_FDCWD, path2, 0) == 0);
+  CHECK(in_root(root, name2, &st) == 0 && st.st_ino == target.st_ino);
+  CHECK(syscall(SYS_unlinkat, AT_FDCWD, path2, 0) == 0);
+  CHECK(syscall(SYS_renameat, AT_FDCWD, path, AT_FDCWD, path2, 0) == 0);
+  CHECK(in_root(root, name2, &st) == 0 && in_root(root, name, &st) == -1);
+
+  // Flags of renameat2, linkat and faccessat2 are kept
+  CHECK(syscall(SYS_renameat2, AT_FDCWD, path2, AT_FDCWD, path, RENAME_NOREPLACE) == 0);
+  CHECK(in_root(root, name, &st) == 0 && in_root(root, name2, &st) == -1);
+  CHECK(syscall(SYS_linkat, AT_FDCWD, path, AT_FDCWD, path2, 0) == 0);
+  CHECK(syscall(SYS_renameat2, AT_FDCWD, path, AT_FDCWD, path2, RENAME_NOREPLACE) == -1 && errno == EEXIST);
+  CHECK(syscall(SYS_unlinkat, AT_FDCWD, path, 0) == 0);
+  char link_name[64], link_path[PATH_MAX], link_in_root[PATH_MAX];
+  snprintf(link_name, sizeof(link_name), "LCK..seccomp%d.link", getpid());
+  snprintf(link_path, PATH_MAX, "%s/%s", LOCKDIR, link_name);
+  snprintf(link_in_root, PATH_MAX, "%s/%s", root, link_name);
+  CHECK(symlink(name, link_in_root) == 0);
+  CHECK(syscall(SYS_faccessat2, AT_FDCWD, link_path, F_OK, AT_SYMLINK_NOFOLLOW) == 0);
+  CHECK(syscall(SYS_faccessat, AT_FDCWD, link_path, F_OK) == -1 && errno == ENOENT);
+  CHECK(syscall(SYS_renameat, AT_FDCWD, path2, AT_FDCWD, path) == 0);
+  CHECK(syscall(SYS_linkat, AT_FDCWD, link_path, AT_FDCWD, path2, AT_SYMLINK_FOLLOW) == 0);
+  CHECK(in_root(root, name2, &st) == 0 && S_ISREG(st.st_mode) && st.st_ino == target.st_ino);
+  CHECK(syscall(SYS_unlinkat, AT_FDCWD, link_path, 0) == 0);
+  CHECK(syscall(SYS_unlinkat, AT_FDCWD, path, 0) == 0);
+
+  CHECK(syscall(SYS_fchmodat, AT_FDCWD, path2, 0600) == 0);
+  CHECK(in_root(root, name2, &st) == 0 && (st.st_mode & 0777) == 0600);
+  CHECK(syscall(SYS_mkdirat, AT_FDCWD, dir_path, 0777) == 0);
+  CHECK(in_root(root, dir, &st) == 0 && S_ISDIR(st.st_mode) && (st.st_mode & 0777) == 0750);
+  CHECK(syscall(SYS_unlinkat, AT_FDCWD, dir_path, AT_REMOVEDIR) == 0);
+  CHECK(in_root(root, dir, &st) == -1);
+
+  // Children inherit the filter
+  pid_t pid = fork();
+  CHECK(pid != -1);
+  if (pid == 0)
+    _exit(syscall(SYS_unlinkat, AT_FDCWD, path2, 0) == 0 ? 0 : 1);
+  int status;
+  CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  CHECK(in_root(root, name2, &st) == -1);
+  CHECK(raw_stat(path2, &st) == -1);
+
+  // No free descriptor left: The open fails instead of hanging
+  pid = fork();
+  CHECK(pid != -1);
+  if (pid == 0) {
+    alarm(5);
+    struct rlimit limit = { 3, 3 };
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+      _exit(1);
+    _exit(raw_openat(AT_FDCWD, path, O_CREAT | O_WRONLY, 0644) == -1 && errno == EMFILE ? 0 : 1);
+  }
+  CHECK(waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  syscall(SYS_unlinkat, AT_FDCWD, path, 0);
+  return 0;
+}
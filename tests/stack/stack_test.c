@@ -0,0 +1,183 @@
+// Checks the stack usage of intercepted calls on lock paths. Every call runs
+// in a thread with a painted stack. After the thread finished, the unpainted
+// part of the stack is what the call used (including glibc and the thread
+// startup, which is measured separately and subtracted).
+
+#define _GNU_SOURCE
+#include <linux/limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#define LOCKDIR "/var/lock"
+
+// Upper bound for a single intercepted call, see utilities.h
+#define STACK_LIMIT (8 * 1024)
+
+#define STACK_SIZE (256 * 1024)
+#define STACK_PAINT 0xA5
+
+static char stack[STACK_SIZE] __attribute__ ((aligned (4096)));
+static char lockfilepath[PATH_MAX];
+static char linkpath[PATH_MAX];
+static char renamepath[PATH_MAX];
+static int failed = 0;
+
+
+static void op_none(void) {
+}
+
+static void op_open(void) {
+  int fd = open(lockfilepath, O_CREAT | O_WRONLY, 0644);
+  if (fd == -1)
+    failed = 1;
+  else
+    close(fd);
+}
+
+static void op_fopen(void) {
+  FILE* fp = fopen(lockfilepath, "w");
+  if (!fp)
+    failed = 1;
+  else
+    fclose(fp);
+}
+
+static void op_creat(void) {
+  int fd = creat(lockfilepath, 0644);
+  if (fd == -1)
+    failed = 1;
+  else
+    close(fd);
+}
+
+static void op_link(void) {
+  if (link(lockfilepath, linkpath))
+    failed = 1;
+}
+
+static void op_rename(void) {
+  if (rename(linkpath, renamepath))
+    failed = 1;
+}
+
+static void op_chmod(void) {
+  if (chmod(lockfilepath, S_IRUSR | S_IWUSR))
+    failed = 1;
+}
+
+static void op_scandir(void) {
+  struct dirent **namelist;
+  int n = scandir(LOCKDIR, &namelist, NULL, alphasort);
+  if (n == -1) {
+    failed = 1;
+    return;
+  }
+  while (n--)
+    free(namelist[n]);
+  free(namelist);
+}
+
+static void op_mktemp(void) {
+  static char template[PATH_MAX];
+  snprintf(template, PATH_MAX, "%s/stacktest-XXXXXX", LOCKDIR);
+  if (!mktemp(template)[0])
+    failed = 1;
+}
+
+static void op_unlink(void) {
+  if (unlink(lockfilepath))
+    failed = 1;
+}
+
+static void op_remove(void) {
+  if (remove(renamepath))
+    failed = 1;
+}
+
+
+static void* thread_main(void* arg) {
+  ((void (*)(void))arg)();
+  return NULL;
+}
+
+// Runs the given function in a thread on a painted stack
+// Return value: Number of stack bytes used
+static size_t measure(void (*func)(void)) {
+  memset(stack, STACK_PAINT, STACK_SIZE);
+
+  pthread_attr_t attr;
+  pthread_t thread;
+  pthread_attr_init(&attr);
+  pthread_attr_setstack(&attr, stack, STACK_SIZE);
+  if (pthread_create(&thread, &attr, thread_main, func)) {
+    fprintf(stderr, "pthread_create failed\n");
+    exit(1);
+  }
+  pthread_join(thread, NULL);
+  pthread_attr_destroy(&attr);
+
+  // The stack grows down, so find the lowest touched byte
+  size_t untouched = 0;
+  while (untouched < STACK_SIZE && (unsigned char)stack[untouched] == STACK_PAINT)
+    untouched++;
+  return STACK_SIZE - untouched;
+}
+
+
+int main (int argc, char *argv[]) {
+  int n = snprintf(lockfilepath, PATH_MAX, "%s/lockdev-redirect-stack-%d.tmp", LOCKDIR, getpid());
+  if (n < 0 || n >= PATH_MAX)
+    return 1;
+  n = snprintf(linkpath, PATH_MAX, "%s/lockdev-redirect-stack-%d.lnk", LOCKDIR, getpid());
+  if (n < 0 || n >= PATH_MAX)
+    return 1;
+  n = snprintf(renamepath, PATH_MAX, "%s/lockdev-redirect-stack-%d.new", LOCKDIR, getpid());
+  if (n < 0 || n >= PATH_MAX)
+    return 1;
+
+  struct {
+    const char* name;
+    void (*func)(void);
+  } ops[] = {
+    { "open", op_open },
+    { "fopen", op_fopen },
+    { "creat", op_creat },
+    { "link", op_link },
+    { "rename", op_rename },
+    { "chmod", op_chmod },
+    { "scandir", op_scandir },
+    { "mktemp", op_mktemp },
+    { "unlink", op_unlink },
+    { "remove", op_remove },
+  };
+
+  // The first call per function may have to set up our lock root or resolve
+  // lazily bound symbols. Run everything once upfront, so we only measure
+  // the common case.
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+    measure(ops[i].func);
+  if (failed) {
+    printf("Testing stack usage: FAIL (calls failed)\n");
+    return 1;
+  }
+
+  size_t baseline = measure(op_none);
+  for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+    printf("Testing stack usage of %s: ", ops[i].name);
+    size_t used = measure(ops[i].func) - baseline;
+    if (failed || used > STACK_LIMIT) {
+      printf("FAIL (%zu bytes)\n", used);
+      return 1;
+    }
+    else
+      printf("PASS (%zu bytes)\n", used);
+  }
+
+  return 0;
+}
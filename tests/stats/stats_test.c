@@ -0,0 +1,49 @@
+// Produces some calls on lock paths. The Makefile checks that they show up
+// in the statistics report written at exit. With the argument "live" the
+// live segment is published and dumped with the viewer given as second
+// argument before exiting.
+
+#include <linux/limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define LOCKDIR "/var/lock"
+
+
+int main (int argc, char *argv[]) {
+  char lockfilepath[PATH_MAX];
+  int n = snprintf(lockfilepath, PATH_MAX, "%s/lockdev-redirect-stats-%d.tmp", LOCKDIR, getpid());
+  if (n < 0 || n >= PATH_MAX)
+    return 1;
+
+  int fd = open(lockfilepath, O_CREAT | O_WRONLY, 0644);
+  if (fd == -1)
+    return 1;
+  close(fd);
+  if (unlink(lockfilepath))
+    return 1;
+
+  // Fails with ENOENT (2)
+  if (unlink(lockfilepath) == 0 || errno != ENOENT)
+    return 1;
+
+  if (argc > 2 && strcmp(argv[1], "live") == 0) {
+    // The first call after one second publishes all of the above
+    struct timespec ts = { 1, 100000000 };
+    nanosleep(&ts, NULL);
+    if (access(LOCKDIR, F_OK))
+      return 1;
+
+    char command[PATH_MAX + 32];
+    snprintf(command, sizeof(command), "%s --stats > live.txt", argv[2]);
+    unsetenv("LD_PRELOAD");
+    if (system(command))
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,33 @@
+// Produces some calls on lock paths. The Makefile checks that they show up
+// in the decoded trace.
+
+#include <linux/limits.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#define LOCKDIR "/var/lock"
+
+
+int main (int argc, char *argv[]) {
+  char lockfilepath[PATH_MAX];
+  char newpath[PATH_MAX];
+  snprintf(lockfilepath, PATH_MAX, "%s/LCK..trace%d", LOCKDIR, getpid());
+  snprintf(newpath, PATH_MAX, "%s/LCK..trace%d.new", LOCKDIR, getpid());
+
+  int fd = open(lockfilepath, O_CREAT | O_WRONLY, 0644);
+  if (fd == -1)
+    return 1;
+  close(fd);
+  if (rename(lockfilepath, newpath))
+    return 1;
+  if (unlink(newpath))
+    return 1;
+
+  // Fails with ENOENT (2)
+  if (unlink(newpath) == 0 || errno != ENOENT)
+    return 1;
+  printf("%d\n", getpid());
+  return 0;
+}
@@ -0,0 +1,235 @@
+/*
+    lockdev-redirect  Helper to redirect /var/lock to a user writable path
+    Copyright (C) 2020  Manuel Reimer <manuel.reimer@gmx.de>
+
+    This program is free software: you can redistribute it and/or modify
+    it under the terms of the GNU Lesser General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public License
+    along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/limits.h>
+#include "stats.h"
+#include "trace_ring.h"
+#include "symbols.h"
+
+_Static_assert(LOCK_STATS_FUNCTIONS <= 64, "Too many functions for the trace ring header");
+_Static_assert(sizeof(struct lock_trace_record) == 128, "Trace records should be two cache lines");
+
+#define RING_SIZE (sizeof(struct lock_trace_ring) + LOCK_TRACE_RECORDS * sizeof(struct lock_trace_record))
+
+// Mapped ring of the calling thread. Rings of exited threads stay in their
+// files until the decoder reads them.
+static __thread struct lock_trace_ring* current_ring __attribute__ ((tls_model ("initial-exec")));
+static __thread bool ring_disabled __attribute__ ((tls_model ("initial-exec")));
+static pthread_key_t ring_key;
+static char trace_dir[PATH_MAX];
+
+
+static uint64_t _now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+#define TRACE_CLOCK LOCK_TRACE_CLOCK_TSC
+#else
+#define TRACE_CLOCK LOCK_TRACE_CLOCK_NS
+#endif
+
+// Timestamp for trace records, see trace_ring.h
+__attribute__ ((visibility ("hidden"))) uint64_t _trace_clock(void) {
+#if TRACE_CLOCK == LOCK_TRACE_CLOCK_TSC
+  return __builtin_ia32_rdtsc();
+#else
+  return _now();
+#endif
+}
+
+// Stores a pair of timestamp and CLOCK_MONOTONIC for the decoder
+static void _calibrate(struct lock_trace_ring* ring, unsigned int index) {
+  ring->clock_ticks[index] = _trace_clock();
+  ring->clock_ns[index] = _now();
+}
+
+// Creates and maps the ring file of the calling thread
+// Return value: Ring. NULL on error.
+static struct lock_trace_ring* _create_ring(void) {
+  char path[PATH_MAX];
+  int tid = syscall(SYS_gettid);
+  int n = snprintf(path, PATH_MAX, "%s/%d.%d.trace", trace_dir, getpid(), tid);
+  if (n < 0 || n >= PATH_MAX)
+    return NULL;
+
+  int fd = ORIG(open)(path, O_RDWR | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd == -1)
+    return NULL;
+  struct lock_trace_ring* ring = NULL;
+  if (ftruncate(fd, RING_SIZE) == 0) {
+    ring = mmap(NULL, RING_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+      ring = NULL;
+  }
+  ORIG(close)(fd);
+  if (!ring) {
+    ORIG(remove)(path);
+    return NULL;
+  }
+
+  ring->version = LOCK_TRACE_VERSION;
+  ring->record_size = sizeof(struct lock_trace_record);
+  ring->capacity = LOCK_TRACE_RECORDS;
+  ring->pid = getpid();
+  ring->tid = tid;
+  ring->function_count = LOCK_STATS_FUNCTIONS;
+  ring->clock = TRACE_CLOCK;
+  _calibrate(ring, 0);
+  strncpy(ring->command, program_invocation_short_name, sizeof(ring->command) - 1);
+  for (unsigned int id = 0; id < LOCK_STATS_FUNCTIONS; id++)
+    strncpy(ring->function_names[id], _stats_function_names[id], sizeof(ring->function_names[id]) - 1);
+  __atomic_store_n(&ring->magic, LOCK_TRACE_MAGIC, __ATOMIC_RELEASE);
+  return ring;
+}
+
+// Returns the ring of the calling thread. Creates it on first use.
+// Return value: Ring. NULL on error.
+static struct lock_trace_ring* _get_ring(void) {
+  struct lock_trace_ring* ring = current_ring;
+  if (__builtin_expect(ring != NULL, 1) || ring_disabled)
+    return ring;
+
+  int saved_errno = errno;
+  ring = _create_ring();
+  if (!ring) {
+    fprintf(stderr, "lockdev-redirect: Failed to create trace ring in %s\n", trace_dir);
+    ring_disabled = true;
+  }
+  else {
+    current_ring = ring;
+    pthread_setspecific(ring_key, ring);
+  }
+  errno = saved_errno;
+  return ring;
+}
+
+// Thread exit. Calls from later destructors of this thread are not traced,
+// a new ring would overwrite the file.
+static void _release_ring(void* ring) {
+  current_ring = NULL;
+  ring_disabled = true;
+  munmap(ring, RING_SIZE);
+}
+
+// The child must not write into the ring of its parent
+static void _reset_after_fork(void) {
+  if (current_ring)
+    munmap(current_ring, RING_SIZE);
+  current_ring = NULL;
+  ring_disabled = false;
+}
+
+// Copies the end of "path" to "dest" and hashes the whole path
+// Return value: true if the path had to be truncated
+static bool _copy_path(char* dest, const char* path, uint32_t* hash) {
+  uint32_t h = 2166136261u;
+  const char* p = path;
+  for (; *p; p++)
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  *hash = h;
+
+  size_t len = p - path;
+  bool truncated = len >= LOCK_TRACE_PATH;
+  if (truncated) {
+    path = p - (LOCK_TRACE_PATH - 1);
+    len = LOCK_TRACE_PATH - 1;
+  }
+  memcpy(dest, path, len);
+  dest[len] = '\0';
+  return truncated;
+}
+
+// Called by _stats_end while tracing
+// The slot is claimed before it is written. If a signal handler makes a
+// traced call meanwhile, then it gets the next slot. "sequence" is set last
+// so the decoder can skip records which were never completed.
+__attribute__ ((visibility ("hidden"))) void _trace_record(const struct lock_stats_call* call, int64_t result, bool failed, int error) {
+  struct lock_trace_ring* ring = _get_ring();
+  if (!ring)
+    return;
+
+  uint64_t index = ring->head;
+  __atomic_store_n(&ring->head, index + 1, __ATOMIC_RELAXED);
+  __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  struct lock_trace_record* record = &ring->records[index & (LOCK_TRACE_RECORDS - 1)];
+  __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+
+  uint16_t flags = 0;
+  if (call->decision == LOCK_STATS_HIT)
+    flags |= LOCK_TRACE_HIT;
+  else if (call->decision == LOCK_STATS_REWRITE_FAILED)
+    flags |= LOCK_TRACE_REWRITE_FAILED;
+  if (failed)
+    flags |= LOCK_TRACE_FAILED;
+
+  record->path_hash = 0;
+  record->path[0] = '\0';
+  record->path2[0] = '\0';
+  uint32_t hash2;
+  if (call->path && _copy_path(record->path, call->path, &record->path_hash))
+    flags |= LOCK_TRACE_PATH_TRUNCATED;
+  if (call->path2 && _copy_path(record->path2, call->path2, &hash2))
+    flags |= LOCK_TRACE_PATH2_TRUNCATED;
+
+  uint64_t end = _trace_clock();
+  record->start = call->trace_start;
+  record->duration = end - call->trace_start > UINT32_MAX ? UINT32_MAX : end - call->trace_start;
+  record->error = error;
+  record->result = result;
+  record->function = call->id;
+  record->flags = flags;
+  __atomic_store_n(&record->sequence, index + 1, __ATOMIC_RELEASE);
+
+  // Keeps the conversion of long running traces accurate
+  if ((index & (LOCK_TRACE_RECORDS - 1)) == LOCK_TRACE_RECORDS - 1)
+    _calibrate(ring, 1);
+}
+
+__attribute__ ((constructor (104))) static void _init_trace(void) {
+  const char* dir = getenv("LOCKDEV_REDIRECT_TRACE");
+  if (!dir || !dir[0])
+    return;
+  if (strlen(dir) >= PATH_MAX - 32) {
+    fprintf(stderr, "lockdev-redirect: LOCKDEV_REDIRECT_TRACE too long, tracing disabled\n");
+    return;
+  }
+
+  strcpy(trace_dir, dir);
+  ORIG(mkdir)(trace_dir, 0700);
+  if (pthread_key_create(&ring_key, _release_ring) || pthread_atfork(NULL, NULL, _reset_after_fork)) {
+    fprintf(stderr, "lockdev-redirect: Failed to set up tracing\n");
+    return;
+  }
+  __atomic_or_fetch(&_stats_enabled, LOCK_STATS_TRACING, __ATOMIC_RELAXED);
+}
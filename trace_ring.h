@@ -0,0 +1,60 @@
+#include <stdint.h>
+
+// Binary call trace
+// With LOCKDEV_REDIRECT_TRACE=<directory> every thread maps its own ring
+// file "<pid>.<tid>.trace" in this directory and appends one fixed-size
+// record per intercepted call. Only the owning thread writes to a ring, so
+// no locks or atomic read-modify-write operations are needed. Old records
+// get overwritten when the ring is full. lockdev-redirect-trace merges the
+// rings to a timeline. The layout must only change together with
+// LOCK_TRACE_VERSION.
+//
+// Reading CLOCK_MONOTONIC costs more than the rest of a record, so on x86
+// records are stamped with the time stamp counter. The ring header holds
+// pairs of counter and CLOCK_MONOTONIC values to convert them.
+
+#define LOCK_TRACE_MAGIC 0x54524c44  // "DLRT"
+#define LOCK_TRACE_VERSION 1
+#define LOCK_TRACE_RECORDS 8192      // Records per ring, power of two
+#define LOCK_TRACE_PATH 44           // Path bytes kept per record
+
+// Record flags
+#define LOCK_TRACE_HIT 1               // Path was redirected
+#define LOCK_TRACE_REWRITE_FAILED 2    // Path matched but could not be redirected
+#define LOCK_TRACE_PATH_TRUNCATED 4    // "path" only holds the end of the path
+#define LOCK_TRACE_PATH2_TRUNCATED 8
+#define LOCK_TRACE_FAILED 16           // The call failed
+
+// Clock sources
+#define LOCK_TRACE_CLOCK_NS 0          // Timestamps are CLOCK_MONOTONIC
+#define LOCK_TRACE_CLOCK_TSC 1         // Timestamps are time stamp counter ticks
+
+struct lock_trace_record {
+  uint64_t sequence;          // Index + 1 once the record is complete
+  uint64_t start;             // Timestamp at entry
+  uint32_t duration;          // Including the forwarded call, same unit
+  int32_t error;              // errno of failed calls. 0 on success.
+  int64_t result;             // Return value. Pointers are stored as integer.
+  uint16_t function;          // Index into the function names of the ring
+  uint16_t flags;
+  uint32_t path_hash;         // FNV-1a of the whole path, 0 if none
+  char path[LOCK_TRACE_PATH];   // Zero terminated
+  char path2[LOCK_TRACE_PATH];  // Second path of link and rename
+} __attribute__ ((aligned (64)));
+
+struct lock_trace_ring {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_size;
+  uint32_t capacity;
+  int32_t pid;
+  int32_t tid;
+  uint32_t function_count;
+  uint32_t clock;             // LOCK_TRACE_CLOCK_*
+  char command[64];
+  uint64_t head;              // Records written so far
+  uint64_t clock_ticks[2];    // Timestamps at ring creation and at the last
+  uint64_t clock_ns[2];       // wrap with the matching CLOCK_MONOTONIC
+  char function_names[64][24];
+  struct lock_trace_record records[] __attribute__ ((aligned (64)));
+};
@@ -16,6 +16,7 @@
     along with this program.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#define _GNU_SOURCE
 #include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
@@ -23,100 +24,330 @@
 #include <stdlib.h>
 #include <linux/limits.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <limits.h>
 #include "utilities.h"
+#include "symbols.h"
 
-/*
- Known device lock file paths:
- /var/lock          is used by both, java rxtx and lockdev by default
- /var/lock/lockdev  is used by java rxtx on Arch and Fedora (patched)
- /run/lock/lockdev  is used by lockdev on Arch and Fedora (patched)
-*/
+// Currently used lock roots. Published once complete and never modified
+// afterwards, so readers only need one atomic load.
+static struct lock_root* current_lock_roots[MAX_LOCK_ROOTS];
+
+// Generation counter. Bumped every time a lock root had to be re-resolved
+static unsigned int lock_root_generation = 0;
+
+// Range of file descriptors ever used for lock roots. Lets the close
+// wrappers skip all other descriptors with two compares.
+__attribute__ ((visibility ("hidden"))) int _lock_root_fd_min = INT_MAX;
+__attribute__ ((visibility ("hidden"))) int _lock_root_fd_max = -1;
+
+// Appends a string of known length to the given buffer. Replaces snprintf
+// in all path building code, so we don't run the printf engine (and its
+// stack usage) for every redirected call.
+// Parameters:
+//   destination: Destination string buffer
+//   size: Size of the destination buffer
+//   pos: Current string length in destination. Gets updated.
+//   source: String to append
+//   len: Length of the string to append
+// Return value: true on success. false if the result doesn't fit.
+static inline bool _append(char* destination, size_t size, size_t* pos, const char* source, size_t len) {
+  if (len >= size - *pos)
+    return false;
+  memcpy(destination + *pos, source, len);
+  *pos += len;
+  destination[*pos] = '\0';
+  return true;
+}
+
+// Creates both levels of our lock directory. Ignores the EEXIST error.
+// Parameters:
+//   root: The lock root to create
+// Return value: Number of directories that had to be created. -1 on error.
+static int _create_lock_root(const struct lock_root* root) {
+  int created = 0;
+
+  if (ORIG(mkdir)(root->path, 0700) == 0)
+    created++;
+  else if (errno != EEXIST) {
+    fprintf(stderr, "lockdev-redirect: Failed to create directory %s, %s\n", root->path, strerror(errno));
+    return -1;
+  }
+
+  // Create a "lockdev" directory below. Doing this relative to the lock
+  // root saves us from building its path in another PATH_MAX buffer.
+  int dirfd = ORIG(open)(root->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd < 0) {
+    fprintf(stderr, "lockdev-redirect: Failed to open directory %s, %s\n", root->path, strerror(errno));
+    return -1;
+  }
+
+  int result = mkdirat(dirfd, "lockdev", 0700);
+  int saved_errno = errno;
+  ORIG(close)(dirfd);
+  if (result == 0)
+    created++;
+  else if (saved_errno != EEXIST) {
+    fprintf(stderr, "lockdev-redirect: Failed to create directory %s/lockdev, %s\n", root->path, strerror(saved_errno));
+    return -1;
+  }
 
-// List of known device lock file paths (prefix to match for)
-char* LOCK_PATHS[] = {
-  "/var/lock",
-  "/run/lock",
-  NULL
-};
-
-// First stage of path rewrite
-// Detects if the given path is below our known lock paths.
-// Prameters:
-//   path: The path to check
-// Return value: Lock path prefix on match. NULL otherwise.
-__attribute__ ((visibility ("hidden"))) char* _find_lockpath_prefix(const char* path) {
-  size_t pathlen = strlen(path);
-  unsigned char index = 0;
-
-  while(true) {
-    char* prefix = LOCK_PATHS[index];
-    if (!prefix)
+  return created;
+}
+
+// Checks if the cached lock root still matches the current environment.
+// setenv, putenv and unsetenv all replace the pointer in "environ" that
+// holds XDG_RUNTIME_DIR, so comparing this pointer is enough to notice a
+// change without doing a getenv on every call.
+static bool _lock_root_valid(const struct lock_root* root) {
+  if (root->env_index < 0)
+    return true;
+  if (root->environ != environ)
+    return false;
+  return environ[root->env_index] == root->env_entry;
+}
+
+// Returns the lock root for the current environment. Creates it if needed.
+// Parameters:
+//   index: Index of the lock root, as found in the matched lock prefix
+// Return value: Lock root on success. NULL on error.
+__attribute__ ((visibility ("hidden"))) const struct lock_root* _get_lock_root(unsigned int index) {
+  struct lock_root* root = __atomic_load_n(&current_lock_roots[index], __ATOMIC_ACQUIRE);
+  if (__builtin_expect(root != NULL && _lock_root_valid(root), 1))
+    return root;
+
+  // Resolve a new lock root. Old ones are never freed as other threads may
+  // still use them. This only leaks if XDG_RUNTIME_DIR changes at runtime.
+  struct lock_root* new_root = malloc(sizeof(struct lock_root));
+  if (!new_root)
+    return NULL;
+
+  size_t len = 0;
+  bool success;
+  const char* target = _get_lock_target(index);
+  if (target[0] == '/') {
+    new_root->env_index = -1;
+    success = _append(new_root->path, PATH_MAX, &len, target, strlen(target));
+  }
+  else {
+    // We need XDG_RUNTIME_DIR to be set as this is where we move lock files to
+    int env_index = 0;
+    for (; environ && environ[env_index]; env_index++) {
+      if (strncmp(environ[env_index], "XDG_RUNTIME_DIR=", 16) == 0)
+        break;
+    }
+    if (!environ || !environ[env_index]) {
+      fprintf(stderr, "lockdev-redirect: XDG_RUNTIME_DIR not set!\n");
+      free(new_root);
       return NULL;
-    index++;
+    }
 
-    size_t prefixlen = strlen(prefix);
-    if (prefixlen > pathlen)
-      continue;
+    new_root->environ = environ;
+    new_root->env_index = env_index;
+    new_root->env_entry = environ[env_index];
 
-    if (memcmp(path, prefix, prefixlen) != 0)
-      continue;
+    // Append the target (default: "/lock") to XDG_RUNTIME_DIR for our files
+    const char* runtime_dir = environ[env_index] + 16;
+    success = _append(new_root->path, PATH_MAX, &len, runtime_dir, strlen(runtime_dir)) &&
+              _append(new_root->path, PATH_MAX, &len, "/", 1) &&
+              _append(new_root->path, PATH_MAX, &len, target, strlen(target));
+  }
 
-    if (path[prefixlen] != '\0' && path[prefixlen] != '/')
-      continue;
+  if (!success || _create_lock_root(new_root) < 0) {
+    free(new_root);
+    return NULL;
+  }
+  new_root->len = len;
 
-    return prefix;
+  // Only count a new generation if the resolved path actually changed.
+  // Otherwise the directory descriptor can be reused.
+  if (root && strcmp(root->path, new_root->path) == 0) {
+    new_root->generation = root->generation;
+    new_root->fd = __atomic_load_n(&root->fd, __ATOMIC_ACQUIRE);
+  }
+  else {
+    new_root->generation = __atomic_add_fetch(&lock_root_generation, 1, __ATOMIC_RELAXED);
+    new_root->fd = -1;
   }
 
-  return NULL;
+  // Publish. If another thread was faster, then use its result.
+  if (!__atomic_compare_exchange_n(&current_lock_roots[index], &root, new_root, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    free(new_root);
+    return root;
+  }
+  return new_root;
 }
 
+// Widens the range of descriptors checked by the close wrappers. Has to be
+// called for every descriptor we keep open, before it is published.
+// Parameters:
+//   fd: The descriptor to protect
+__attribute__ ((visibility ("hidden"))) void _track_internal_fd(int fd) {
+  int value = __atomic_load_n(&_lock_root_fd_min, __ATOMIC_RELAXED);
+  while (fd < value && !__atomic_compare_exchange_n(&_lock_root_fd_min, &value, fd, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  value = __atomic_load_n(&_lock_root_fd_max, __ATOMIC_RELAXED);
+  while (fd > value && !__atomic_compare_exchange_n(&_lock_root_fd_max, &value, fd, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
 
-// Second stage of path rewrite
-// This function attempts to actually rewrite the given path. It also creates
-// missing path levels.
+// Returns the directory descriptor for the given lock root. The directory
+// is opened with O_PATH once and then kept open, so redirected calls don't
+// have to walk the whole lock root path again.
 // Parameters:
-//   destination: Destination string buffer. Expected to have size of PATH_MAX
-//   path: The path to rewrite
-//   prefix: The already determined lock path prefix in the given path
-// Return value: true if rewrite succeeded. false otherwise.
-__attribute__ ((visibility ("hidden"))) bool _rewrite_path(char* destination, const char* path, const char* prefix) {
-  // We need XDG_RUNTIME_DIR to be set as this is where we move lock files to
-  char* runtime_dir = getenv("XDG_RUNTIME_DIR");
-  if (!runtime_dir) {
-    fprintf(stderr, "lockdev-redirect: XDG_RUNTIME_DIR not set!\n");
-    return false;
+//   root: The lock root to get the descriptor for
+// Return value: Directory descriptor on success. -1 on error.
+__attribute__ ((visibility ("hidden"))) int _get_lock_root_fd(const struct lock_root* root) {
+  int* slot = (int*)&root->fd;
+  int fd = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+  if (__builtin_expect(fd >= 0, 1))
+    return fd;
+
+  fd = ORIG(open)(root->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  _track_internal_fd(fd);
+  int expected = -1;
+  if (!__atomic_compare_exchange_n(slot, &expected, fd, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    ORIG(close)(fd);
+    return expected;
   }
+  return fd;
+}
 
-  // Append a "/lock" directory to XDG_RUNTIME_DIR for our files to go
-  char lock_dir[PATH_MAX];
-  int n = snprintf(lock_dir, PATH_MAX, "%s/lock", runtime_dir);
-  if (n < 0 || n >= PATH_MAX)
-    return false;
+// Called by the close wrappers if the application closes (or replaces) one
+// of the descriptors in the given range. Lock root descriptors (and the ones
+// of the negative lookup cache and the lock broker) in this range get
+// forgotten and will be re-opened on next use.
+// Parameters:
+//   first: First closed descriptor
+//   last: Last closed descriptor
+__attribute__ ((visibility ("hidden"))) void _forget_lock_root_fds(int first, int last) {
+  for (unsigned int index = 0; index < MAX_LOCK_ROOTS; index++) {
+    struct lock_root* root = __atomic_load_n(&current_lock_roots[index], __ATOMIC_ACQUIRE);
+    if (!root)
+      continue;
+    int fd = __atomic_load_n(&root->fd, __ATOMIC_ACQUIRE);
+    if (fd >= first && fd <= last)
+      __atomic_compare_exchange_n(&root->fd, &fd, -1, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+  }
+  _forget_lookup_fds(first, last);
+  _forget_broker_fds(first, last);
+}
 
-  // Attempt to create this directory. Ignore the EEXIST error.
-  if (mkdir(lock_dir, 0700) && errno != EEXIST) {
-    fprintf(stderr, "lockdev-redirect: Failed to create directory %s, %s\n", lock_dir, strerror(errno));
+// Re-creates the lock root after a redirected call failed with ENOENT. This
+// happens if something (like a tmpfiles cleanup) removed our directory. Our
+// directory descriptor then points to a deleted directory, so it gets
+// re-opened as well. errno is kept if there is nothing to re-create.
+// Parameters:
+//   index: Index of the lock root to re-create
+// Return value: true if the lock root had to be re-created. false otherwise.
+__attribute__ ((visibility ("hidden"))) bool _recreate_lock_root(unsigned int index) {
+  int saved_errno = errno;
+  struct lock_root* root = (struct lock_root*)_get_lock_root(index);
+  if (!root) {
+    errno = saved_errno;
     return false;
   }
 
-  // Append a "/lockdev" directory
-  char lockdev_dir[PATH_MAX];
-  n = snprintf(lockdev_dir, PATH_MAX, "%s/lockdev", lock_dir);
-  if (n < 0 || n >= PATH_MAX)
-    return false;
+  bool recreated = _create_lock_root(root) > 0;
 
-  // Attempt to create this directory. Ignore the EEXIST error.
-  if (mkdir(lockdev_dir, 0700) && errno != EEXIST) {
-    fprintf(stderr, "lockdev-redirect: Failed to create directory %s, %s\n", lockdev_dir, strerror(errno));
-    return false;
+  // Someone else may have re-created the directory already. Other threads
+  // may use the old descriptor right now, so it is not closed but replaced
+  // atomically with dup3.
+  int fd = __atomic_load_n(&root->fd, __ATOMIC_ACQUIRE);
+  struct stat stat_buf;
+  if (fd >= 0 && (recreated || (fstat(fd, &stat_buf) == 0 && stat_buf.st_nlink == 0))) {
+    int new_fd = ORIG(open)(root->path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (new_fd >= 0) {
+      ORIG(dup3)(new_fd, fd, O_CLOEXEC);
+      ORIG(close)(new_fd);
+      recreated = true;
+    }
   }
 
-  // Finally replace the found prefix in path with our created lock directory
-  const char* suffix = path + strlen(prefix);
-  n = snprintf(destination, PATH_MAX, "%s%s", lock_dir, suffix);
-  if (n < 0 || n >= PATH_MAX)
+  errno = saved_errno;
+  return recreated;
+}
+
+// Second stage of path rewrite
+// Resolves the lock root for a matched path and splits off the part of the
+// path below the lock path prefix. Redirected calls then use the *at()
+// variant of the called function with the result.
+// Parameters:
+//   target: Receives the lock root directory descriptor and relative path
+//   match: The already determined match of the path to redirect
+// Return value: true if redirect succeeded. false otherwise and for
+//               blackhole prefixes.
+__attribute__ ((visibility ("hidden"))) bool _redirect_path(struct lock_target* target, const struct lock_match* match) {
+  if (match->prefix->blackhole)
     return false;
+  const struct lock_root* root = _get_lock_root(match->prefix->root);
+  int fd = root ? _get_lock_root_fd(root) : -1;
+  if (fd < 0) {
+    LOCKDEV_PROBE1(redirect_failed, match->prefix->path);
+    return false;
+  }
 
-  // Report success
+  const char* suffix = match->suffix;
+  while (*suffix == '/')
+    suffix++;
+
+  target->dirfd = fd;
+  target->path = *suffix ? suffix : ".";
+  target->root = match->prefix->root;
+  LOCKDEV_PROBE3(redirect, match->prefix->path, root->path, target->path);
   return true;
 }
+
+// Alternative second stage of path rewrite
+// This function rewrites the given path into an absolute path below our
+// lock root. Only needed for functions without *at() variant. This is a
+// plain copy of the cached lock root and the path suffix, so the only stack
+// needed is the caller's buffer.
+// Parameters:
+//   destination: Destination string buffer
+//   size: Size of the destination buffer
+//   match: The already determined match of the path to rewrite
+// Return value: true if rewrite succeeded. false otherwise.
+__attribute__ ((visibility ("hidden"))) bool _rewrite_path(char* destination, size_t size, const struct lock_match* match) {
+  const struct lock_root* root = _get_lock_root(match->prefix->root);
+  if (!root)
+    return false;
+
+  // Replace the found prefix in path with our lock directory
+  const char* suffix = match->suffix;
+  size_t len = 0;
+  bool success = _append(destination, size, &len, root->path, root->len) &&
+                 _append(destination, size, &len, suffix, strlen(suffix));
+  LOCKDEV_PROBE2(rewrite, destination, success);
+  return success;
+}
+
+// Identifies the file at a redirect target
+// Parameters:
+//   target: The redirect target
+//   id: Filled with the identity. "ino" is 0 if the file can't be found.
+__attribute__ ((visibility ("hidden"))) void _get_lock_file_id(const struct lock_target* target, struct lock_file_id* id) {
+  int saved_errno = errno;
+  id->ino = 0;
+#ifdef SYS_statx
+  struct statx statx_buf;
+  if (syscall(SYS_statx, target->dirfd, target->path, AT_SYMLINK_NOFOLLOW, STATX_INO | STATX_BTIME, &statx_buf) == 0) {
+    id->dev = makedev(statx_buf.stx_dev_major, statx_buf.stx_dev_minor);
+    id->ino = statx_buf.stx_ino;
+    id->birth = (statx_buf.stx_mask & STATX_BTIME) ? (uint64_t)statx_buf.stx_btime.tv_sec * 1000000000 + statx_buf.stx_btime.tv_nsec : 0;
+    errno = saved_errno;
+    return;
+  }
+#endif
+  struct stat stat_buf;
+  if (fstatat(target->dirfd, target->path, &stat_buf, AT_SYMLINK_NOFOLLOW) == 0) {
+    id->dev = stat_buf.st_dev;
+    id->ino = stat_buf.st_ino;
+    id->birth = 0;
+  }
+  errno = saved_errno;
+}
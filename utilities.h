@@ -1,3 +1,190 @@
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <linux/limits.h>
+#include <fcntl.h>
+#include "probes.h"
 
-char* _find_lockpath_prefix(const char* path);
-bool _rewrite_path(char* destination, const char* path, const char* prefix);
+// Resolved lock root (default: $XDG_RUNTIME_DIR/lock) with the environment
+// state it was resolved from. "fd" is the only field that may change after
+// publishing and has to be accessed atomically.
+struct lock_root {
+  unsigned int generation;
+  int fd;
+  char** environ;
+  int env_index;
+  char* env_entry;
+  size_t len;
+  char path[PATH_MAX];
+};
+
+// Maximum number of distinct redirect targets
+#define MAX_LOCK_ROOTS 16
+
+// Lock path prefix with its precomputed length and the index of the lock
+// root it gets redirected to. Blackhole prefixes are never redirected,
+// calls below them fail with ENOENT while the directory is missing.
+struct lock_prefix {
+  const char* path;
+  size_t len;
+  unsigned int root;
+  bool blackhole;
+};
+
+// Special states of the lock path automaton
+#define STATE_DEAD 0
+#define STATE_START 1
+
+// Longest normalized path, see _match_lockpath. Lock paths are short.
+#define LOCK_NORMALIZED_MAX 256
+
+// Result of matching a path against the lock path prefixes
+struct lock_match {
+  const struct lock_prefix* prefix;   // Matched prefix. NULL if none.
+  const char* suffix;                 // Rest of the path after the prefix
+  unsigned int state;                 // For parents of lock paths: State to continue from
+  char normalized[LOCK_NORMALIZED_MAX]; // Paths with "//", "/./" or "/../" are matched in normalized form. "suffix" may point here.
+};
+
+// Redirect target of a lock path: Lock root directory descriptor and the
+// path relative to it
+struct lock_target {
+  int dirfd;
+  const char* path;
+  unsigned int root;
+};
+
+extern int _lock_root_fd_min;
+extern int _lock_root_fd_max;
+
+// Checks if a range of closed descriptors may contain a lock root descriptor
+// or another descriptor of ours
+static inline bool _is_lock_root_fd_range(int first, int last) {
+  return last >= __atomic_load_n(&_lock_root_fd_min, __ATOMIC_RELAXED) &&
+         first <= __atomic_load_n(&_lock_root_fd_max, __ATOMIC_RELAXED);
+}
+
+const struct lock_prefix* _match_lockpath(struct lock_match* match, unsigned int state, const char* path);
+const char* _get_lock_target(unsigned int root);
+bool _is_blackholed(const struct lock_match* match, bool lookup);
+const struct lock_root* _get_lock_root(unsigned int index);
+int _get_lock_root_fd(const struct lock_root* root);
+void _track_internal_fd(int fd);
+void _forget_lock_root_fds(int first, int last);
+bool _recreate_lock_root(unsigned int index);
+bool _redirect_path(struct lock_target* target, const struct lock_match* match);
+
+// Stack usage: Redirected calls go through _redirect_path and the *at()
+// variant of the called function. The only path buffer on the stack of a
+// wrapper is the LOCK_NORMALIZED_MAX buffer in every lock_match, so
+// wrappers need less than 1 KiB on top of glibc. The exceptions are mktemp
+// and mkstemp which need one PATH_MAX buffer for _rewrite_path (PATH_MAX
+// plus less than 1 KiB). tests/stack checks that no intercepted call on a
+// lock path exceeds 8 KiB including glibc.
+bool _rewrite_path(char* destination, size_t size, const struct lock_match* match);
+
+// Identity of a lock file. Inode numbers get reused right after a file was
+// removed, so the birth time is part of it where the file system has one.
+struct lock_file_id {
+  uint64_t dev;
+  uint64_t ino;               // 0 if unknown
+  uint64_t birth;             // Nanoseconds. 0 if not available.
+};
+
+void _get_lock_file_id(const struct lock_target* target, struct lock_file_id* id);
+
+static inline bool _same_lock_file(const struct lock_file_id* a, const struct lock_file_id* b) {
+  return a->ino != 0 && a->dev == b->dev && a->ino == b->ino && a->birth == b->birth;
+}
+
+// Negative lookup cache, see lookup.c
+extern bool _strict_lookups;
+bool _lookup_absent(const struct lock_target* target);
+void _forget_lookup_fds(int first, int last);
+
+// Descriptor table
+// Remembers for directory descriptors if they point to a parent of a lock
+// path (like "/var") or into a lock root. Indexed by descriptor, so looking
+// up the "dirfd" of *at() calls is one load.
+#define FD_TABLE_SIZE 4096
+#define FD_INSIDE_ROOT 0x8000
+
+extern uint16_t _fd_table[FD_TABLE_SIZE];
+
+// Automaton state of the current working directory if it is a parent of a
+// lock path. STATE_DEAD otherwise. Kept up to date by chdir and fchdir,
+// see fdtable.c for the limits.
+extern uint16_t _cwd_state;
+
+// Returns the automaton state to start from for the given path
+static inline unsigned int _get_start_state(int dirfd, const char* path) {
+  if (path[0] == '/')
+    return STATE_START;
+  if (dirfd == AT_FDCWD)
+    return __atomic_load_n(&_cwd_state, __ATOMIC_RELAXED);
+  if (dirfd < 0 || dirfd >= FD_TABLE_SIZE)
+    return STATE_DEAD;
+
+  // Descriptors inside a lock root already point to the redirected target
+  unsigned int state = __atomic_load_n(&_fd_table[dirfd], __ATOMIC_RELAXED);
+  return (state & FD_INSIDE_ROOT) ? STATE_DEAD : state;
+}
+
+bool _check_fd(int fd);
+
+extern unsigned char _lock_path_heads[256];
+
+// First stage of path rewrite as used by the wrappers
+// Matches the given path, which may be relative to "dirfd".
+// Most paths are rejected here without calling into the matcher: Absolute
+// paths by the byte after the leading "/", relative paths by the state of
+// "dirfd".
+static inline const struct lock_prefix* _find_lockpath_prefix(struct lock_match* match, int dirfd, const char* path) {
+  unsigned int state = _get_start_state(dirfd, path);
+  if (state == STATE_DEAD || (path[0] == '/' && !__atomic_load_n(&_lock_path_heads[(unsigned char)path[1]], __ATOMIC_RELAXED))) {
+    match->prefix = NULL;
+    match->state = STATE_DEAD;
+    return NULL;
+  }
+
+  if (!_match_lockpath(match, state, path))
+    return NULL;
+
+  // Descriptors may be closed behind our back (e.g. by fclose or closedir)
+  // and get reused. Verify the descriptor before redirecting relative to it.
+  if (path[0] != '/' && dirfd != AT_FDCWD && !_check_fd(dirfd)) {
+    match->prefix = NULL;
+    return NULL;
+  }
+  LOCKDEV_PROBE3(match, path, match->prefix->path, match->suffix);
+  return match->prefix;
+}
+
+// Forgets a closed descriptor
+static inline void _untrack_fd(int fd) {
+  if (fd >= 0 && fd < FD_TABLE_SIZE && __atomic_load_n(&_fd_table[fd], __ATOMIC_RELAXED))
+    __atomic_store_n(&_fd_table[fd], 0, __ATOMIC_RELAXED);
+}
+
+void _track_fd(int fd, const struct lock_match* match);
+void _untrack_fds(int first, int last);
+void _copy_fd(int fd, int fd2);
+void _set_cwd(const struct lock_match* match);
+void _set_cwd_fd(int fd);
+void _reset_cwd(void);
+
+// Lock table, see locktable.c
+struct lock_table_slot;
+extern bool _lock_table_enabled;
+bool _lock_table_begin_create(const struct lock_target* target, struct lock_table_slot** held);
+void _lock_table_end_create(struct lock_table_slot* slot, const struct lock_target* target, bool success);
+bool _lock_table_begin_remove(const struct lock_target* target, struct lock_table_slot** held);
+void _lock_table_end_remove(struct lock_table_slot* slot, bool success);
+
+// Lock broker client, see broker.c
+extern bool _broker_enabled;
+int _broker_acquire(const struct lock_target* target);
+void _broker_cancel(const struct lock_target* target);
+void _broker_created(const struct lock_target* target);
+bool _broker_remove(const struct lock_target* target, int* result);
+void _forget_broker_fds(int first, int last);
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+// List of all glibc functions we intercept
+// Every entry describes one symbol and which of its arguments are paths.
+// functions.c generates the wrapper from it and symbols.h the slot in the
+// dispatch table. Adding coverage for a new function should only need one
+// line here. Entry kinds:
+//
+//   OPEN(name, params, args, dirfd, path, oflag_extra)
+//     open variant with optional "mode" argument. "oflag_extra" is added to
+//     the open flags of redirected calls.
+//   OPEN2(name, params, args, dirfd, path, oflag_extra)
+//     Fortified open variant without "mode" argument.
+//   PATH(name, ret, params, args, fail, dirfd, path, creates, call)
+//     Function with one path argument. "fail" is returned if the original
+//     function can't be found. "call" is the expression used for redirected
+//     paths. It may use "target" and "match". If "creates" is true, then
+//     a failure with ENOENT re-creates the lock root and retries once.
+//   LOOKUP(name, ret, params, args, fail, dirfd, path, call)
+//     Like PATH for functions which only look up the path (stat, access).
+//     Redirected paths known to be missing fail with ENOENT without a
+//     call, see lookup.c.
+//   PATH2(name, ret, params, args, fail, dirfd1, path1, dirfd2, path2, creates, call)
+//     Function with two path arguments. "call" uses "target1" and
+//     "target2". Paths which are not redirected are passed through there.
+//     "creates" refers to the second path.
+//   CUSTOM(name, ret, params)
+//     Function with a hand-written wrapper in functions.c
+//   INTERNAL(name, ret, params)
+//     Function we only forward to. Not intercepted.
+#define LOCKDEV_WRAPPERS(OPEN, OPEN2, PATH, LOOKUP, PATH2, CUSTOM, INTERNAL) \
+  OPEN(open, (const char* file, int oflag, ...), (file, oflag, mode), AT_FDCWD, file, 0) \
+  OPEN(open64, (const char* file, int oflag, ...), (file, oflag, mode), AT_FDCWD, file, O_LARGEFILE) \
+  OPEN(openat, (int fd, const char* file, int oflag, ...), (fd, file, oflag, mode), fd, file, 0) \
+  OPEN(openat64, (int fd, const char* file, int oflag, ...), (fd, file, oflag, mode), fd, file, O_LARGEFILE) \
+  OPEN2(__open_2, (const char* file, int oflag), (file, oflag), AT_FDCWD, file, 0) \
+  OPEN2(__open64_2, (const char* file, int oflag), (file, oflag), AT_FDCWD, file, O_LARGEFILE) \
+  OPEN2(__openat_2, (int fd, const char* file, int oflag), (fd, file, oflag), fd, file, 0) \
+  OPEN2(__openat64_2, (int fd, const char* file, int oflag), (fd, file, oflag), fd, file, O_LARGEFILE) \
+  PATH(fopen, FILE*, (const char* filename, const char* modes), (filename, modes), NULL, \
+       AT_FDCWD, filename, false, _fopen_at(&target, modes)) \
+  PATH(unlink, int, (const char* name), (name), -1, \
+       AT_FDCWD, name, false, _unlink_at(&target)) \
+  PATH(mktemp, char*, (char* template), (template), (template[0] = '\0', template), \
+       AT_FDCWD, template, false, _mktemp_redirected(orig_func, template, &match)) \
+  LOOKUP(__xstat, int, (int ver, const char* filename, struct stat* stat_buf), (ver, filename, stat_buf), -1, \
+         AT_FDCWD, filename, ORIG(__fxstatat)(ver, target.dirfd, target.path, stat_buf, 0)) \
+  /* Implementations up to this line make rxtx work properly */ \
+  PATH(creat, int, (const char* file, mode_t mode), (file, mode), -1, \
+       AT_FDCWD, file, false, _open_redirected(&target, &match, O_CREAT | O_WRONLY | O_TRUNC, mode)) \
+  PATH2(link, int, (const char* from, const char* to), (from, to), -1, \
+        AT_FDCWD, from, AT_FDCWD, to, true, _link_at(&target1, &target2, redirected2, 0)) \
+  PATH2(rename, int, (const char* old, const char* new), (old, new), -1, \
+        AT_FDCWD, old, AT_FDCWD, new, true, renameat(target1.dirfd, target1.path, target2.dirfd, target2.path)) \
+  /* Implementations up to this line make lockdev work properly */ \
+  PATH(chmod, int, (const char* file, mode_t mode), (file, mode), -1, \
+       AT_FDCWD, file, false, fchmodat(target.dirfd, target.path, mode, 0)) \
+  PATH(scandir, int, (const char* dir, struct dirent*** namelist, int (*selector) (const struct dirent*), int (*cmp) (const struct dirent**, const struct dirent**)), \
+       (dir, namelist, selector, cmp), -1, \
+       AT_FDCWD, dir, false, scandirat(target.dirfd, target.path, namelist, selector, cmp)) \
+  PATH(fopen64, FILE*, (const char* filename, const char* modes), (filename, modes), NULL, \
+       AT_FDCWD, filename, false, _fopen_at(&target, modes)) \
+  PATH(remove, int, (const char* filename), (filename), -1, \
+       AT_FDCWD, filename, false, _remove_at(&target)) \
+  /* Implementations up to this line make MATLAB libmwserialsupport.so work */ \
+  PATH(creat64, int, (const char* file, mode_t mode), (file, mode), -1, \
+       AT_FDCWD, file, false, _open_redirected(&target, &match, O_CREAT | O_WRONLY | O_TRUNC | O_LARGEFILE, mode)) \
+  LOOKUP(stat, int, (const char* file, struct stat* buf), (file, buf), -1, \
+         AT_FDCWD, file, fstatat(target.dirfd, target.path, buf, 0)) \
+  LOOKUP(stat64, int, (const char* file, struct stat64* buf), (file, buf), -1, \
+         AT_FDCWD, file, fstatat64(target.dirfd, target.path, buf, 0)) \
+  LOOKUP(lstat, int, (const char* file, struct stat* buf), (file, buf), -1, \
+         AT_FDCWD, file, fstatat(target.dirfd, target.path, buf, AT_SYMLINK_NOFOLLOW)) \
+  LOOKUP(lstat64, int, (const char* file, struct stat64* buf), (file, buf), -1, \
+         AT_FDCWD, file, fstatat64(target.dirfd, target.path, buf, AT_SYMLINK_NOFOLLOW)) \
+  LOOKUP(__xstat64, int, (int ver, const char* filename, struct stat64* stat_buf), (ver, filename, stat_buf), -1, \
+         AT_FDCWD, filename, ORIG(__fxstatat64)(ver, target.dirfd, target.path, stat_buf, 0)) \
+  LOOKUP(__lxstat, int, (int ver, const char* filename, struct stat* stat_buf), (ver, filename, stat_buf), -1, \
+         AT_FDCWD, filename, ORIG(__fxstatat)(ver, target.dirfd, target.path, stat_buf, AT_SYMLINK_NOFOLLOW)) \
+  LOOKUP(__lxstat64, int, (int ver, const char* filename, struct stat64* stat_buf), (ver, filename, stat_buf), -1, \
+         AT_FDCWD, filename, ORIG(__fxstatat64)(ver, target.dirfd, target.path, stat_buf, AT_SYMLINK_NOFOLLOW)) \
+  LOOKUP(statx, int, (int fd, const char* path, int flags, unsigned int mask, struct statx* buf), (fd, path, flags, mask, buf), -1, \
+         fd, path, statx(target.dirfd, target.path, flags, mask, buf)) \
+  LOOKUP(access, int, (const char* name, int type), (name, type), -1, \
+         AT_FDCWD, name, ORIG(faccessat)(target.dirfd, target.path, type, 0)) \
+  LOOKUP(faccessat, int, (int fd, const char* file, int type, int flag), (fd, file, type, flag), -1, \
+         fd, file, ORIG(faccessat)(target.dirfd, target.path, type, flag)) \
+  PATH(mkdir, int, (const char* path, mode_t mode), (path, mode), -1, \
+       AT_FDCWD, path, true, mkdirat(target.dirfd, target.path, mode)) \
+  PATH(rmdir, int, (const char* path), (path), -1, \
+       AT_FDCWD, path, false, unlinkat(target.dirfd, target.path, AT_REMOVEDIR)) \
+  PATH(mkstemp, int, (char* template), (template), -1, \
+       AT_FDCWD, template, false, _mkstemp_redirected(orig_func, template, &match)) \
+  PATH(mkstemp64, int, (char* template), (template), -1, \
+       AT_FDCWD, template, false, _mkstemp_redirected(orig_func, template, &match)) \
+  PATH(scandir64, int, (const char* dir, struct dirent64*** namelist, int (*selector) (const struct dirent64*), int (*cmp) (const struct dirent64**, const struct dirent64**)), \
+       (dir, namelist, selector, cmp), -1, \
+       AT_FDCWD, dir, false, scandirat64(target.dirfd, target.path, namelist, selector, cmp)) \
+  PATH2(linkat, int, (int fd1, const char* from, int fd2, const char* to, int flags), (fd1, from, fd2, to, flags), -1, \
+        fd1, from, fd2, to, true, _link_at(&target1, &target2, redirected2, flags)) \
+  PATH2(renameat2, int, (int fd1, const char* old, int fd2, const char* new, unsigned int flags), (fd1, old, fd2, new, flags), -1, \
+        fd1, old, fd2, new, true, _rename_at(&target1, &target2, redirected2, flags)) \
+  /* Descriptor and working directory tracking */ \
+  CUSTOM(chdir, int, (const char* path)) \
+  CUSTOM(fchdir, int, (int fd)) \
+  CUSTOM(close, int, (int fd)) \
+  CUSTOM(opendir, DIR*, (const char* name)) \
+  CUSTOM(dup, int, (int fd)) \
+  CUSTOM(dup2, int, (int fd, int fd2)) \
+  CUSTOM(dup3, int, (int fd, int fd2, int flags)) \
+  CUSTOM(close_range, int, (unsigned int fd, unsigned int max_fd, int flags)) \
+  CUSTOM(closefrom, void, (int lowfd)) \
+  CUSTOM(fcntl, int, (int fd, int cmd, ...)) \
+  CUSTOM(fcntl64, int, (int fd, int cmd, ...)) \
+  /* Only forwarded to */ \
+  INTERNAL(__fxstatat, int, (int ver, int fildes, const char* filename, struct stat* stat_buf, int flag)) \
+  INTERNAL(__fxstatat64, int, (int ver, int fildes, const char* filename, struct stat64* stat_buf, int flag))